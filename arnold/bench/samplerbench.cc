@@ -0,0 +1,299 @@
+// ----------------------------------------------------------------------------
+//
+// samplerbench.cc
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+// Micro-benchmark for NbAi::TileSampler4 against the Naiad samplers. Four
+// analytic fields (a sphere distance and a swirl velocity) are stored as
+// voxels in tiles and sampled at random positions two ways: the way
+// naiad_distance_field falls back to Nb, a quadratic lookup of the distance
+// and three cubic lookups of the velocity, and one TileSampler4::sample()
+// filled from those lookups. The bench does not link Naiad, so NaiadField
+// below reproduces the kernels and the per-voxel tile lookups of
+// Nb::sampleFieldQuadratic1f() and Nb::sampleFieldCubic1f(). Returns
+// non-zero if the two differ by more than a voxel.
+//
+// ----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "NbAiFieldBounds.h"
+#include "NbAiTileSampler.h"
+
+
+double wallTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+
+void fields(const float x[3], float v[4])
+{
+    v[0] = std::sqrt(x[0]*x[0] + x[1]*x[1] + x[2]*x[2]) - 1.f;
+    v[1] = -x[1];
+    v[2] = x[0];
+    v[3] = 0.1f * x[2];
+}
+
+
+// NaiadField
+// ----------
+//! One field with its voxels stored per data tile of a FieldBounds, like the
+//! blocks of an Nb::Field1f, and sampled the way the Nb samplers do it:
+//! every voxel the kernel reads looks its tile up. Indices past the grid are
+//! clamped.
+
+class NaiadField
+{
+public:
+    void
+    init(const NbAi::FieldBounds & bounds, const int cells)
+    {
+        _bounds = &bounds;
+        _cells = cells;
+        _h = bounds.tileSize() / cells;
+        for (int k = 0; k < 3; ++k)
+            _res[k] = bounds.dims()[k] * cells;
+        _voxels.assign(size_t(bounds.dataTileCount()) * cells * cells * cells,
+                       0.f);
+    }
+
+    //! Center of voxel (i, j, k) of the grid.
+    void
+    voxelCenter(const int i, const int j, const int k, float x[3]) const
+    {
+        const int c[3] = { i, j, k };
+        for (int a = 0; a < 3; ++a)
+            x[a] = _bounds->origin()[a] + (c[a] + 0.5f) * _h;
+    }
+
+    const int * res() const { return _res; }
+
+    float &
+    voxel(const int i, const int j, const int k)
+    { return _voxels[_index(i, j, k)]; }
+
+    float
+    voxel(const int i, const int j, const int k) const
+    { return _voxels[_index(i, j, k)]; }
+
+    //! Quadratic B-spline over the 3^3 voxels around x.
+    float
+    sampleQuadratic(const float x[3]) const
+    {
+        int c[3];
+        float w[3][3];
+        for (int a = 0; a < 3; ++a) {
+            const float g = (x[a] - _bounds->origin()[a]) / _h - 0.5f;
+            c[a] = static_cast<int>(std::floor(g + 0.5f)) - 1;
+            const float t = g - (c[a] + 1);
+            w[a][0] = 0.5f * (0.5f - t) * (0.5f - t);
+            w[a][1] = 0.75f - t * t;
+            w[a][2] = 0.5f * (0.5f + t) * (0.5f + t);
+        }
+        float sum = 0.f;
+        for (int k = 0; k < 3; ++k)
+            for (int j = 0; j < 3; ++j)
+                for (int i = 0; i < 3; ++i)
+                    sum += w[0][i] * w[1][j] * w[2][k] *
+                        _clamped(c[0] + i, c[1] + j, c[2] + k);
+        return sum;
+    }
+
+    //! Catmull-Rom cubic over the 4^3 voxels around x.
+    float
+    sampleCubic(const float x[3]) const
+    {
+        int c[3];
+        float w[3][4];
+        for (int a = 0; a < 3; ++a) {
+            const float g = (x[a] - _bounds->origin()[a]) / _h - 0.5f;
+            const float f = std::floor(g);
+            c[a] = static_cast<int>(f) - 1;
+            const float t = g - f;
+            const float t2 = t * t;
+            const float t3 = t2 * t;
+            w[a][0] = 0.5f * (-t3 + 2.f * t2 - t);
+            w[a][1] = 0.5f * (3.f * t3 - 5.f * t2 + 2.f);
+            w[a][2] = 0.5f * (-3.f * t3 + 4.f * t2 + t);
+            w[a][3] = 0.5f * (t3 - t2);
+        }
+        float sum = 0.f;
+        for (int k = 0; k < 4; ++k)
+            for (int j = 0; j < 4; ++j)
+                for (int i = 0; i < 4; ++i)
+                    sum += w[0][i] * w[1][j] * w[2][k] *
+                        _clamped(c[0] + i, c[1] + j, c[2] + k);
+        return sum;
+    }
+
+private:
+    size_t
+    _index(const int i, const int j, const int k) const
+    {
+        const int * dims = _bounds->dims();
+        const int tile = ((k / _cells) * dims[1] + j / _cells) * dims[0] +
+            i / _cells;
+        return (size_t(_bounds->dataSlot(tile)) * _cells + k % _cells) *
+            _cells * _cells + (j % _cells) * _cells + i % _cells;
+    }
+
+    float
+    _clamped(const int i, const int j, const int k) const
+    {
+        return voxel(std::max(0, std::min(_res[0] - 1, i)),
+                     std::max(0, std::min(_res[1] - 1, j)),
+                     std::max(0, std::min(_res[2] - 1, k)));
+    }
+
+    const NbAi::FieldBounds * _bounds;
+    int                       _cells;
+    int                       _res[3];
+    float                     _h;
+    std::vector<float>        _voxels;
+};
+
+
+int main(int argc, char* argv[])
+{
+    const int tiles   = argc > 1 ? std::atoi(argv[1]) : 16;
+    const int cells   = argc > 2 ? std::atoi(argv[2]) : 8;
+    const int samples = argc > 3 ? std::atoi(argv[3]) : 1000000;
+
+    std::cerr << "samplerbench: " << tiles << "^3 tiles of " << cells
+              << "^3 cells, " << samples << " samples"
+#ifdef NBAI_TILE_SAMPLER_SSE
+              << ", SSE"
+#endif
+              << "\n";
+
+    // Every tile holds data, so every position takes the full path
+    NbAi::FieldBounds bounds;
+    const float min[3] = { -2.f, -2.f, -2.f };
+    const float max[3] = {  2.f,  2.f,  2.f };
+    bounds.init(min, max, 4.f / tiles, 1, 0.f);
+    for (int t = 0; t < bounds.tileCount(); ++t)
+        bounds.addDataTile(t);
+
+    // Voxels from the analytic fields
+    NaiadField naiad[4];
+    for (int f = 0; f < 4; ++f)
+        naiad[f].init(bounds, cells);
+    const int * res = naiad[0].res();
+    for (int k = 0; k < res[2]; ++k)
+        for (int j = 0; j < res[1]; ++j)
+            for (int i = 0; i < res[0]; ++i) {
+                float x[3], v[4];
+                naiad[0].voxelCenter(i, j, k, x);
+                fields(x, v);
+                for (int f = 0; f < 4; ++f)
+                    naiad[f].voxel(i, j, k) = v[f];
+            }
+
+    // Sampler nodes from the Naiad lookups, as naiad_distance_field fills
+    // them
+    NbAi::TileSampler4 sampler;
+    sampler.init(bounds, cells);
+    for (int t = 0; t < bounds.tileCount(); ++t)
+        for (int k = 0; k <= cells; ++k)
+            for (int j = 0; j <= cells; ++j)
+                for (int i = 0; i <= cells; ++i) {
+                    float x[3];
+                    sampler.nodePosition(t, i, j, k, x);
+                    const float v[4] = { naiad[0].sampleQuadratic(x),
+                                         naiad[1].sampleCubic(x),
+                                         naiad[2].sampleCubic(x),
+                                         naiad[3].sampleCubic(x) };
+                    sampler.set(t, i, j, k, v);
+                }
+
+    std::cerr << "samplerbench: " << sampler.bytes()/(1024*1024)
+              << " MB of nodes\n";
+
+    std::srand(1);
+    std::vector<float> pos(3*samples);
+    for (int p = 0; p < 3*samples; ++p)
+        pos[p] = -1.99f + 3.98f * std::rand() / RAND_MAX;
+
+    // Naiad samplers, four lookups per position
+    std::vector<float> ref(4*samples);
+    double start = wallTime();
+    for (int p = 0; p < samples; ++p) {
+        const float * x = &pos[3*p];
+        ref[4*p] = naiad[0].sampleQuadratic(x);
+        for (int f = 1; f < 4; ++f)
+            ref[4*p + f] = naiad[f].sampleCubic(x);
+    }
+    const double naiadTime = wallTime() - start;
+
+    // One sample() per position
+    std::vector<float> single(4*samples);
+    start = wallTime();
+    int sampled = 0;
+    for (int p = 0; p < samples; ++p)
+        sampled += sampler.sample(&pos[3*p], &single[4*p]);
+    const double singleTime = wallTime() - start;
+
+    // The sampler interpolates the Naiad kernels trilinearly between nodes
+    // a voxel apart, it should stay well within a voxel of them
+    float maxError = 0.f;
+    for (int p = 0; p < samples; ++p)
+        for (int f = 0; f < 4; ++f)
+            maxError = std::max(maxError,
+                                std::fabs(single[4*p + f] - ref[4*p + f]));
+    const float voxelSize = bounds.tileSize() / cells;
+
+    const double ns = 1e9 / samples;
+    std::cerr << "samplerbench: naiad  " << naiadTime * ns
+              << " ns/position\n"
+              << "samplerbench: sample " << singleTime * ns
+              << " ns/position (" << naiadTime / singleTime << "x)\n"
+              << "samplerbench: max difference " << maxError
+              << ", voxel size " << voxelSize << "\n";
+
+    if (sampled != samples || maxError > voxelSize) {
+        std::cerr << "samplerbench: FAILED\n";
+        return 1;
+    }
+    std::cerr << "samplerbench: PASSED\n";
+    return 0;
+}
@@ -0,0 +1,306 @@
+// ----------------------------------------------------------------------------
+//
+// volumebench.cc
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+// Micro-benchmark and check for NbAi::VolumeTiles. A spherical shell of
+// cells is set in the tiles, dilated by a few cells and compared with the
+// same dilation done cell by cell: every cell of the dilated shell must lie
+// in the box of its tile. Random rays are then walked through the tiles by
+// rayExtents() and, as a reference, clipped against the box of every active
+// tile; the intervals of both must agree along the rays. Returns non-zero if
+// they don't.
+//
+// ----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <sys/time.h>
+
+#include "NbAiVolumeTiles.h"
+
+
+double wallTime()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+
+// Collects the intervals of a ray
+struct Intervals
+{
+    void operator()(const float a, const float b)
+    { list.push_back(std::make_pair(a, b)); }
+
+    std::vector<std::pair<float, float> > list;
+};
+
+
+// Clips [ta, tb] to the part of the ray inside [min, max]
+bool slab(const float o[3], const float d[3], const float min[3],
+          const float max[3], float & ta, float & tb)
+{
+    for (int k = 0; k < 3; ++k) {
+        if (d[k] == 0.f) {
+            if (o[k] < min[k] || o[k] > max[k])
+                return false;
+            continue;
+        }
+        float n = (min[k] - o[k]) / d[k];
+        float f = (max[k] - o[k]) / d[k];
+        if (n > f)
+            std::swap(n, f);
+        ta = std::max(ta, n);
+        tb = std::min(tb, f);
+    }
+    return ta <= tb;
+}
+
+
+// Whether t is inside one of the intervals, and how far it is from their
+// ends
+bool inside(const std::vector<std::pair<float, float> > & list,
+            const float t, float & margin)
+{
+    bool in = false;
+    margin = 1e30f;
+    for (size_t i = 0; i < list.size(); ++i) {
+        in = in || (t >= list[i].first && t <= list[i].second);
+        margin = std::min(margin, std::min(std::fabs(t - list[i].first),
+                                           std::fabs(t - list[i].second)));
+    }
+    return in;
+}
+
+
+float random01()
+{
+    return static_cast<float>(std::rand()) / RAND_MAX;
+}
+
+
+int main(int argc, char* argv[])
+{
+    const int tiles = argc > 1 ? std::atoi(argv[1]) : 32;
+    const int cells = argc > 2 ? std::atoi(argv[2]) : 8;
+    const int rays  = argc > 3 ? std::atoi(argv[3]) : 20000;
+    const int halo  = argc > 4 ? std::atoi(argv[4]) : 2;
+
+    std::cerr << "volumebench: " << tiles << "^3 tiles of " << cells
+              << "^3 cells, " << rays << " rays, dilated by " << halo
+              << " cells\n";
+
+    NbAi::VolumeTiles volume;
+    const float min[3] = { -2.f, -2.f, -2.f };
+    const float max[3] = {  2.f,  2.f,  2.f };
+    volume.init(min, max, 4.f / tiles, cells);
+    const int * dims = volume.dims();
+    const int res[3] = { dims[0] * cells, dims[1] * cells, dims[2] * cells };
+    const float h = volume.tileSize() / cells;
+
+    // A shell of cells around the origin, per cell and per tile
+    std::vector<unsigned char> dense(size_t(res[0]) * res[1] * res[2], 0);
+    for (int k = 0; k < res[2]; ++k)
+        for (int j = 0; j < res[1]; ++j)
+            for (int i = 0; i < res[0]; ++i) {
+                const float x = min[0] + (i + 0.5f) * h;
+                const float y = min[1] + (j + 0.5f) * h;
+                const float z = min[2] + (k + 0.5f) * h;
+                const float r = std::sqrt(x*x + y*y + z*z);
+                dense[(size_t(k) * res[1] + j) * res[0] + i] =
+                    std::fabs(r - 1.2f) < 0.1f;
+            }
+    for (int t = 0; t < volume.tileCount(); ++t) {
+        const int tc[3] = { t % dims[0], (t / dims[0]) % dims[1],
+                            t / (dims[0] * dims[1]) };
+        int lo[3] = { cells, cells, cells }, hi[3] = { -1, -1, -1 };
+        for (int c = 0; c < cells; ++c)
+            for (int b = 0; b < cells; ++b)
+                for (int a = 0; a < cells; ++a) {
+                    const int i = tc[0] * cells + a;
+                    const int j = tc[1] * cells + b;
+                    const int k = tc[2] * cells + c;
+                    if (!dense[(size_t(k) * res[1] + j) * res[0] + i])
+                        continue;
+                    const int l[3] = { a, b, c };
+                    for (int d = 0; d < 3; ++d) {
+                        lo[d] = std::min(lo[d], l[d]);
+                        hi[d] = std::max(hi[d], l[d]);
+                    }
+                }
+        if (hi[0] >= 0)
+            volume.setActive(t, lo, hi);
+    }
+
+    double start = wallTime();
+    volume.dilate(halo);
+    const double dilateTime = wallTime() - start;
+    const int activeTiles = volume.countActive();
+
+    // The same dilation cell by cell, one axis at a time
+    for (int axis = 0; axis < 3; ++axis) {
+        const size_t stride = axis == 0 ? 1 : axis == 1 ? res[0] :
+            size_t(res[0]) * res[1];
+        std::vector<unsigned char> grown(dense.size(), 0);
+        for (size_t p = 0; p < dense.size(); ++p) {
+            if (!dense[p])
+                continue;
+            const int c = static_cast<int>(p / stride % res[axis]);
+            for (int o = std::max(0, c - halo);
+                 o <= std::min(res[axis] - 1, c + halo); ++o)
+                grown[p + (o - c) * stride] = 1;
+        }
+        dense.swap(grown);
+    }
+
+    // Every dilated cell must be in the box of its tile
+    int uncovered = 0;
+    for (int k = 0; k < res[2]; ++k)
+        for (int j = 0; j < res[1]; ++j)
+            for (int i = 0; i < res[0]; ++i) {
+                if (!dense[(size_t(k) * res[1] + j) * res[0] + i])
+                    continue;
+                const float x[3] = { min[0] + (i + 0.5f) * h,
+                                     min[1] + (j + 0.5f) * h,
+                                     min[2] + (k + 0.5f) * h };
+                const int t = volume.tileIndex(x);
+                float bmin[3], bmax[3];
+                if (!volume.active(t)) {
+                    ++uncovered;
+                    continue;
+                }
+                volume.activeBounds(t, bmin, bmax);
+                for (int d = 0; d < 3; ++d)
+                    if (x[d] < bmin[d] || x[d] > bmax[d]) {
+                        ++uncovered;
+                        break;
+                    }
+            }
+
+    // Rays from a sphere around the volume through random points in it
+    std::srand(1);
+    std::vector<float> ray(6 * rays);
+    for (int r = 0; r < rays; ++r) {
+        float o[3], d[3], len = 0.f;
+        for (int k = 0; k < 3; ++k) {
+            o[k] = 2.f * random01() - 1.f;
+            len += o[k] * o[k];
+        }
+        len = std::sqrt(std::max(1e-6f, len));
+        for (int k = 0; k < 3; ++k)
+            o[k] *= 4.f / len;
+        len = 0.f;
+        for (int k = 0; k < 3; ++k) {
+            d[k] = 3.f * random01() - 1.5f - o[k];
+            len += d[k] * d[k];
+        }
+        len = std::sqrt(len);
+        for (int k = 0; k < 3; ++k) {
+            ray[6*r + k] = o[k];
+            ray[6*r + 3 + k] = d[k] / len;
+        }
+    }
+    const float t0 = 0.f, t1 = 10.f;
+
+    // rayExtents()
+    std::vector<Intervals> walked(rays);
+    start = wallTime();
+    for (int r = 0; r < rays; ++r)
+        volume.rayExtents(&ray[6*r], &ray[6*r + 3], t0, t1, walked[r]);
+    const double walkTime = wallTime() - start;
+
+    // Every active tile clipped against every ray
+    std::vector<Intervals> clipped(rays);
+    start = wallTime();
+    for (int r = 0; r < rays; ++r)
+        for (int t = 0; t < volume.tileCount(); ++t) {
+            if (!volume.active(t))
+                continue;
+            float bmin[3], bmax[3];
+            volume.activeBounds(t, bmin, bmax);
+            float a = t0, b = t1;
+            if (slab(&ray[6*r], &ray[6*r + 3], bmin, bmax, a, b))
+                clipped[r](a, b);
+        }
+    const double clipTime = wallTime() - start;
+
+    // Both must agree along the rays, away from interval ends. The walked
+    // intervals must come in order without touching.
+    int mismatches = 0, unordered = 0;
+    size_t intervals = 0;
+    const int checked = std::min(rays, 2000);
+    for (int r = 0; r < rays; ++r) {
+        const std::vector<std::pair<float, float> > & list = walked[r].list;
+        intervals += list.size();
+        for (size_t i = 0; i < list.size(); ++i)
+            if (list[i].first > list[i].second ||
+                (i > 0 && list[i].first <= list[i-1].second))
+                ++unordered;
+        if (r >= checked)
+            continue;
+        for (float t = t0; t <= t1; t += 0.25f * h) {
+            float walkMargin, clipMargin;
+            const bool a = inside(list, t, walkMargin);
+            const bool b = inside(clipped[r].list, t, clipMargin);
+            if (a != b && std::min(walkMargin, clipMargin) > 1e-3f * h)
+                ++mismatches;
+        }
+    }
+
+    const double us = 1e6 / rays;
+    std::cerr << "volumebench: " << activeTiles << " active tiles, "
+              << volume.bytes() / 1024 << " KB\n"
+              << "volumebench: dilate " << dilateTime * 1e3 << " ms, "
+              << uncovered << " dilated cells outside their tile box\n"
+              << "volumebench: clip   " << clipTime * us << " us/ray\n"
+              << "volumebench: walk   " << walkTime * us << " us/ray ("
+              << clipTime / walkTime << "x), "
+              << double(intervals) / rays << " intervals/ray\n"
+              << "volumebench: " << mismatches << " mismatches over "
+              << checked << " rays, " << unordered
+              << " intervals out of order\n";
+
+    if (uncovered != 0 || mismatches != 0 || unordered != 0) {
+        std::cerr << "volumebench: FAILED\n";
+        return 1;
+    }
+    std::cerr << "volumebench: PASSED\n";
+    return 0;
+}
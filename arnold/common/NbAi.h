@@ -34,13 +34,23 @@
 //
 // ----------------------------------------------------------------------------
 
+#ifndef NBAI_H_
+#define NBAI_H_
+
 #include <ai.h>
 #include <Ni.h>
 #include <Nb.h>
 #include <NbBody.h>
 #include <NbBlock.h>
 #include <NbFilename.h>
+#include <NbAiIsosurface.h>
+#include <NbAiStats.h>
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <map>
+#include <sstream>
+#include <vector>
 
 namespace NbAi
 {
@@ -81,19 +91,566 @@ minMaxLocal(const Nb::Vec3f & pos, Nb::Vec3f & min, Nb::Vec3f & max)
         max[2] = pos[2];
 }
 // ----------------------------------------------------------------------------
+//! Opens the file to find out. Frames of a sequence are better looked up in
+//! its index, see NbAiSequenceIndex.h.
 bool
 empExists(std::string filename)
 {
     FILE* emp(std::fopen(filename.c_str(),"rb"));
     bool fileExists(emp!=NULL);
-    std::fclose(emp);
+    if (fileExists)
+        std::fclose(emp);
     return fileExists;
 }
 // ----------------------------------------------------------------------------
+inline float
+lengthSquared(const Nb::Vec3f & v)
+{
+    return v[0]*v[0] + v[1]*v[1] + v[2]*v[2];
+}
+// ----------------------------------------------------------------------------
+// Split mode: a body is rendered as one procedural per cluster of tiles. The
+// clusters form a regular grid aligned with the tile layout; a triangle goes
+// to the cluster holding its centroid, a particle to the one holding it.
+// ----------------------------------------------------------------------------
+struct SplitGrid
+{
+    Nb::Vec3f origin;
+    float     size;     //!< edge length of one cluster
+
+    void
+    cellOf(const Nb::Vec3f & p, int cell[3]) const
+    {
+        for (int k = 0; k < 3; ++k)
+            cell[k] = static_cast<int>(std::floor((p[k] - origin[k]) / size));
+    }
+
+    bool
+    inCell(const Nb::Vec3f & p, const int cell[3]) const
+    {
+        int c[3];
+        cellOf(p, c);
+        return c[0] == cell[0] && c[1] == cell[1] && c[2] == cell[2];
+    }
+};
+// ----------------------------------------------------------------------------
+//! One non-empty cluster and the bounds of the geometry assigned to it.
+struct SplitCell
+{
+    int       cell[3];
+    Nb::Vec3f min, max;
+
+    bool operator<(const SplitCell & rhs) const
+    {
+        return std::lexicographical_compare(cell, cell + 3,
+                                            rhs.cell, rhs.cell + 3);
+    }
+};
+// ----------------------------------------------------------------------------
+//! Where particles are kept at ingest: inside a box, inside the camera
+//! frustum, or both, each grown by a padding. The frustum is four planes
+//! in world space, nothing is culled by distance so that far particles
+//! still reach reflections.
+struct CullRegion
+{
+    CullRegion() : useBox(false), planes(0) {}
+
+    //! Keeps what is inside [min - pad, max + pad].
+    void
+    setBox(const Nb::Vec3f & min, const Nb::Vec3f & max, const float pad)
+    {
+        useBox = true;
+        for (int k = 0; k < 3; ++k){
+            boxMin[k] = min[k] - pad;
+            boxMax[k] = max[k] + pad;
+        }
+    }
+
+    //! Keeps what is within pad of the view of a perspective camera looking
+    //! down its -Z axis. camToWorld is an Arnold (row vector) matrix, fov
+    //! the horizontal field of view in degrees.
+    void
+    setFrustum(const AtMatrix camToWorld,
+               const float    fov,
+               const float    aspect,
+               const float    pad)
+    {
+        Nb::Vec3f axis[3], eye(camToWorld[3][0], camToWorld[3][1],
+                               camToWorld[3][2]);
+        for (int a = 0; a < 3; ++a){
+            axis[a] = Nb::Vec3f(camToWorld[a][0], camToWorld[a][1],
+                                camToWorld[a][2]);
+            const float l = std::sqrt(_dot(axis[a], axis[a]));
+            if (l > 0)
+                for (int k = 0; k < 3; ++k)
+                    axis[a][k] /= l;
+        }
+        const float tanX = std::tan(0.5f * fov * 3.14159265f / 180.f);
+        const float tan[2] = { tanX, aspect > 0 ? tanX / aspect : tanX };
+
+        //Side planes n.p <= d, from x +- tan z <= pad in camera space
+        planes = 0;
+        for (int a = 0; a < 2; ++a)
+            for (int s = -1; s <= 1; s += 2){
+                Nb::Vec3f & n = normal[planes];
+                for (int k = 0; k < 3; ++k)
+                    n[k] = s * axis[a][k] + tan[a] * axis[2][k];
+                const float l = std::sqrt(_dot(n, n));
+                for (int k = 0; k < 3; ++k)
+                    n[k] /= l;
+                offset[planes] = _dot(n, eye) + pad;
+                ++planes;
+            }
+    }
+
+    bool empty() const { return !useBox && planes == 0; }
+
+    bool
+    inside(const Nb::Vec3f & p) const
+    {
+        if (useBox)
+            for (int k = 0; k < 3; ++k)
+                if (p[k] < boxMin[k] || p[k] > boxMax[k])
+                    return false;
+        for (int i = 0; i < planes; ++i)
+            if (_dot(normal[i], p) > offset[i])
+                return false;
+        return true;
+    }
+
+    //! -1 if the box [min, max] is entirely culled, 1 if it is entirely
+    //! kept, 0 if its points have to be tested one by one.
+    int
+    classify(const Nb::Vec3f & min, const Nb::Vec3f & max) const
+    {
+        int result = 1;
+        if (useBox)
+            for (int k = 0; k < 3; ++k){
+                if (max[k] < boxMin[k] || min[k] > boxMax[k])
+                    return -1;
+                if (min[k] < boxMin[k] || max[k] > boxMax[k])
+                    result = 0;
+            }
+        for (int i = 0; i < planes; ++i){
+            float lo = 0, hi = 0;
+            for (int k = 0; k < 3; ++k){
+                const float a = normal[i][k] * min[k];
+                const float b = normal[i][k] * max[k];
+                lo += std::min(a, b);
+                hi += std::max(a, b);
+            }
+            if (lo > offset[i])
+                return -1;
+            if (hi > offset[i])
+                result = 0;
+        }
+        return result;
+    }
+
+    bool      useBox;
+    Nb::Vec3f boxMin, boxMax;
+    int       planes;
+    Nb::Vec3f normal[4];
+    float     offset[4];
+
+private:
+    static float
+    _dot(const Nb::Vec3f & a, const Nb::Vec3f & b)
+    { return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+};
+// ----------------------------------------------------------------------------
+//! The cull region of the current Arnold scene: the render camera's
+//! frustum if camera is set, and a box given as "minx miny minz maxx maxy
+//! maxz" unless box is empty, both grown by pad.
+CullRegion
+cullRegion(const bool camera, const Nb::String & box, const float pad)
+{
+    CullRegion region;
+    if (camera){
+        const AtNode * cam = AiUniverseGetCamera();
+        const AtNode * options = AiUniverseGetOptions();
+        if (cam != NULL && options != NULL){
+            AtMatrix m;
+            AiNodeGetMatrix(cam, "matrix", m);
+            const float aspect =
+                static_cast<float>(AiNodeGetInt(options, "xres")) /
+                std::max(1, AiNodeGetInt(options, "yres"));
+            region.setFrustum(m, AiNodeGetFlt(cam, "fov"), aspect, pad);
+        } else {
+            AiMsgWarning("NbAi: no camera to cull particles against");
+        }
+    }
+    if (box.size() > 0){
+        std::stringstream ss(box);
+        Nb::Vec3f min, max;
+        if (ss >> min[0] >> min[1] >> min[2] >> max[0] >> max[1] >> max[2])
+            region.setBox(min, max, pad);
+        else
+            AiMsgWarning("NbAi: cull box \"%s\" is not six numbers",
+                         box.c_str());
+    }
+    return region;
+}
+// ----------------------------------------------------------------------------
+//! Bounds of fine tile t of the layout.
+inline void
+tileBounds(const Nb::TileLayout & layout,
+           const int              t,
+           Nb::Vec3f &            min,
+           Nb::Vec3f &            max)
+{
+    layout.tileBounds(t, min, max);
+}
+// ----------------------------------------------------------------------------
+inline Nb::Vec3f
+centroid(const Nb::Buffer3f & pos, const Nb::Vec3i & tri)
+{
+    return Nb::Vec3f((pos(tri[0])[0] + pos(tri[1])[0] + pos(tri[2])[0]) / 3.f,
+                     (pos(tri[0])[1] + pos(tri[1])[1] + pos(tri[2])[1]) / 3.f,
+                     (pos(tri[0])[2] + pos(tri[1])[2] + pos(tri[2])[2]) / 3.f);
+}
+// ----------------------------------------------------------------------------
+//! The triangles of a mesh binned by split cluster, built in one parallel
+//! pass over the triangles so that the clusters of a body don't each scan
+//! all of them. The clusters of a body share one (see naiad_geo).
+struct SplitBins
+{
+    SplitGrid        grid;
+    int              lo[3];     //!< smallest cluster coordinates
+    int              dim[3];    //!< cluster coordinates spanned
+    std::vector<int> start;     //!< first triangle of each cluster in ids
+    std::vector<int> ids;       //!< triangles, by cluster
+
+    void
+    build(const SplitGrid & g, const Nb::Buffer3f & pos,
+          const Nb::Buffer3i & tris)
+    {
+        grid = g;
+        const int n = tris.size();
+        const int big = std::numeric_limits<int>::max();
+        int hi[3] = { -big, -big, -big };
+        lo[0] = lo[1] = lo[2] = big;
+#pragma omp parallel
+        {
+            int tlo[3] = { big, big, big };
+            int thi[3] = { -big, -big, -big };
+#pragma omp for schedule(static)
+            for (int f = 0; f < n; ++f){
+                int c[3];
+                grid.cellOf(centroid(pos, tris(f)), c);
+                for (int k = 0; k < 3; ++k){
+                    tlo[k] = std::min(tlo[k], c[k]);
+                    thi[k] = std::max(thi[k], c[k]);
+                }
+            }
+#pragma omp critical(NbAiSplitBins)
+            for (int k = 0; k < 3; ++k){
+                lo[k] = std::min(lo[k], tlo[k]);
+                hi[k] = std::max(hi[k], thi[k]);
+            }
+        }
+        for (int k = 0; k < 3; ++k)
+            dim[k] = n > 0 ? hi[k] - lo[k] + 1 : 0;
+
+        //The grid is tile aligned, so the clusters spanned are few
+        const int64_t cells = int64_t(dim[0]) * dim[1] * dim[2];
+        if (cells > int64_t(n) + (1 << 20))
+            NB_THROW("Split clusters span " << dim[0] << "x" << dim[1] << "x"
+                     << dim[2] << " cells, the split size is too small");
+
+        std::vector<int> bin(n);
+#pragma omp parallel for schedule(static)
+        for (int f = 0; f < n; ++f){
+            int c[3];
+            grid.cellOf(centroid(pos, tris(f)), c);
+            bin[f] = index(c);
+        }
+
+        //Counting sort, triangles stay in order within a cluster
+        start.assign(cells + 1, 0);
+        for (int f = 0; f < n; ++f)
+            ++start[bin[f] + 1];
+        for (int64_t i = 0; i < cells; ++i)
+            start[i + 1] += start[i];
+        ids.resize(n);
+        std::vector<int> next(start.begin(), start.end() - 1);
+        for (int f = 0; f < n; ++f)
+            ids[next[bin[f]]++] = f;
+    }
+
+    //! The triangles of cell, false if it holds none.
+    bool
+    find(const int cell[3], const int *& begin, const int *& end) const
+    {
+        for (int k = 0; k < 3; ++k)
+            if (cell[k] < lo[k] || cell[k] >= lo[k] + dim[k])
+                return false;
+        const int i = index(cell);
+        if (start[i] == start[i + 1])
+            return false;
+        begin = &ids[0] + start[i];
+        end = &ids[0] + start[i + 1];
+        return true;
+    }
+
+private:
+    int
+    index(const int c[3]) const
+    {
+        return (c[0] - lo[0]) + dim[0] * ((c[1] - lo[1]) +
+                                          dim[1] * (c[2] - lo[2]));
+    }
+};
+// ----------------------------------------------------------------------------
+//! Copies the selected points (all if ids is NULL).
+inline AtArrayPtr
+pointArray(const Nb::Buffer3f &       pos,
+           const std::vector<int> *   ids)
+{
+    if (ids == NULL)
+        return AiArrayConvert(pos.size(), 1, AI_TYPE_POINT, pos.data, false);
+
+    const int n = static_cast<int>(ids->size());
+    AtArrayPtr array = AiArrayAllocate(n, 1, AI_TYPE_POINT);
+    AtPoint * data = reinterpret_cast<AtPoint *>(array->data);
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i){
+        const int j = (*ids)[i];
+        data[i].x = pos(j)[0];
+        data[i].y = pos(j)[1];
+        data[i].z = pos(j)[2];
+    }
+    return array;
+}
+// ----------------------------------------------------------------------------
+//! Time of motion key k of keys, spread evenly over [0, frametime].
+inline float
+keyTime(const int k, const int keys, const float frametime)
+{
+    return keys > 1 ? frametime * k / (keys - 1) : 0.f;
+}
+// ----------------------------------------------------------------------------
+//! Moves the count points in x along v, and a if given, by time t, writing
+//! the result to key. The arrays hold 3 floats per point.
+inline void
+advectKey(const int64_t  count,
+          const float *  x,
+          const float *  v,
+          const float *  a,
+          const float    t,
+          float *        key)
+{
+    if (a == NULL){
+        for (int64_t i = 0; i < 3 * count; ++i)
+            key[i] = x[i] + t * v[i];
+    } else {
+        const float h = 0.5f * t * t;
+        for (int64_t i = 0; i < 3 * count; ++i)
+            key[i] = x[i] + t * v[i] + h * a[i];
+    }
+}
+// ----------------------------------------------------------------------------
+//! A keys-key point array of the selected points (all if ids is NULL),
+//! key k moved along vel, and acc if given, to keyTime(k, keys, frametime).
+//! Keys are written straight into the array, in parallel over chunks of
+//! points.
+AtArrayPtr
+motionArray(const Nb::Buffer3f &       pos,
+            const std::vector<int> *   ids,
+            const Nb::Buffer3f &       vel,
+            const Nb::Buffer3f *       acc,
+            const float                frametime,
+            const int                  keys)
+{
+    const int64_t n =
+        ids != NULL ? static_cast<int64_t>(ids->size()) : pos.size();
+    AtArrayPtr array = AiArrayAllocate(n, std::max(1, keys), AI_TYPE_POINT);
+    float * data = reinterpret_cast<float *>(array->data);
+    const int64_t chunk = 4096;
+    const int chunks = static_cast<int>((n + chunk - 1) / chunk);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < chunks; ++c){
+        const int64_t begin = c * chunk;
+        const int64_t count = std::min(chunk, n - begin);
+        float * x = data + 3 * begin;
+        std::vector<float> gathered;
+        const float * v;
+        const float * a = NULL;
+        if (ids == NULL){
+            memcpy(x, &pos(begin)[0], count * 3 * sizeof(float));
+            v = &vel(begin)[0];
+            if (acc != NULL)
+                a = &(*acc)(begin)[0];
+        } else {
+            gathered.resize((acc != NULL ? 6 : 3) * count);
+            for (int64_t i = 0; i < count; ++i){
+                const int j = (*ids)[begin + i];
+                for (int k = 0; k < 3; ++k){
+                    x[3*i + k] = pos(j)[k];
+                    gathered[3*i + k] = vel(j)[k];
+                    if (acc != NULL)
+                        gathered[3*(count + i) + k] = (*acc)(j)[k];
+                }
+            }
+            v = &gathered[0];
+            if (acc != NULL)
+                a = &gathered[3*count];
+        }
+        for (int k = 1; k < keys; ++k)
+            advectKey(count, x, v, a, keyTime(k, keys, frametime),
+                      data + 3 * (k * n + begin));
+    }
+    return array;
+}
+// ----------------------------------------------------------------------------
+//! Indexed uvs of the selected triangles (all if faces is NULL): corners
+//! of the same vertex with the same uv share one entry of list. verts holds
+//! the vertex, below nVerts, of each of the 3*nFaces corners. Corners are
+//! bucketed by vertex in linear time, and the few corners of each vertex
+//! compared in parallel.
+void
+indexedUVs(const Nb::Buffer3f &       uBuf,
+           const Nb::Buffer3f &       vBuf,
+           const std::vector<int> *   faces,
+           const int                  nFaces,
+           const AtUInt32 *           verts,
+           const int                  nVerts,
+           std::vector<AtUInt32> &    idxs,
+           std::vector<float> &       list)
+{
+    const int nCorners = 3 * nFaces;
+
+    //The corners of each vertex, after start[vertex]
+    std::vector<int> start(nVerts + 1, 0);
+    for (int c = 0; c < nCorners; ++c)
+        ++start[verts[c] + 1];
+    for (int v = 0; v < nVerts; ++v)
+        start[v + 1] += start[v];
+    std::vector<int> bucket(nCorners);
+    {
+        std::vector<int> fill(start.begin(), start.end() - 1);
+        for (int c = 0; c < nCorners; ++c)
+            bucket[fill[verts[c]]++] = c;
+    }
+
+    //Distinct uvs first in each bucket, idxs relative to the bucket
+    idxs.resize(nCorners);
+    std::vector<int> first(nVerts + 1, 0);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int v = 0; v < nVerts; ++v){
+        int * b = &bucket[0] + start[v];
+        const int n = start[v + 1] - start[v];
+        int distinct = 0;
+        for (int i = 0; i < n; ++i){
+            const int c = b[i];
+            const int f = faces != NULL ? (*faces)[c / 3] : c / 3;
+            const float u = uBuf(f)[c % 3];
+            const float w = vBuf(f)[c % 3];
+            int s = 0;
+            for (; s < distinct; ++s){
+                const int d = b[s];
+                const int g = faces != NULL ? (*faces)[d / 3] : d / 3;
+                if (uBuf(g)[d % 3] == u && vBuf(g)[d % 3] == w)
+                    break;
+            }
+            if (s == distinct)
+                std::swap(b[distinct++], b[i]);
+            idxs[c] = static_cast<AtUInt32>(s);
+        }
+        first[v + 1] = distinct;
+    }
+    for (int v = 0; v < nVerts; ++v)
+        first[v + 1] += first[v];
+
+    list.resize(2 * first[nVerts]);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int v = 0; v < nVerts; ++v){
+        const int * b = &bucket[0] + start[v];
+        for (int i = 0; i < start[v + 1] - start[v]; ++i)
+            idxs[b[i]] += first[v];
+        for (int s = 0; s < first[v + 1] - first[v]; ++s){
+            const int d = b[s];
+            const int g = faces != NULL ? (*faces)[d / 3] : d / 3;
+            list[2 * (first[v] + s)] = uBuf(g)[d % 3];
+            list[2 * (first[v] + s) + 1] = vBuf(g)[d % 3];
+        }
+    }
+}
+// ----------------------------------------------------------------------------
+//! Adds the float and vector point channels listed in userChannels to the
+//! node as varying user data of the same name, for the selected points (all
+//! if ids is NULL).
+void
+meshUserData(AtNode *                 node,
+             const Nb::PointShape &   point,
+             const std::vector<int> * ids,
+             const Nb::String &       userChannels,
+             LoadStats *              stats = NULL)
+{
+    if (userChannels.size() == 0)
+        return;
+    StageTimer timer(stats, StageChannels);
+    for (int ch = 1; ch < point.channelCount(); ++ch){
+        const Nb::String name = point.constChannelBase(ch).name();
+        if (!name.listed_in(userChannels))
+            continue;
+
+        AtArrayPtr array;
+        if (point.constChannelBase(ch).type() == Nb::ValueBase::FloatType){
+            const Nb::Buffer1f & buf(point.constBuffer1f(name));
+            AiNodeDeclare(node, name.c_str(), "varying FLOAT");
+            if (ids == NULL){
+                array = AiArrayConvert(buf.size(), 1, AI_TYPE_FLOAT,
+                                       buf.data, false);
+            } else {
+                const int n = static_cast<int>(ids->size());
+                array = AiArrayAllocate(n, 1, AI_TYPE_FLOAT);
+                float * data = reinterpret_cast<float *>(array->data);
+#pragma omp parallel for schedule(static)
+                for (int i = 0; i < n; ++i)
+                    data[i] = buf((*ids)[i]);
+            }
+        } else if (point.constChannelBase(ch).type() ==
+                   Nb::ValueBase::Vec3fType){
+            const Nb::Buffer3f & buf(point.constBuffer3f(name));
+            AiNodeDeclare(node, name.c_str(), "varying VECTOR");
+            if (ids == NULL){
+                array = AiArrayConvert(buf.size(), 1, AI_TYPE_VECTOR,
+                                       buf.data, false);
+            } else {
+                const int n = static_cast<int>(ids->size());
+                array = AiArrayAllocate(n, 1, AI_TYPE_VECTOR);
+                AtVector * data = reinterpret_cast<AtVector *>(array->data);
+#pragma omp parallel for schedule(static)
+                for (int i = 0; i < n; ++i){
+                    data[i].x = buf((*ids)[i])[0];
+                    data[i].y = buf((*ids)[i])[1];
+                    data[i].z = buf((*ids)[i])[2];
+                }
+            }
+        } else {
+            continue;
+        }
+        if (stats != NULL)
+            stats->addArray(array);
+        AiNodeSetArray(node, name.c_str(), array);
+    }
+}
+// ----------------------------------------------------------------------------
+//! Creates a polymesh from the body. With split bins, only the triangles
+//! of the given cluster are added. Float and vector point channels listed
+//! in userChannels become varying user data of the same name. Load times
+//! and array sizes are added to stats if given.
 AtNode *
 loadMesh(const Nb::Body *     body,
          const float     frametime = 0,
-         const Nb::Body * bodyNext = NULL)
+         const Nb::Body * bodyNext = NULL,
+         const SplitBins * split = NULL,
+         const int * cell = NULL,
+         const Nb::String & userChannels = "",
+         const int motionKeys = 2,
+         LoadStats * stats = NULL)
 {
     //Create the node
     AtNode* node = AiNode("polymesh");
@@ -106,93 +663,146 @@ loadMesh(const Nb::Body *     body,
     const Nb::Buffer3f& posBuf(point.constBuffer3f("position"));
     const Nb::Buffer3i& triIdxBuf(triangle.constBuffer3i("index"));
 
+    //In split mode, the triangles of the cluster and the vertices they use
+    std::vector<int> faceIds, vertIds;
+    const std::vector<int> * faces = NULL;
+    const std::vector<int> * verts = NULL;
+    if (split != NULL){
+        StageTimer timer(stats, StageSelect);
+        const int * begin;
+        const int * end;
+        if (split->find(cell, begin, end))
+            faceIds.assign(begin, end);
+        const int n = static_cast<int>(faceIds.size());
+        vertIds.resize(3 * n);
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; ++i)
+            for (int k = 0; k < 3; ++k)
+                vertIds[3 * i + k] = triIdxBuf(faceIds[i])[k];
+        std::sort(vertIds.begin(), vertIds.end());
+        vertIds.erase(std::unique(vertIds.begin(), vertIds.end()),
+                      vertIds.end());
+        faces = &faceIds;
+        verts = &vertIds;
+#ifndef NDEBUG
+        std::cerr << "NbAi:: Cluster " << cell[0] << " " << cell[1] << " "
+                  << cell[2] << ": " << faceIds.size() << " triangles\n";
+#endif
+    }
+    const int nFaces =
+        faces != NULL ? static_cast<int>(faces->size()) : triIdxBuf.size();
+
     //Store vertex indices (the three vertices that a triangles uses)
-    AtArrayPtr vidxsArray = AiArrayConvert(
-                                           triIdxBuf.size() * 3,
-                                           1,
-                                           AI_TYPE_UINT,
-                                           triIdxBuf.data,
-                                           false
-                                        );
+    AtArrayPtr vidxsArray;
+    std::vector<AtUInt32> vidxs;
+    if (faces == NULL){
+        StageTimer timer(stats, StageArrays);
+        vidxsArray = AiArrayConvert(
+                                    triIdxBuf.size() * 3,
+                                    1,
+                                    AI_TYPE_UINT,
+                                    triIdxBuf.data,
+                                    false
+                                 );
+    } else {
+        StageTimer timer(stats, StageArrays);
+        vidxs.resize(nFaces * 3);
+#pragma omp parallel for schedule(static)
+        for (int i = 0; i < nFaces; ++i)
+            for (int k = 0; k < 3; ++k)
+                vidxs[i * 3 + k] = static_cast<AtUInt32>(
+                    std::lower_bound(verts->begin(), verts->end(),
+                                     triIdxBuf((*faces)[i])[k]) -
+                    verts->begin());
+        vidxsArray = AiArrayConvert(nFaces * 3, 1, AI_TYPE_UINT,
+                                    &vidxs[0], false);
+    }
     AiNodeSetArray(node, "vidxs", vidxsArray);
+    if (stats != NULL){
+        stats->elements += nFaces;
+        stats->addArray(vidxsArray);
+    }
 
     //Check if UV coordinates are available
     if (triangle.hasChannels3f("u") && triangle.hasChannels3f("v")){
+        StageTimer timer(stats, StageChannels);
 #ifndef NDEBUG
         std::cerr << "NbAi:: Found UV channels!\n";
 #endif
         const Nb::Buffer3f& uBuf(triangle.constBuffer3f("u"));
         const Nb::Buffer3f& vBuf(triangle.constBuffer3f("v"));
 
-        //We don't want any vertices to have shared uv coords
-        AtArrayPtr uvidxsArray = AiArrayAllocate(
-                                                 uBuf.size() * 3,
-                                                 1,
-                                                 AI_TYPE_UINT
-                                               );
-        for (int i = 0; i < uBuf.size() * 3; ++ i)
-            AiArraySetUInt(uvidxsArray, i, i);
-        AiNodeSetArray(node, "uvidxs", uvidxsArray);
-
-        AtArrayPtr uvlistArray = AiArrayAllocate(
-                                                 uBuf.size() * 3,
-                                                 1,
-                                                 AI_TYPE_POINT2
-                                               );
-        for (int i = 0; i < uBuf.size(); ++i){
-            Nb::Vec3f u = uBuf(i), v = vBuf(i);
-            for (int j = 0; j < 3 ; ++j){
-                AtPoint2 uv = {u[j], v[j]};
-                AiArraySetPnt2(uvlistArray, i * 3 + j, uv);
+        //Corners of a vertex share its uv, across seams it differs
+        std::vector<AtUInt32> uvidxs;
+        std::vector<float> uvlist;
+        if (faces == NULL)
+            indexedUVs(uBuf, vBuf, faces, nFaces,
+                       reinterpret_cast<const AtUInt32 *>(triIdxBuf.data),
+                       posBuf.size(), uvidxs, uvlist);
+        else if (nFaces > 0)
+            indexedUVs(uBuf, vBuf, faces, nFaces, &vidxs[0],
+                       static_cast<int>(verts->size()), uvidxs, uvlist);
+#ifndef NDEBUG
+        std::cerr << "NbAi:: " << uvlist.size() / 2 << " uvs for "
+                  << uvidxs.size() << " corners\n";
+#endif
+        if (nFaces > 0){
+            AtArrayPtr uvidxsArray = AiArrayConvert(
+                uvidxs.size(), 1, AI_TYPE_UINT, &uvidxs[0], false);
+            AtArrayPtr uvlistArray = AiArrayConvert(
+                uvlist.size() / 2, 1, AI_TYPE_POINT2, &uvlist[0], false);
+            AiNodeSetArray(node, "uvidxs", uvidxsArray);
+            AiNodeSetArray(node, "uvlist", uvlistArray);
+            if (stats != NULL){
+                stats->addArray(uvidxsArray);
+                stats->addArray(uvlistArray);
             }
         }
-        AiNodeSetArray(node, "uvlist", uvlistArray);
     }
 
+    meshUserData(node, point, verts, userChannels, stats);
+
     //Copy Vertex positions
     AtArrayPtr vlistArray = NULL;
+    const int nVerts =
+        verts != NULL ? static_cast<int>(verts->size()) : posBuf.size();
 
     //If no motion blur, frametime is set to 0
     if (frametime == 0.0f){
-        vlistArray = AiArrayConvert(
-                                    posBuf.size(),
-                                    1,
-                                    AI_TYPE_POINT,
-                                    posBuf.data,
-                                    false
-                                 );
+        StageTimer timer(stats, StageArrays);
+        vlistArray = pointArray(posBuf, verts);
 
         AiNodeSetArray(node, "vlist", vlistArray);
+        if (stats != NULL)
+            stats->addArray(vlistArray);
 #ifndef NDEBUG
         std::cerr << body->name() << " : No motion blur! \n";
 #endif
         return node;
     }
-    AtArrayPtr vp0array = AiArrayConvert(
-                                         posBuf.size(),
-                                         1,
-                                         AI_TYPE_POINT,
-                                         posBuf.data,
-                                         false
-                                      );
-    AtArrayPtr vp1array;
-    //If the body has a velocity for each point, we will use it for motion blur.
+    //If the body has a velocity for each point, we will use it for motion
+    //blur, with as many keys as asked for, bent by acceleration if stored
     if (point.hasChannels3f("velocity")){
+        StageTimer timer(stats, StageMotion);
 #ifndef NDEBUG
         std::cerr << body->name() << " has a velocity channel! \n";
 #endif
-
-        //Allocate arrays
-        vp1array = AiArrayAllocate(posBuf.size(), 1, AI_TYPE_POINT);
         const Nb::Buffer3f& velBuf(point.constBuffer3f("velocity"));
-        //Forward euler. x + dx * dt where dt = frametime
-        for (int i = 0; i < velBuf.size(); ++i){
-            AtPoint p1 = {posBuf(i)[0] + velBuf(i)[0] * frametime,
-                    posBuf(i)[1] + velBuf(i)[1] * frametime,
-                    posBuf(i)[2] + velBuf(i)[2] * frametime};
-            AiArraySetPnt(vp1array, i, p1);
-        }
-    } else if (bodyNext != NULL) {
+        const Nb::Buffer3f * accBuf =
+            point.hasChannels3f("acceleration") ?
+            &point.constBuffer3f("acceleration") : NULL;
+        vlistArray = motionArray(posBuf, verts, velBuf, accBuf, frametime,
+                                 std::max(2, motionKeys));
+        AiNodeSetArray(node, "vlist", vlistArray);
+        if (stats != NULL)
+            stats->addArray(vlistArray);
+        return node;
+    }
+
+    StageTimer timer(stats, StageMotion);
+    AtArrayPtr vp0array = pointArray(posBuf, verts);
+    AtArrayPtr vp1array;
+    if (bodyNext != NULL) {
         //Otherwise we will use the body of the next frame
 #ifndef NDEBUG
         std::cerr << body->name() << " motion blur from next frame: " <<
@@ -203,31 +813,118 @@ loadMesh(const Nb::Body *     body,
         const Nb::Buffer3f& posBufNext(
                 bodyNext->constPointShape().constBuffer3f("position")
                 );
-        vp1array = AiArrayConvert(
-                        posBufNext.size(),
-                        1,
-                        AI_TYPE_POINT,
-                        posBufNext.data,
-                        false
-                );
+        vp1array = pointArray(posBufNext, verts);
     } else {
         NB_THROW("Can't set motion key for motion blur." <<
                 " No velocity or no body next frame available.")
     }
 
-    vlistArray = AiArrayAllocate(posBuf.size(), 2, AI_TYPE_POINT);
+    vlistArray = AiArrayAllocate(nVerts, 2, AI_TYPE_POINT);
     AiArraySetKey(vlistArray, 0, vp0array->data);
     AiArraySetKey(vlistArray, 1, vp1array->data);
     AiNodeSetArray(node, "vlist", vlistArray);
+    if (stats != NULL)
+        stats->addArray(vlistArray);
 
     return node;
 }
 // ----------------------------------------------------------------------------
+//! Where the radii of a points node come from: one constant radius, or a
+//! float channel multiplied by radius and clamped to [min, max].
+struct ParticleRadius
+{
+    ParticleRadius(const float r = 0.f)
+        : radius(r), channel(""), min(0.f),
+          max(std::numeric_limits<float>::max())
+    {}
+
+    float
+    value(const float c) const
+    { return std::min(max, std::max(min, radius * c)); }
+
+    //! Largest radius a particle may get
+    float
+    bound() const
+    { return channel.size() > 0 ? max : radius; }
+
+    float      radius;
+    Nb::String channel;
+    float      min;
+    float      max;
+};
+// ----------------------------------------------------------------------------
+//! The particle radius set up on a body by Arnold-Particle.
+ParticleRadius
+particleRadius(const Nb::Body * body, const Nb::TimeBundle & tb)
+{
+    ParticleRadius radius(body->prop1f("radius")->eval(tb));
+    if (body->hasProp("radius-channel")){
+        radius.channel = body->prop1s("radius-channel")->eval(tb);
+        radius.min = body->prop1f("radius-min")->eval(tb);
+        radius.max = body->prop1f("radius-max")->eval(tb);
+    }
+    return radius;
+}
+// ----------------------------------------------------------------------------
+//! Whether Arnold-Particle asked for culling, and its settings.
+bool
+bodyCull(const Nb::Body *       body,
+         const Nb::TimeBundle & tb,
+         bool &                 camera,
+         Nb::String &           box,
+         float &                pad)
+{
+    if (!body->hasProp("cull-camera"))
+        return false;
+    camera = body->prop1i("cull-camera")->eval(tb) != 0;
+    box = body->prop1s("cull-box")->eval(tb);
+    pad = body->prop1f("cull-padding")->eval(tb);
+    return camera || box.size() > 0;
+}
+// ----------------------------------------------------------------------------
+//! The number of motion keys Arnold-Mesh or Arnold-Particle asked for.
+int
+bodyMotionKeys(const Nb::Body * body, const Nb::TimeBundle & tb)
+{
+    if (!body->hasProp("motion-keys"))
+        return 2;
+    return std::max(2, body->prop1i("motion-keys")->eval(tb));
+}
+// ----------------------------------------------------------------------------
+//! The channels Arnold-Mesh or Arnold-Particle export as user data.
+Nb::String
+bodyUserChannels(const Nb::Body * body, const Nb::TimeBundle & tb)
+{
+    if (!body->hasProp("user-channels"))
+        return Nb::String("");
+    return body->prop1s("user-channels")->eval(tb);
+}
+// ----------------------------------------------------------------------------
+//! A particle channel exported as Arnold user data, and where its values go.
+struct ParticleUserData
+{
+    int                      type;
+    const Nb::BlockArray1f * blocks1f;
+    const Nb::BlockArray3f * blocks3f;
+    float *                  data;
+};
+// ----------------------------------------------------------------------------
+//! Creates a points node from the body. With a split grid, only the
+//! particles inside the given cluster are added, with a cull region only
+//! the ones inside it. Float and vector channels listed in userChannels
+//! become uniform user data of the same name. Load times and array sizes
+//! are added to stats if given.
 AtNode*
-loadParticles(const Nb::Body * body,
-              const char *    pMode,
-              const float    radius,
-              const float  frametime = 0)
+loadParticles(const Nb::Body *       body,
+              const char *          pMode,
+              const ParticleRadius & radius,
+              const float  frametime = 0,
+              const SplitGrid * grid = NULL,
+              const int * cell = NULL,
+              const Nb::String & userChannels = "",
+              const int motionKeys = 2,
+              const CullRegion * cull = NULL,
+              LoadStats * stats = NULL)
 {
 
     //Create the node
@@ -238,132 +935,866 @@ loadParticles(const Nb::Body * body,
     const Nb::ParticleShape & particle = body->constParticleShape();
 
     //Total amount of particles
-    const int64_t nParticles = particle.size();
+    int64_t nParticles = particle.size();
 
     //Copy the data from Naiads particle information.
     //Position will always be in channel 0
-    const int sizeOfFloat = sizeof(float);
     const Nb::BlockArray3f& blocksPos = particle.constBlocks3f(0);
     const int bcountPos = blocksPos.block_count();
 
+    //Culling looks at whole tiles first when blocks follow the tiles
+    if (cull != NULL && cull->empty())
+        cull = NULL;
+    const Nb::TileLayout & layout = body->constLayout();
+    const bool tiled = bcountPos == layout.fineTileCount();
+
+    //In split mode or with culling, the particles of each block kept
+    std::vector<std::vector<int> > selected;
+    if (grid != NULL || cull != NULL){
+        StageTimer timer(stats, StageSelect);
+        selected.resize(bcountPos);
+        int64_t culledTiles = 0;
+#pragma omp parallel for schedule(dynamic) reduction(+:culledTiles)
+        for(int b = 0; b < bcountPos; ++b) {
+            const Nb::Block3f& cb = blocksPos(b);
+            int inside = 0;
+            if (cull != NULL && tiled){
+                Nb::Vec3f tileMin, tileMax;
+                tileBounds(layout, b, tileMin, tileMax);
+                inside = cull->classify(tileMin, tileMax);
+                if (inside < 0){
+                    ++culledTiles;
+                    continue;
+                }
+            }
+            //Tiles away from the cluster hold none of its particles
+            if (grid != NULL && tiled){
+                Nb::Vec3f tileMin, tileMax;
+                tileBounds(layout, b, tileMin, tileMax);
+                bool away = false;
+                for (int k = 0; k < 3; ++k){
+                    const float lo = grid->origin[k] + cell[k] * grid->size;
+                    away = away || tileMax[k] < lo ||
+                        tileMin[k] > lo + grid->size;
+                }
+                if (away)
+                    continue;
+            }
+            const bool test = cull != NULL && inside == 0;
+            for (int p(0); p < cb.size(); ++p)
+                if ((grid == NULL || grid->inCell(cb(p), cell)) &&
+                    (!test || cull->inside(cb(p))))
+                    selected[b].push_back(p);
+        }
+        nParticles = 0;
+        for(int b = 0; b < bcountPos; ++b)
+            nParticles += selected[b].size();
+        if (cull != NULL)
+            AiMsgInfo("NbAi: %s keeps %lld of %lld particles, "
+                      "%lld of %d tiles culled whole",
+                      body->name().c_str(),
+                      static_cast<long long>(nParticles),
+                      static_cast<long long>(particle.size()),
+                      static_cast<long long>(culledTiles), bcountPos);
+    }
+
 #ifndef NDEBUG
     std::cerr << "NbAi:: Total amount of particles: "<< nParticles << std::endl;
 #endif
 
-    //Create map for parallel loops later on.
-    int64_t totalOffset = 0;
-    int64_t * offset = new int64_t[bcountPos];
-    offset[0] = 0;
-    for(int b = 0; b < bcountPos-1; ++b) {
-        totalOffset += blocksPos(b).size() * 3  * sizeOfFloat;
-        offset[b + 1] = totalOffset;
+    //Index of the first particle of each block in the Arnold arrays. These
+    //are 64 bit: a billion particles with two motion keys is 6e9 floats.
+    std::vector<int64_t> first(bcountPos + 1, 0);
+    for(int b = 0; b < bcountPos; ++b)
+        first[b + 1] = first[b] +
+            (!selected.empty() ? int64_t(selected[b].size()) :
+             blocksPos(b).size());
+
+    //Motion keys from velocity, bent by acceleration if stored
+    const Nb::BlockArray3f * blocksVel =
+        frametime != 0 ? &particle.constBlocks3f("velocity") : NULL;
+    const Nb::BlockArray3f * blocksAcc =
+        blocksVel != NULL && particle.hasChannels3f("acceleration") ?
+        &particle.constBlocks3f("acceleration") : NULL;
+    const int keys = blocksVel != NULL ? std::max(2, motionKeys) : 1;
+
+    //Radii, from a channel or all the same
+    const Nb::BlockArray1f * blocksRadius = NULL;
+    if (radius.channel.size() > 0){
+        if (particle.hasChannels1f(radius.channel))
+            blocksRadius = &particle.constBlocks1f(radius.channel);
+        else
+            AiMsgWarning("NbAi: %s has no float channel %s, "
+                         "using a constant radius",
+                         body->name().c_str(), radius.channel.c_str());
     }
 
-    AtArrayPtr pointsArray;
-    //No motion blur
-    if (frametime == 0){
-        pointsArray = AiArrayAllocate(nParticles, 1, AI_TYPE_POINT);
-        char * data = reinterpret_cast<char *> (pointsArray->data);
+    AtArrayPtr pointsArray = AiArrayAllocate(nParticles, keys, AI_TYPE_POINT);
+    AtArrayPtr radiusArray = AiArrayAllocate(nParticles, 1, AI_TYPE_FLOAT);
+    float * points = reinterpret_cast<float *> (pointsArray->data);
+    float * radii = reinterpret_cast<float *> (radiusArray->data);
+
+    //User data, allocated up front and filled in the same pass
+    std::vector<ParticleUserData> user;
+    if (userChannels.size() > 0){
+        for(int ch = 1; ch < particle.channelCount(); ++ch) {
+            const Nb::ParticleChannelBase& channel =
+                particle.constChannelBase(ch);
+            if (!channel.name().listed_in(userChannels))
+                continue;
+            ParticleUserData u;
+            u.type = channel.type();
+            u.blocks1f = NULL;
+            u.blocks3f = NULL;
+            AtArrayPtr array;
+            if (u.type == Nb::ValueBase::FloatType){
+                u.blocks1f = &particle.constBlocks1f(ch);
+                AiNodeDeclare(node, channel.name().c_str(), "uniform FLOAT");
+                array = AiArrayAllocate(nParticles, 1, AI_TYPE_FLOAT);
+            } else if (u.type == Nb::ValueBase::Vec3fType){
+                u.blocks3f = &particle.constBlocks3f(ch);
+                AiNodeDeclare(node, channel.name().c_str(), "uniform VECTOR");
+                array = AiArrayAllocate(nParticles, 1, AI_TYPE_VECTOR);
+            } else {
+                continue;
+            }
+            u.data = reinterpret_cast<float *> (array->data);
+            AiNodeSetArray(node, channel.name().c_str(), array);
+            if (stats != NULL)
+                stats->addArray(array);
+            user.push_back(u);
+        }
+    }
 
 #ifndef NDEBUG
-        std::cerr << "NbAi:: Copying particle data (no motion blur)...\n";
+    std::cerr << "NbAi:: Copying particle data ("
+              << keys << " motion keys, "
+              << user.size() << " user channels)...\n";
 #endif
 
-#pragma omp parallel for schedule(dynamic)
-        for(int b = 0; b < bcountPos; ++b) {
-            const Nb::Block3f& cb = blocksPos(b);
-            const int bufferSize = cb.size() * 3  * sizeOfFloat;
-            if(cb.size()==0) continue;
-            memcpy(
-                    data + offset[b],
-                    (char *) cb.data(),
-                    bufferSize
-                );
+    //One pass over the blocks for every channel, with the thread time of
+    //each stage if asked for
+    double cpuArrays = 0, cpuMotion = 0, cpuChannels = 0;
+    const double passStart = stats != NULL ? wallTime() : 0;
+#pragma omp parallel for schedule(dynamic) \
+    reduction(+:cpuArrays, cpuMotion, cpuChannels)
+    for(int b = 0; b < bcountPos; ++b) {
+        const int64_t count = first[b + 1] - first[b];
+        if (count == 0)
+            continue;
+        double lap = stats != NULL ? wallTime() : 0;
+        const Nb::Block3f& cb = blocksPos(b);
+        const int * sel = !selected.empty() ? &selected[b][0] : NULL;
+
+        //Positions, a straight copy unless split
+        float * pos = points + 3 * first[b];
+        if (sel == NULL){
+            memcpy(pos, cb.data(), count * 3 * sizeof(float));
+        } else {
+            for (int64_t i(0); i < count; ++i){
+                const Nb::Vec3f & x = cb(sel[i]);
+                pos[3*i] = x[0];
+                pos[3*i + 1] = x[1];
+                pos[3*i + 2] = x[2];
+            }
         }
+        if (stats != NULL)
+            cpuArrays += lapTime(lap);
 
-        AiNodeSetArray(node, "points", pointsArray);
-#ifndef NDEBUG
-        std::cerr<< "NbAi:: Copy done.\n";
-#endif
-    } else {
-        pointsArray = AiArrayAllocate(nParticles, 2, AI_TYPE_POINT);
-        char * data = reinterpret_cast<char *> (pointsArray->data);
+        //Motion keys, written into the key array directly
+        if (blocksVel != NULL){
+            const Nb::Block3f& vb = (*blocksVel)(b);
+            std::vector<float> gathered;
+            const float * v = &vb(0)[0];
+            const float * a = blocksAcc != NULL ? &(*blocksAcc)(b)(0)[0] : NULL;
+            if (sel != NULL){
+                gathered.resize((a != NULL ? 6 : 3) * count);
+                for (int64_t i(0); i < count; ++i)
+                    for (int k = 0; k < 3; ++k){
+                        gathered[3*i + k] = vb(sel[i])[k];
+                        if (a != NULL)
+                            gathered[3*(count + i) + k] =
+                                (*blocksAcc)(b)(sel[i])[k];
+                    }
+                v = &gathered[0];
+                if (a != NULL)
+                    a = &gathered[3*count];
+            }
+            for (int k = 1; k < keys; ++k)
+                advectKey(count, pos, v, a, keyTime(k, keys, frametime),
+                          points + 3 * (k * nParticles + first[b]));
+        }
+        if (stats != NULL)
+            cpuMotion += lapTime(lap);
 
-        //Velocities
-        const Nb::BlockArray3f& blocksVel = particle.constBlocks3f("velocity");
-        const int halfBuffer = nParticles * sizeOfFloat * 3;
+        //Radii
+        float * rad = radii + first[b];
+        if (blocksRadius == NULL){
+            std::fill(rad, rad + count, radius.radius);
+        } else {
+            const Nb::Block1f& rb = (*blocksRadius)(b);
+            for (int64_t i(0); i < count; ++i)
+                rad[i] = radius.value(rb(sel != NULL ? sel[i] : i));
+        }
 
+        //User data
+        for (size_t c = 0; c < user.size(); ++c){
+            if (user[c].blocks1f != NULL){
+                const Nb::Block1f& ub = (*user[c].blocks1f)(b);
+                float * dst = user[c].data + first[b];
+                for (int64_t i(0); i < count; ++i)
+                    dst[i] = ub(sel != NULL ? sel[i] : i);
+            } else {
+                const Nb::Block3f& ub = (*user[c].blocks3f)(b);
+                float * dst = user[c].data + 3 * first[b];
+                for (int64_t i(0); i < count; ++i){
+                    const Nb::Vec3f & v = ub(sel != NULL ? sel[i] : i);
+                    dst[3*i] = v[0];
+                    dst[3*i + 1] = v[1];
+                    dst[3*i + 2] = v[2];
+                }
+            }
+        }
+        if (stats != NULL)
+            cpuChannels += lapTime(lap);
+    }
+
+    AiNodeSetArray(node, "points", pointsArray);
+    AiNodeSetArray(node, "radius", radiusArray);
+    if (stats != NULL){
+        double cpu[StageCount] = {0};
+        cpu[StageArrays] = cpuArrays;
+        cpu[StageMotion] = cpuMotion;
+        cpu[StageChannels] = cpuChannels;
+        stats->addPass(wallTime() - passStart, cpu);
+        stats->elements += nParticles;
+        stats->addArray(pointsArray);
+        stats->addArray(radiusArray);
+    }
 #ifndef NDEBUG
-        std::cerr << "NbAi:: Copying particle data (motion blur)...\n";
+    std::cerr<< "NbAi:: Copy done.\n";
 #endif
 
+    return node;
+}
+// ----------------------------------------------------------------------------
+//! Whether Arnold-Implicit asked for the body to be rendered as a mesh, and
+//! of which surface: where the distance channel equals threshold - level,
+//! as the implicit node sees it.
+bool
+bodyImplicitMesh(const Nb::Body *       body,
+                 const Nb::TimeBundle & tb,
+                 Nb::String &           channel,
+                 float &                iso)
+{
+    if (!body->hasProp("mesh") || body->prop1i("mesh")->eval(tb) == 0)
+        return false;
+    channel = body->prop1s("channel")->eval(tb);
+    iso = body->prop1f("threshold")->eval(tb) -
+        body->prop1f("level")->eval(tb);
+    return true;
+}
+// ----------------------------------------------------------------------------
+//! Creates a polymesh of the surface where the distance channel of a field
+//! body equals iso, with normals from the distance gradient. Tiles are
+//! meshed in parallel on a lattice of the field's voxels; tiles the surface
+//! can't reach are skipped without sampling them. The lattice nodes are
+//! numbered over the whole field, so the points neighbouring tiles make on
+//! the faces they share are welded and the mesh is connected across tiles.
+//! With a frametime, the points are moved along the velocity field for
+//! motion blur. Load times and array sizes are added to stats if given.
+AtNode *
+loadIsosurface(const Nb::Body *   body,
+               const Nb::String & channel,
+               const float        iso,
+               const float        frametime = 0,
+               const int          motionKeys = 2,
+               LoadStats *        stats = NULL)
+{
+    AtNode* node = AiNode("polymesh");
+
+    const Nb::TileLayout & layout = body->constLayout();
+    const Nb::FieldShape & field = body->constFieldShape();
+    const Nb::Field1f & distance = field.constField1f(channel);
+    const int tileCount = layout.fineTileCount();
+    if (tileCount == 0)
+        return node;
+
+    Nb::Vec3f tileMin, tileMax, gridMin, gridMax;
+    layout.tileBounds(0, tileMin, tileMax);
+    layout.allTileBounds(gridMin, gridMax);
+    const float tileSize = tileMax[0] - tileMin[0];
+    const int n = std::max(1, static_cast<int>(
+        tileSize / layout.cellSize() + 0.5f));
+    const int m = n + 1;
+    const float h = tileSize / n;
+    int64_t lattice[3];
+    for (int k = 0; k < 3; ++k)
+        lattice[k] = static_cast<int64_t>(
+            (gridMax[k] - gridMin[k]) / h + 0.5f) + 1;
+
+    //Further than this from the center of a tile, the surface can't be in
+    //it, as long as the distance doesn't change faster than the position
+    const float reach = 0.5f * std::sqrt(3.f) * tileSize + h;
+
+    //Tiles sample the nodes they share at the same positions, from the
+    //lattice coordinates of their first node
+    std::vector<TileMesh> meshes(tileCount);
+    std::vector<int> tileNode(3 * tileCount);
+    {
+        StageTimer timer(stats, StageMesh);
 #pragma omp parallel for schedule(dynamic)
-        for(int b = 0; b < bcountPos; ++b) {
-            //std::cerr << "b: " << b << std::endl;
-            const Nb::Block3f& cb = blocksPos(b);
-            const int bufferSize = cb.size() * 3  * sizeOfFloat;
-            if(cb.size()==0) continue;
-            memcpy(
-                   data + offset[b],
-                   (char *) cb.data(),
-                   bufferSize
-                 );
-
-            //Velocity block
-            const Nb::Block3f& vb = blocksVel(b);
-
-            for (int p(0); p < cb.size(); ++p){
-                float vel[3] = {  cb(p)[0] +  frametime * vb(p)[0]
-                                , cb(p)[1] +  frametime * vb(p)[1]
-                                , cb(p)[2] +  frametime * vb(p)[2]};
-                memcpy(
-                       data + offset[b] + halfBuffer + p * 3 * sizeOfFloat,
-                       reinterpret_cast<char *> (vel),
-                       3 * sizeOfFloat
-                     );
-            }
+        for (int t = 0; t < tileCount; ++t){
+            Nb::Vec3f o, end;
+            layout.tileBounds(t, o, end);
+            int * base = &tileNode[3 * t];
+            for (int k = 0; k < 3; ++k)
+                base[k] = static_cast<int>((o[k] - gridMin[k]) / h + 0.5f);
+            const Nb::Vec3f center(0.5f * (o[0] + end[0]),
+                                   0.5f * (o[1] + end[1]),
+                                   0.5f * (o[2] + end[2]));
+            if (std::fabs(Nb::sampleFieldQuadratic1f(center, layout,
+                                                     distance) - iso) > reach)
+                continue;
+
+            std::vector<float> d(m * m * m);
+            for (int k = 0; k < m; ++k)
+                for (int j = 0; j < m; ++j)
+                    for (int i = 0; i < m; ++i)
+                        d[(k * m + j) * m + i] = Nb::sampleFieldQuadratic1f(
+                            Nb::Vec3f(gridMin[0] + (base[0] + i) * h,
+                                      gridMin[1] + (base[1] + j) * h,
+                                      gridMin[2] + (base[2] + k) * h),
+                            layout, distance);
 
+            const float origin[3] = { gridMin[0] + base[0] * h,
+                                      gridMin[1] + base[1] * h,
+                                      gridMin[2] + base[2] * h };
+            LatticePolygonizer polygonizer;
+            polygonizer.polygonize(&d[0], n, origin, h, iso, meshes[t]);
         }
+    }
+
+    std::vector<int> firstRaw(tileCount + 1, 0);
+    std::vector<int> firstTriangle(tileCount + 1, 0);
+    for (int t = 0; t < tileCount; ++t){
+        firstRaw[t + 1] = firstRaw[t] + meshes[t].pointCount();
+        firstTriangle[t + 1] = firstTriangle[t] + meshes[t].triangleCount();
+    }
+    const int nRaw = firstRaw[tileCount];
+    const int nTriangles = firstTriangle[tileCount];
+
+    //Points on the lattice edges of a tile's faces, by global edge key. Of
+    //the points neighbouring tiles make on the same edge, the one of the
+    //first tile is kept and the others welded to it.
+    std::vector<std::pair<int64_t, int> > faceEdges;
+#pragma omp parallel
+    {
+        std::vector<std::pair<int64_t, int> > local;
+#pragma omp for schedule(dynamic)
+        for (int t = 0; t < tileCount; ++t){
+            const TileMesh & mesh = meshes[t];
+            const int * base = &tileNode[3 * t];
+            for (int p = 0; p < mesh.pointCount(); ++p){
+                const int node = mesh.edges[p] / 7;
+                const int dir = mesh.edges[p] % 7 + 1;
+                const int c[3] = { node % m, node / m % m, node / (m * m) };
+                bool face = false;
+                for (int k = 0; k < 3; ++k)
+                    face = face ||
+                        (!(dir >> k & 1) && (c[k] == 0 || c[k] == n));
+                if (!face)
+                    continue;
+                const int64_t key = (((base[2] + c[2]) * lattice[1] +
+                                      base[1] + c[1]) * lattice[0] +
+                                     base[0] + c[0]) * 7 + dir - 1;
+                local.push_back(std::make_pair(key, firstRaw[t] + p));
+            }
+        }
+#pragma omp critical(NbAiIsosurfaceWeld)
+        faceEdges.insert(faceEdges.end(), local.begin(), local.end());
+    }
+    std::sort(faceEdges.begin(), faceEdges.end());
+    std::vector<int> weldTo(nRaw, -1);
+    for (size_t e = 1; e < faceEdges.size(); ++e)
+        if (faceEdges[e].first == faceEdges[e - 1].first)
+            weldTo[faceEdges[e].second] = weldTo[faceEdges[e - 1].second] >= 0 ?
+                weldTo[faceEdges[e - 1].second] : faceEdges[e - 1].second;
+    std::vector<std::pair<int64_t, int> >().swap(faceEdges);
+
+    //Points kept per tile, in order, and the final index of every point
+    std::vector<int> firstPoint(tileCount + 1, 0);
+    for (int t = 0; t < tileCount; ++t){
+        int kept = 0;
+        for (int p = firstRaw[t]; p < firstRaw[t + 1]; ++p)
+            kept += weldTo[p] < 0;
+        firstPoint[t + 1] = firstPoint[t] + kept;
+    }
+    const int nPoints = firstPoint[tileCount];
+    std::vector<int> pointIndex(nRaw);
+    for (int t = 0, next = 0; t < tileCount; ++t)
+        for (int p = firstRaw[t]; p < firstRaw[t + 1]; ++p)
+            if (weldTo[p] < 0)
+                pointIndex[p] = next++;
+    for (int p = 0; p < nRaw; ++p)
+        if (weldTo[p] >= 0)
+            pointIndex[p] = pointIndex[weldTo[p]];
 
-        AiNodeSetArray(node, "points", pointsArray);
 #ifndef NDEBUG
-        std::cerr<< "NbAi:: Copy done.\n";
+    std::cerr << "NbAi:: " << body->name() << " iso-surface: " << nPoints
+              << " points (" << nRaw - nPoints << " welded), " << nTriangles
+              << " triangles\n";
 #endif
+
+    //Motion keys from the velocity field
+    const Nb::Field1f * velocity[3] = { NULL, NULL, NULL };
+    if (frametime != 0 && field.hasChannels3f("velocity"))
+        for (int k = 0; k < 3; ++k)
+            velocity[k] = &field.constField3f("velocity", k);
+    const int keys = velocity[0] != NULL ? std::max(2, motionKeys) : 1;
+
+    AtArrayPtr vlistArray = AiArrayAllocate(nPoints, keys, AI_TYPE_POINT);
+    AtArrayPtr nlistArray = AiArrayAllocate(nPoints, 1, AI_TYPE_VECTOR);
+    AtArrayPtr vidxsArray = AiArrayAllocate(nTriangles * 3, 1, AI_TYPE_UINT);
+    AtArrayPtr nidxsArray = AiArrayAllocate(nTriangles * 3, 1, AI_TYPE_UINT);
+    float * points = reinterpret_cast<float *>(vlistArray->data);
+    float * normals = reinterpret_cast<float *>(nlistArray->data);
+    AtUInt32 * vidxs = reinterpret_cast<AtUInt32 *>(vidxsArray->data);
+    AtUInt32 * nidxs = reinterpret_cast<AtUInt32 *>(nidxsArray->data);
+
+    //One pass over the tiles for every array, with the thread time of each
+    //stage if asked for
+    double cpuArrays = 0, cpuMotion = 0, cpuChannels = 0;
+    const double passStart = stats != NULL ? wallTime() : 0;
+#pragma omp parallel for schedule(dynamic) \
+    reduction(+:cpuArrays, cpuMotion, cpuChannels)
+    for (int t = 0; t < tileCount; ++t){
+        const TileMesh & mesh = meshes[t];
+        const int count = firstPoint[t + 1] - firstPoint[t];
+        if (mesh.pointCount() == 0)
+            continue;
+        double lap = stats != NULL ? wallTime() : 0;
+
+        float * x = points + 3 * firstPoint[t];
+        for (int p = 0, q = 0; p < mesh.pointCount(); ++p)
+            if (weldTo[firstRaw[t] + p] < 0){
+                memcpy(x + 3 * q, &mesh.points[3 * p], 3 * sizeof(float));
+                ++q;
+            }
+        const int corners = 3 * mesh.triangleCount();
+        for (int i = 0; i < corners; ++i)
+            vidxs[3 * firstTriangle[t] + i] = nidxs[3 * firstTriangle[t] + i] =
+                static_cast<AtUInt32>(
+                    pointIndex[firstRaw[t] + mesh.triangles[i]]);
+        if (stats != NULL)
+            cpuArrays += lapTime(lap);
+
+        //Normals, the distance gradient by central differences
+        float * nrm = normals + 3 * firstPoint[t];
+        const float e = 0.5f * h;
+        for (int p = 0; p < count; ++p){
+            const Nb::Vec3f c(x[3*p], x[3*p + 1], x[3*p + 2]);
+            float g[3];
+            for (int k = 0; k < 3; ++k){
+                Nb::Vec3f a(c), b(c);
+                a[k] += e;
+                b[k] -= e;
+                g[k] = Nb::sampleFieldQuadratic1f(a, layout, distance) -
+                    Nb::sampleFieldQuadratic1f(b, layout, distance);
+            }
+            const float len = std::sqrt(g[0]*g[0] + g[1]*g[1] + g[2]*g[2]);
+            for (int k = 0; k < 3; ++k)
+                nrm[3*p + k] = len > 0 ? g[k] / len : 0.f;
+        }
+        if (stats != NULL)
+            cpuChannels += lapTime(lap);
+
+        if (velocity[0] != NULL){
+            std::vector<float> v(3 * count);
+            for (int p = 0; p < count; ++p){
+                const Nb::Vec3f c(x[3*p], x[3*p + 1], x[3*p + 2]);
+                for (int k = 0; k < 3; ++k)
+                    v[3*p + k] =
+                        Nb::sampleFieldCubic1f(c, layout, *velocity[k]);
+            }
+            for (int k = 1; k < keys; ++k)
+                advectKey(count, x, &v[0], NULL, keyTime(k, keys, frametime),
+                          points + 3 * (k * int64_t(nPoints) + firstPoint[t]));
+            if (stats != NULL)
+                cpuMotion += lapTime(lap);
+        }
     }
-    delete[] offset;
 
-    //All particles have the same radius
-    //(maybe add static randomness in the future?)
-    AtArrayPtr radiusArray = AiArrayAllocate(nParticles, 1, AI_TYPE_FLOAT);
-    for (int i = 0; i < nParticles; ++ i)
-        AiArraySetFlt(radiusArray, i, radius);
-    AiNodeSetArray(node, "radius", radiusArray);
+    AiNodeSetArray(node, "vidxs", vidxsArray);
+    AiNodeSetArray(node, "vlist", vlistArray);
+    AiNodeSetArray(node, "nidxs", nidxsArray);
+    AiNodeSetArray(node, "nlist", nlistArray);
+    AiNodeSetBool(node, "smoothing", true);
+
+    if (stats != NULL){
+        double cpu[StageCount] = {0};
+        cpu[StageArrays] = cpuArrays;
+        cpu[StageMotion] = cpuMotion;
+        cpu[StageChannels] = cpuChannels;
+        stats->addPass(wallTime() - passStart, cpu);
+        stats->elements += nTriangles;
+        stats->addArray(vidxsArray);
+        stats->addArray(vlistArray);
+        stats->addArray(nidxsArray);
+        stats->addArray(nlistArray);
+    }
 
     return node;
 }
 // ----------------------------------------------------------------------------
-void computeMinMax(const Nb::Body * body, Nb::Vec3f & min, Nb::Vec3f & max)
+//! Bounds computed by computeMinMax(), per body and exactness. Bodies are
+//! told apart by address, so a cache must not outlive the bodies it has
+//! seen: NbAi::Output keeps one for the bodies of the step it writes.
+class BoundsCache
+{
+public:
+    BoundsCache()
+    { AiCritSecInit(&_lock); }
+
+    ~BoundsCache()
+    { AiCritSecClose(&_lock); }
+
+    bool
+    find(const Nb::Body * body, const bool exact,
+         Nb::Vec3f & min, Nb::Vec3f & max) const
+    {
+        AiCritSecEnter(&_lock);
+        const Map::const_iterator it = _bounds.find(Key(body, exact));
+        const bool found = it != _bounds.end();
+        if (found){
+            min = it->second.first;
+            max = it->second.second;
+        }
+        AiCritSecLeave(&_lock);
+        return found;
+    }
+
+    void
+    insert(const Nb::Body * body, const bool exact,
+           const Nb::Vec3f & min, const Nb::Vec3f & max)
+    {
+        AiCritSecEnter(&_lock);
+        _bounds[Key(body, exact)] = std::make_pair(min, max);
+        AiCritSecLeave(&_lock);
+    }
+
+private:
+    BoundsCache(const BoundsCache &);
+    BoundsCache & operator=(const BoundsCache &);
+
+    typedef std::pair<const Nb::Body *, bool>                Key;
+    typedef std::map<Key, std::pair<Nb::Vec3f, Nb::Vec3f> > Map;
+
+    Map               _bounds;
+    mutable AtCritSec _lock;
+};
+// ----------------------------------------------------------------------------
+//! Bounds of positions(j) for j in [begin, end), a parallel reduction.
+template <class Positions> void
+reduceMinMax(const Positions & positions,
+             const int64_t     begin,
+             const int64_t     end,
+             Nb::Vec3f &       min,
+             Nb::Vec3f &       max)
 {
+#pragma omp parallel
+    {
+        Nb::Vec3f localMin(min[0], min[1], min[2]);
+        Nb::Vec3f localMax(max[0], max[1], max[2]);
+#pragma omp for schedule(static)
+        for (int64_t j = begin; j < end; ++j)
+            minMaxLocal(positions(j), localMin, localMax);
+#pragma omp critical(nbai_minmax)
+        {
+            minMaxLocal(localMin, min, max);
+            minMaxLocal(localMax, min, max);
+        }
+    }
+}
+// ----------------------------------------------------------------------------
+//! Bounds of the positions of a mesh or particle body. Unless exact is set,
+//! particle bodies whose blocks follow the tile layout are bounded by the
+//! tiles holding particles, padded by a voxel, which only visits the tiles.
+//! Otherwise every position is visited, in parallel. With a cache, bodies
+//! expanded into several procedurals are only scanned once.
+void computeMinMax(const Nb::Body * body, Nb::Vec3f & min, Nb::Vec3f & max,
+                   const bool exact = true, BoundsCache * cache = NULL)
+{
+    if (cache != NULL && cache->find(body, exact, min, max))
+        return;
+
     min[0] = min[1] = min[2] = std::numeric_limits<float>::max();
-    max[0] = max[1] = max[2] = std::numeric_limits<float>::min();
+    max[0] = max[1] = max[2] = -std::numeric_limits<float>::max();
+
     //Evaluate bodies
     if(body->matches("Mesh")){
         //todo this can be improved by use bounding box of motion blur too
         const Nb::PointShape& point = body->constPointShape();
         const Nb::Buffer3f& posBuf(point.constBuffer3f("position"));
-        for (int j = 0; j < posBuf.size(); ++j)
-            minMaxLocal(posBuf(j),min,max);
+        reduceMinMax(posBuf, 0, posBuf.size(), min, max);
     }
     else if (body->matches("Particle")){
         const Nb::ParticleShape & particle = body->constParticleShape();
         const Nb::BlockArray3f& blocksPos=particle.constBlocks3f(0);
         const int bcountPos=blocksPos.block_count();
-        for(int b=0; b<bcountPos; ++b) {
-            const Nb::Block3f& cb = blocksPos(b);
-            for(int64_t p(0); p<cb.size(); ++p)
-                minMaxLocal(cb(p),min,max);
+        const Nb::TileLayout & layout = body->constLayout();
+        if (!exact && bcountPos == layout.fineTileCount()){
+            Nb::Vec3f tileMin, tileMax;
+            for(int b=0; b<bcountPos; ++b) {
+                if (blocksPos(b).size() == 0)
+                    continue;
+                tileBounds(layout, b, tileMin, tileMax);
+                minMaxLocal(tileMin, min, max);
+                minMaxLocal(tileMax, min, max);
+            }
+            const float pad = layout.cellSize();
+            for (int k = 0; k < 3; ++k){
+                min[k] -= pad;
+                max[k] += pad;
+            }
+        } else {
+#pragma omp parallel
+            {
+                Nb::Vec3f localMin(min[0], min[1], min[2]);
+                Nb::Vec3f localMax(max[0], max[1], max[2]);
+#pragma omp for schedule(dynamic)
+                for(int b=0; b<bcountPos; ++b) {
+                    const Nb::Block3f& cb = blocksPos(b);
+                    for(int64_t p(0); p<cb.size(); ++p)
+                        minMaxLocal(cb(p), localMin, localMax);
+                }
+#pragma omp critical(nbai_minmax)
+                {
+                    minMaxLocal(localMin, min, max);
+                    minMaxLocal(localMax, min, max);
+                }
+            }
         }
     }
+
+    if (cache != NULL)
+        cache->insert(body, exact, min, max);
+}
+
+// ----------------------------------------------------------------------------
+//! The cluster grid of a body in split mode: clusters of tilesPerCluster^3
+//! fine tiles. Bodies without tiles are cut in about 4 clusters per axis.
+SplitGrid
+splitGrid(const Nb::Body * body, const int tilesPerCluster,
+          BoundsCache * cache = NULL)
+{
+    SplitGrid grid;
+    const Nb::TileLayout & layout = body->constLayout();
+    if (layout.fineTileCount() > 0){
+        Nb::Vec3f tileMin, tileMax, max;
+        tileBounds(layout, 0, tileMin, tileMax);
+        layout.allTileBounds(grid.origin, max);
+        grid.size = (tileMax[0] - tileMin[0]) * std::max(1, tilesPerCluster);
+    } else {
+        Nb::Vec3f max;
+        computeMinMax(body, grid.origin, max, true, cache);
+        grid.size = std::max(max[0] - grid.origin[0],
+                    std::max(max[1] - grid.origin[1],
+                             max[2] - grid.origin[2])) / 4.f;
+    }
+    if (!(grid.size > 0))
+        grid.size = 1.f;
+    return grid;
+}
+// ----------------------------------------------------------------------------
+//! Expands the bounds of the cluster key by a box of half size pad at p,
+//! adding the cluster if it isn't in cells yet.
+void
+growSplitCell(std::map<SplitCell, int> & index,
+              std::vector<SplitCell> &   cells,
+              const SplitCell &          key,
+              const Nb::Vec3f &          p,
+              const float                pad)
+{
+    std::map<SplitCell, int>::iterator it = index.find(key);
+    if (it == index.end()){
+        it = index.insert(std::make_pair(
+            key, static_cast<int>(cells.size()))).first;
+        cells.push_back(key);
+        const float big = std::numeric_limits<float>::max();
+        cells.back().min = Nb::Vec3f(big, big, big);
+        cells.back().max = Nb::Vec3f(-big, -big, -big);
+    }
+    minMaxLocal(p - Nb::Vec3f(pad, pad, pad), cells[it->second].min,
+                cells[it->second].max);
+    minMaxLocal(p + Nb::Vec3f(pad, pad, pad), cells[it->second].min,
+                cells[it->second].max);
+}
+// ----------------------------------------------------------------------------
+//! Where x is at key k of keys, moved along v, and a if given, as advectKey()
+//! moves it.
+inline Nb::Vec3f
+keyPosition(const Nb::Vec3f & x, const Nb::Vec3f & v, const Nb::Vec3f * a,
+            const int k, const int keys, const float frametime)
+{
+    const float t = keyTime(k, keys, frametime);
+    Nb::Vec3f p = x + v * t;
+    if (a != NULL)
+        p = p + (*a) * (0.5f * t * t);
+    return p;
+}
+// ----------------------------------------------------------------------------
+//! How far a point of the body moves from its position over the motion keys
+//! splitCells() bounds, from the largest velocity (and acceleration) of its
+//! points. Zero if frametime is, as splitCells() then makes no keys.
+float
+motionPad(const Nb::Body * body, const float frametime)
+{
+    if (frametime == 0)
+        return 0.f;
+
+    float maxVel = 0.f, maxAcc = 0.f;
+    if (body->matches("Mesh")){
+        const Nb::PointShape& point = body->constPointShape();
+        const Nb::Buffer3f* velBuf = point.queryConstBuffer3f("velocity");
+        const Nb::Buffer3f* accBuf = velBuf != NULL ?
+            point.queryConstBuffer3f("acceleration") : NULL;
+        const int count = velBuf != NULL ? static_cast<int>(velBuf->size()) : 0;
+#pragma omp parallel
+        {
+            float localVel = 0.f, localAcc = 0.f;
+#pragma omp for schedule(static)
+            for (int v = 0; v < count; ++v){
+                localVel = std::max(localVel, lengthSquared((*velBuf)(v)));
+                if (accBuf != NULL)
+                    localAcc = std::max(localAcc, lengthSquared((*accBuf)(v)));
+            }
+#pragma omp critical(NbAiMotionPad)
+            {
+                maxVel = std::max(maxVel, localVel);
+                maxAcc = std::max(maxAcc, localAcc);
+            }
+        }
+    } else if (body->matches("Particle")){
+        const Nb::ParticleShape & particle = body->constParticleShape();
+        if (!particle.hasChannels3f("velocity"))
+            return 0.f;
+        const Nb::BlockArray3f& blocksVel = particle.constBlocks3f("velocity");
+        const Nb::BlockArray3f* blocksAcc =
+            particle.hasChannels3f("acceleration") ?
+            &particle.constBlocks3f("acceleration") : NULL;
+#pragma omp parallel
+        {
+            float localVel = 0.f, localAcc = 0.f;
+#pragma omp for schedule(dynamic)
+            for(int b = 0; b < blocksVel.block_count(); ++b) {
+                const Nb::Block3f& cb = blocksVel(b);
+                for(int64_t p(0); p < cb.size(); ++p){
+                    localVel = std::max(localVel, lengthSquared(cb(p)));
+                    if (blocksAcc != NULL)
+                        localAcc = std::max(localAcc,
+                                            lengthSquared((*blocksAcc)(b)(p)));
+                }
+            }
+#pragma omp critical(NbAiMotionPad)
+            {
+                maxVel = std::max(maxVel, localVel);
+                maxAcc = std::max(maxAcc, localAcc);
+            }
+        }
+    }
+
+    const float t = std::fabs(frametime);
+    return std::sqrt(maxVel) * t + 0.5f * std::sqrt(maxAcc) * t * t;
+}
+// ----------------------------------------------------------------------------
+//! Finds the non-empty clusters of the body and the bounds of what they
+//! hold, sorted by cluster. The bounds hold every motion key the procedural
+//! will make, from velocity (and acceleration) or from the positions of
+//! bodyNext, and the point radius; Arnold interpolates between the keys, so
+//! nothing moves out of them.
+void
+splitCells(const Nb::Body *         body,
+           const SplitGrid &        grid,
+           const float              frametime,
+           const float              radius,
+           std::vector<SplitCell> & cells,
+           const int                motionKeys = 2,
+           const Nb::Body *         bodyNext = NULL)
+{
+    std::map<SplitCell, int> index;
+    cells.clear();
+
+#pragma omp parallel
+    {
+        std::map<SplitCell, int> localIndex;
+        std::vector<SplitCell> local;
+        SplitCell key;
+        if (body->matches("Mesh")){
+            const Nb::PointShape& point = body->constPointShape();
+            const Nb::Buffer3f& posBuf(point.constBuffer3f("position"));
+            const Nb::Buffer3i& triIdxBuf(
+                body->constTriangleShape().constBuffer3i("index"));
+            const Nb::Buffer3f* velBuf = frametime != 0 ?
+                point.queryConstBuffer3f("velocity") : NULL;
+            const Nb::Buffer3f* accBuf = velBuf != NULL ?
+                point.queryConstBuffer3f("acceleration") : NULL;
+            const Nb::Buffer3f* nextBuf = velBuf == NULL && bodyNext != NULL ?
+                &bodyNext->constPointShape().constBuffer3f("position") : NULL;
+            if (nextBuf != NULL && nextBuf->size() != posBuf.size())
+                nextBuf = NULL;
+            const int keys = velBuf != NULL ? std::max(2, motionKeys) : 1;
+#pragma omp for schedule(static)
+            for (int f = 0; f < triIdxBuf.size(); ++f){
+                grid.cellOf(centroid(posBuf, triIdxBuf(f)), key.cell);
+                for (int k = 0; k < 3; ++k){
+                    const int v = triIdxBuf(f)[k];
+                    growSplitCell(localIndex, local, key, posBuf(v), 0);
+                    for (int j = 1; j < keys; ++j)
+                        growSplitCell(localIndex, local, key, keyPosition(
+                            posBuf(v), (*velBuf)(v),
+                            accBuf != NULL ? &(*accBuf)(v) : NULL,
+                            j, keys, frametime), 0);
+                    if (nextBuf != NULL)
+                        growSplitCell(localIndex, local, key, (*nextBuf)(v), 0);
+                }
+            }
+        } else if (body->matches("Particle")){
+            const Nb::ParticleShape & particle = body->constParticleShape();
+            const Nb::BlockArray3f& blocksPos = particle.constBlocks3f(0);
+            const Nb::BlockArray3f* blocksVel =
+                frametime != 0 && particle.hasChannels3f("velocity") ?
+                &particle.constBlocks3f("velocity") : NULL;
+            const Nb::BlockArray3f* blocksAcc =
+                blocksVel != NULL && particle.hasChannels3f("acceleration") ?
+                &particle.constBlocks3f("acceleration") : NULL;
+            const int keys = blocksVel != NULL ? std::max(2, motionKeys) : 1;
+#pragma omp for schedule(dynamic)
+            for(int b = 0; b < blocksPos.block_count(); ++b) {
+                const Nb::Block3f& cb = blocksPos(b);
+                for(int64_t p(0); p < cb.size(); ++p){
+                    grid.cellOf(cb(p), key.cell);
+                    growSplitCell(localIndex, local, key, cb(p), radius);
+                    for (int j = 1; j < keys; ++j)
+                        growSplitCell(localIndex, local, key, keyPosition(
+                            cb(p), (*blocksVel)(b)(p),
+                            blocksAcc != NULL ? &(*blocksAcc)(b)(p) : NULL,
+                            j, keys, frametime), radius);
+                }
+            }
+        }
+
+#pragma omp critical(NbAiSplitCells)
+        for (size_t c = 0; c < local.size(); ++c){
+            growSplitCell(index, cells, local[c], local[c].min, 0);
+            growSplitCell(index, cells, local[c], local[c].max, 0);
+        }
+    }
+
+    //The same clusters in the same order whatever the threads did
+    std::sort(cells.begin(), cells.end());
 }
 
 }; //end NbAi namespace
+
+#endif /* NBAI_H_ */
@@ -0,0 +1,192 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiAdvectedField.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+// A distance field baked at a few shutter times, for motion blurred implicit
+// shading. Only the data tiles of a FieldBounds are baked: each holds a
+// lattice of nodes per shutter time, and a lookup is a trilinear
+// interpolation in space followed by a linear interpolation in time. Tiles
+// own their boundary nodes, so a lookup never touches a neighbour.
+//
+// Like FieldBounds, the structure knows nothing about Naiad: nodes are
+// filled through set(), see naiad_distance_field.cc.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_ADVECTED_FIELD_H
+#define NBAI_ADVECTED_FIELD_H
+
+#include <NbAiFieldBounds.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace NbAi
+{
+
+class AdvectedField
+{
+public:
+    AdvectedField()
+        : _bounds(0), _cells(0), _nodes(0)
+    {}
+
+    //! Bytes needed to bake the data tiles of bounds with cells^3 cells per
+    //! tile at timeCount shutter times.
+    static size_t
+    bytesNeeded(const FieldBounds & bounds, const int cells,
+                const int timeCount)
+    {
+        const size_t n = cells + 1;
+        return size_t(bounds.dataTileCount()) * n * n * n * timeCount *
+            sizeof(float);
+    }
+
+    //! Allocates the nodes for the data tiles of bounds, which must outlive
+    //! the field. times must be increasing and hold at least two entries.
+    void
+    init(const FieldBounds &        bounds,
+         const int                  cells,
+         const std::vector<float> & times)
+    {
+        _bounds = &bounds;
+        _cells = std::max(1, cells);
+        _nodes = (_cells + 1) * (_cells + 1) * (_cells + 1);
+        _times = times;
+        _values.assign(size_t(bounds.dataTileCount()) * _nodes * times.size(),
+                       0.f);
+    }
+
+    bool                       empty()     const { return _values.empty(); }
+    int                        cells()     const { return _cells; }
+    const std::vector<float> & times()     const { return _times; }
+
+    //! Position of node (i, j, k) of a tile.
+    void
+    nodePosition(const int tile, const int i, const int j, const int k,
+                 float x[3]) const
+    {
+        const int * dims = _bounds->dims();
+        _bounds->tileOrigin(tile % dims[0], (tile / dims[0]) % dims[1],
+                            tile / (dims[0] * dims[1]), x);
+        const float h = _bounds->tileSize() / _cells;
+        x[0] += i * h;
+        x[1] += j * h;
+        x[2] += k * h;
+    }
+
+    //! Sets node (i, j, k) of a data tile at shutter time t.
+    void
+    set(const int tile, const int t, const int i, const int j, const int k,
+        const float value)
+    {
+        _values[_index(_bounds->dataSlot(tile), t) +
+                (k * (_cells + 1) + j) * (_cells + 1) + i] = value;
+    }
+
+    //! Interpolates the baked field at x and shutter time. Returns false if
+    //! x is not inside a baked tile.
+    bool
+    lookup(const float x[3], const float time, float & value) const
+    {
+        if (_values.empty())
+            return false;
+        const int tile = _bounds->tileIndex(x);
+        if (tile < 0)
+            return false;
+        const int slot = _bounds->dataSlot(tile);
+        if (slot < 0)
+            return false;
+
+        // Shutter interval, clamped to the baked range
+        const int last = static_cast<int>(_times.size()) - 1;
+        int t = static_cast<int>(
+            std::upper_bound(_times.begin(), _times.end(), time) -
+            _times.begin()) - 1;
+        t = std::max(0, std::min(last - 1, t));
+        const float ft = std::max(0.f, std::min(1.f,
+            (time - _times[t]) / (_times[t+1] - _times[t])));
+
+        // Cell and weights within the tile
+        int c[3];
+        float w[3];
+        for (int k = 0; k < 3; ++k) {
+            const float f = (x[k] - _bounds->origin()[k]) / _bounds->tileSize();
+            const float g = (f - std::floor(f)) * _cells;
+            c[k] = std::min(_cells - 1, static_cast<int>(g));
+            w[k] = std::min(1.f, g - c[k]);
+        }
+
+        const float v0 = _trilinear(_index(slot, t), c, w);
+        const float v1 = _trilinear(_index(slot, t + 1), c, w);
+        value = v0 + ft * (v1 - v0);
+        return true;
+    }
+
+    //! Bytes held by the baked nodes.
+    size_t
+    bytes() const
+    { return _values.size() * sizeof(float); }
+
+private:
+    size_t
+    _index(const int slot, const int t) const
+    { return (size_t(slot) * _times.size() + t) * _nodes; }
+
+    float
+    _trilinear(const size_t base, const int c[3], const float w[3]) const
+    {
+        const int sy = _cells + 1;
+        const int sz = sy * sy;
+        const float * v = &_values[base + c[2] * sz + c[1] * sy + c[0]];
+        const float x00 = v[0]       + w[0] * (v[1]           - v[0]);
+        const float x10 = v[sy]      + w[0] * (v[sy + 1]      - v[sy]);
+        const float x01 = v[sz]      + w[0] * (v[sz + 1]      - v[sz]);
+        const float x11 = v[sz + sy] + w[0] * (v[sz + sy + 1] - v[sz + sy]);
+        const float y0 = x00 + w[1] * (x10 - x00);
+        const float y1 = x01 + w[1] * (x11 - x01);
+        return y0 + w[2] * (y1 - y0);
+    }
+
+    const FieldBounds *  _bounds;
+    int                  _cells;    //!< per tile edge
+    int                  _nodes;    //!< per tile and shutter time
+    std::vector<float>   _times;    //!< baked shutter times, in frames
+    std::vector<float>   _values;   //!< per data tile, per time, per node
+};
+
+} // namespace NbAi
+
+#endif // NBAI_ADVECTED_FIELD_H
@@ -0,0 +1,100 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiBodyCache.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Bodies read from EMP files, shared by every Naiad procedural and shader in
+// the render process. A body is read once per (file, body name, file
+// modification time) and handed out read-only to all nodes that ask for it.
+// Bodies no longer referenced by any node stay resident, least recently used
+// first out, while their total size is within the cache budget. The budget is
+// taken from NAIAD_ARNOLD_BODY_CACHE_MB (default 2048) and the size of a body
+// is estimated by the size of its EMP file.
+//
+// Callers must hold a session reference (NbAiSession.h) while they use the
+// cache. Unreferenced bodies are dropped before the session ends. Hosts that
+// render several frames in one process, IPR or a render loop, may set
+// NAIAD_ARNOLD_KEEP_NEXT_FRAME=1 to keep the bodies read as the next frame
+// of a motion blurred sequence: rendering frame N reads N+1 for motion, and
+// the render of frame N+1 that follows wants that body again. Those are
+// kept, within the budget, and the session with them, until the session
+// after ends or the host calls endSession(); a file changed meanwhile is
+// read again since its time differs. A kick per frame renders once and
+// exits, so the default is off.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_BODY_CACHE_H
+#define NBAI_BODY_CACHE_H
+
+#include <../common/NbAiSession.h>
+
+#include <stdint.h>
+
+namespace Nb
+{
+class Body;
+class String;
+}
+
+namespace NbAi
+{
+
+//! Returns the body named bodyName in the EMP file empFileName, reading the
+//! file only if the body isn't cached. Each call must be paired with a
+//! releaseBody(). Throws if the body can't be read. A body acquired as the
+//! next frame of the one being rendered is kept for the next render, and
+//! evicted after the others.
+NBAI_SESSION_API const Nb::Body *
+acquireBody(const Nb::String & empFileName, const Nb::String & bodyName,
+            bool nextFrame = false);
+
+//! Drops a reference returned by acquireBody().
+NBAI_SESSION_API void releaseBody(const Nb::Body * body);
+
+//! Budget, in bytes, for bodies that no node references.
+NBAI_SESSION_API void setBodyCacheBudget(int64_t bytes);
+
+//! Drops every unreferenced body.
+NBAI_SESSION_API void flushBodyCache();
+
+//! Drops the unreferenced bodies except, if NAIAD_ARNOLD_KEEP_NEXT_FRAME is
+//! set, those acquired as a next frame since the last call. Returns true if
+//! any are kept. Called by the session when it ends, it stays open while this
+//! returns true.
+NBAI_SESSION_API bool keepNextFrameBodies();
+
+} // namespace NbAi
+
+#endif // NBAI_BODY_CACHE_H
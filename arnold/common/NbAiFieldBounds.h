@@ -0,0 +1,315 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiFieldBounds.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Conservative bounds of a tiled signed distance field, for renderer-side
+// early outs. The field's tile lattice is covered by a dense grid of tiles.
+// A tile without field data holds one constant value. A tile with data is cut
+// into sub-cells, and each sub-cell stores a lower bound on |distance|
+// anywhere inside it together with the sign of the distance there. Every tile
+// also stores an upper bound on the speed inside it, so the bounds can account
+// for advection over a shutter interval.
+//
+// A constant tile only answers for itself if neither the interpolation kernel
+// nor an advected lookup can reach field data from it. finish() measures how
+// far every constant tile is from the nearest tile with data, and queries
+// closer than the kernel's reach plus the distance travelled over the shutter
+// fall back to sampling. The same holds for points outside the grid.
+//
+// The structure knows nothing about Naiad: it is filled through setConstant(),
+// setSubCell() and setMaxSpeed(), see naiad_distance_field.cc.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_FIELD_BOUNDS_H
+#define NBAI_FIELD_BOUNDS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace NbAi
+{
+
+class FieldBounds
+{
+public:
+    FieldBounds()
+        : _tileSize(1.f), _subCells(1), _background(0.f), _reach(0.f),
+          _outsideSpeed(0.f), _dataTiles(0)
+    {
+        _origin[0] = _origin[1] = _origin[2] = 0.f;
+        _dims[0] = _dims[1] = _dims[2] = 0;
+    }
+
+    //! Covers the box [min, max] with tiles of edge tileSize, each cut into
+    //! subCells^3 sub-cells. Every tile starts out constant at background,
+    //! which is also the value returned outside the box. reach is how far
+    //! past a point the interpolation kernel reads the field.
+    void
+    init(const float  min[3],
+         const float  max[3],
+         const float  tileSize,
+         const int    subCells,
+         const float  background,
+         const float  reach = 0.f)
+    {
+        _tileSize = tileSize;
+        _subCells = std::max(1, subCells);
+        _background = background;
+        _reach = reach;
+        _outsideSpeed = 0.f;
+        _dataTiles = 0;
+        for (int k = 0; k < 3; ++k) {
+            _origin[k] = min[k];
+            _dims[k] = std::max(1, static_cast<int>(
+                std::ceil((max[k] - min[k]) / tileSize - 0.001f)));
+        }
+        const size_t count = size_t(_dims[0]) * _dims[1] * _dims[2];
+        _slot.assign(count, -1);
+        _constant.assign(count, background);
+        _speed.assign(count, 0.f);
+        _clearance.assign(count, 0.f);
+        _bounds.clear();
+    }
+
+    int         tileCount() const { return _dims[0] * _dims[1] * _dims[2]; }
+    const int * dims()      const { return _dims; }
+    const float * origin()  const { return _origin; }
+    float       tileSize()  const { return _tileSize; }
+    int         subCells()  const { return _subCells; }
+
+    //! Lower corner of tile (i, j, k).
+    void
+    tileOrigin(const int i, const int j, const int k, float o[3]) const
+    {
+        o[0] = _origin[0] + i * _tileSize;
+        o[1] = _origin[1] + j * _tileSize;
+        o[2] = _origin[2] + k * _tileSize;
+    }
+
+    //! Index of the tile holding x, -1 outside the grid.
+    int
+    tileIndex(const float x[3]) const
+    {
+        int c[3];
+        for (int k = 0; k < 3; ++k) {
+            const float f = (x[k] - _origin[k]) / _tileSize;
+            if (!(f >= 0.f))
+                return -1;
+            c[k] = static_cast<int>(f);
+            if (c[k] >= _dims[k])
+                return -1;
+        }
+        return (c[2] * _dims[1] + c[1]) * _dims[0] + c[0];
+    }
+
+    //! Marks a tile as holding field data. Must be called for all such
+    //! tiles, serially, before the sub-cells are set.
+    void
+    addDataTile(const int tile)
+    {
+        if (_slot[tile] >= 0)
+            return;
+        _slot[tile] = _dataTiles++;
+        _bounds.resize(_bounds.size() + _subCells * _subCells * _subCells,
+                       0.f);
+    }
+
+    bool hasData(const int tile) const { return _slot[tile] >= 0; }
+
+    //! Number of tiles with data, and the dense index [0, dataTileCount())
+    //! of one of them, -1 for a constant tile.
+    int dataTileCount()        const { return _dataTiles; }
+    int dataSlot(const int tile) const { return _slot[tile]; }
+
+    void
+    setConstant(const int tile, const float value)
+    { _constant[tile] = value; }
+
+    //! Sets sub-cell (i, j, k) of a data tile from the distance at its
+    //! center, assuming |grad distance| <= 1.
+    void
+    setSubCell(const int tile, const int i, const int j, const int k,
+               const float centerDistance)
+    {
+        const float halfDiagonal =
+            0.5f * std::sqrt(3.f) * _tileSize / _subCells;
+        const float bound =
+            std::max(0.f, std::fabs(centerDistance) - halfDiagonal);
+        _bounds[_subIndex(tile, i, j, k)] =
+            centerDistance < 0.f ? -bound : bound;
+    }
+
+    //! Upper bound on the speed anywhere in a tile, with or without data.
+    void
+    setMaxSpeed(const int tile, const float speed)
+    { _speed[tile] = speed; }
+
+    //! Must be called once all tiles are set. Computes the clearance of the
+    //! constant tiles, from the chessboard distance in tiles to the nearest
+    //! tile with data or with a constant other than the background, and the
+    //! speed bound outside the grid.
+    void
+    finish()
+    {
+        const int count = tileCount();
+        const int far = _dims[0] + _dims[1] + _dims[2];
+        std::vector<int> steps(count, far);
+        for (int t = 0; t < count; ++t)
+            if (_slot[t] >= 0 || _constant[t] != _background)
+                steps[t] = 0;
+
+        // Forward and backward chamfer sweeps, exact for this metric
+        for (int t = 0; t < count; ++t)
+            _relax(steps, t);
+        for (int t = count - 1; t >= 0; --t)
+            _relax(steps, t);
+
+        _outsideSpeed = 0.f;
+        for (int t = 0; t < count; ++t) {
+            _clearance[t] = (steps[t] - 1) * _tileSize;
+            _outsideSpeed = std::max(_outsideSpeed, _speed[t]);
+        }
+    }
+
+    //! Tries to answer a distance query at x without sampling the field.
+    //! maxTime bounds how long the field may have been advected. Returns
+    //! true with value set to the exact constant of a tile without data
+    //! that no lookup from x can see past, or to a conservative (smaller in
+    //! magnitude, same sign) distance if x is further than band from the
+    //! surface. Returns false if the field must be sampled.
+    bool
+    query(const float x[3],
+          const float maxTime,
+          const float band,
+          float &     value) const
+    {
+        const int tile = tileIndex(x);
+        if (tile < 0) {
+            if (_outsideDistance(x) <= _reach + _outsideSpeed * maxTime)
+                return false;
+            value = _background;
+            return true;
+        }
+        const int slot = _slot[tile];
+        if (slot < 0) {
+            if (_clearance[tile] <= _reach + _speed[tile] * maxTime)
+                return false;
+            value = _constant[tile];
+            return true;
+        }
+
+        int c[3];
+        for (int k = 0; k < 3; ++k) {
+            const float f = (x[k] - _origin[k]) / _tileSize;
+            c[k] = std::min(_subCells - 1, static_cast<int>(
+                (f - std::floor(f)) * _subCells));
+        }
+        const float bound = _bounds[(size_t(slot) * _subCells + c[2]) *
+                                    _subCells * _subCells +
+                                    c[1] * _subCells + c[0]];
+        const float far = std::fabs(bound) - _speed[tile] * maxTime;
+        if (far <= band)
+            return false;
+        value = bound < 0.f ? -far : far;
+        return true;
+    }
+
+    //! Bytes held by the bounds.
+    size_t
+    bytes() const
+    {
+        return _slot.size() * (sizeof(int) + 3 * sizeof(float)) +
+            _bounds.size() * sizeof(float);
+    }
+
+private:
+    //! Lowers the step count of tile t to one more than its neighbours'.
+    void
+    _relax(std::vector<int> & steps, const int t) const
+    {
+        const int i = t % _dims[0];
+        const int j = (t / _dims[0]) % _dims[1];
+        const int k = t / (_dims[0] * _dims[1]);
+        for (int c = std::max(0, k - 1);
+             c <= std::min(_dims[2] - 1, k + 1); ++c)
+            for (int b = std::max(0, j - 1);
+                 b <= std::min(_dims[1] - 1, j + 1); ++b)
+                for (int a = std::max(0, i - 1);
+                     a <= std::min(_dims[0] - 1, i + 1); ++a)
+                    steps[t] = std::min(
+                        steps[t], steps[(c * _dims[1] + b) * _dims[0] + a] + 1);
+    }
+
+    //! Distance from x to the box covered by the tiles.
+    float
+    _outsideDistance(const float x[3]) const
+    {
+        float d2 = 0.f;
+        for (int k = 0; k < 3; ++k) {
+            const float hi = _origin[k] + _dims[k] * _tileSize;
+            const float d = std::max(std::max(_origin[k] - x[k], x[k] - hi),
+                                     0.f);
+            d2 += d * d;
+        }
+        return std::sqrt(d2);
+    }
+
+    size_t
+    _subIndex(const int tile, const int i, const int j, const int k) const
+    {
+        return (size_t(_slot[tile]) * _subCells + k) * _subCells * _subCells +
+            j * _subCells + i;
+    }
+
+    float              _origin[3];
+    float              _tileSize;
+    int                _dims[3];
+    int                _subCells;
+    float              _background;
+    float              _reach;
+    float              _outsideSpeed;
+    int                _dataTiles;
+    std::vector<int>   _slot;      //!< per tile, -1 for constant tiles
+    std::vector<float> _constant;  //!< per tile
+    std::vector<float> _speed;     //!< per tile
+    std::vector<float> _clearance; //!< per tile, distance to data
+    std::vector<float> _bounds;    //!< per data tile, subCells^3 each
+};
+
+} // namespace NbAi
+
+#endif // NBAI_FIELD_BOUNDS_H
@@ -0,0 +1,251 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiIsosurface.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Iso-surface extraction from a lattice of samples, one tile of a field at a
+// time. Each lattice cube is cut into six tetrahedra around its main
+// diagonal, the same way in every cube, so neighbouring cubes agree on the
+// faces they share and the surface has no cracks. A tetrahedron the surface
+// crosses gives one or two triangles, with vertices on the lattice edges
+// where the samples cross the iso value. Vertices on the same edge are
+// shared within the lattice, and each records its edge so that the caller
+// can weld the vertices neighbouring tiles make on the faces they share.
+//
+// The structure knows nothing about Naiad: the lattice is filled by the
+// caller, see NbAi::loadIsosurface.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_ISOSURFACE_H
+#define NBAI_ISOSURFACE_H
+
+#include <algorithm>
+#include <vector>
+
+namespace NbAi
+{
+
+//! Points (3 floats each) and triangles (3 point indices each) of a tile.
+//! Each point is on the lattice edge node * 7 + direction - 1, the
+//! direction's bits 1, 2 and 4 set where the edge moves along x, y and z.
+struct TileMesh
+{
+    std::vector<float> points;
+    std::vector<int>   triangles;
+    std::vector<int>   edges;
+
+    int pointCount()    const { return static_cast<int>(points.size() / 3); }
+    int triangleCount() const { return static_cast<int>(triangles.size()/3); }
+};
+
+class LatticePolygonizer
+{
+public:
+    //! Triangulates where the (n+1)^3 samples in d, x fastest, cross iso.
+    //! Node (i, j, k) is at o + h * (i, j, k). Triangles wind so that their
+    //! normals point to the side above iso. Returns false, leaving mesh
+    //! empty, if all samples are on the same side.
+    bool
+    polygonize(const float * d,
+               const int     n,
+               const float   o[3],
+               const float   h,
+               const float   iso,
+               TileMesh &    mesh)
+    {
+        mesh.points.clear();
+        mesh.triangles.clear();
+        mesh.edges.clear();
+
+        const int m = n + 1;
+        const int nodes = m * m * m;
+        bool below = false, above = false;
+        for (int i = 0; i < nodes && !(below && above); ++i)
+            (d[i] < iso ? below : above) = true;
+        if (!(below && above))
+            return false;
+
+        _d = d;
+        _m = m;
+        _o = o;
+        _h = h;
+        _iso = iso;
+        _mesh = &mesh;
+        _edges.assign(size_t(nodes) * 7, -1);
+
+        // Corner c of a cube is node + (c & 1, c >> 1 & 1, c >> 2 & 1)
+        static const int tets[6][4] = {
+            { 0, 1, 3, 7 }, { 0, 1, 5, 7 }, { 0, 2, 3, 7 },
+            { 0, 2, 6, 7 }, { 0, 4, 5, 7 }, { 0, 4, 6, 7 } };
+
+        for (int k = 0; k < n; ++k)
+            for (int j = 0; j < n; ++j)
+                for (int i = 0; i < n; ++i) {
+                    int corner[8];
+                    int inside = 0;
+                    for (int c = 0; c < 8; ++c) {
+                        corner[c] = _node(i + (c & 1), j + (c >> 1 & 1),
+                                          k + (c >> 2 & 1));
+                        if (d[corner[c]] < iso)
+                            ++inside;
+                    }
+                    if (inside == 0 || inside == 8)
+                        continue;
+                    for (int t = 0; t < 6; ++t) {
+                        const int tet[4] = { corner[tets[t][0]],
+                                             corner[tets[t][1]],
+                                             corner[tets[t][2]],
+                                             corner[tets[t][3]] };
+                        _tetrahedron(tet);
+                    }
+                }
+        return true;
+    }
+
+private:
+    int
+    _node(const int i, const int j, const int k) const
+    { return (k * _m + j) * _m + i; }
+
+    void
+    _position(const int node, float x[3]) const
+    {
+        x[0] = _o[0] + _h * (node % _m);
+        x[1] = _o[1] + _h * (node / _m % _m);
+        x[2] = _o[2] + _h * (node / (_m * _m));
+    }
+
+    //! The point where the edge between nodes a and b crosses iso, made
+    //! once per edge. Edges of the tetrahedra go from a node to one with
+    //! no smaller coordinate, in one of seven directions.
+    int
+    _edgePoint(int a, int b)
+    {
+        if (b < a)
+            std::swap(a, b);
+        const int diff = b - a;
+        const int dir = (diff % _m != 0 ? 1 : 0) |
+            (diff / _m % _m != 0 ? 2 : 0) | (diff / (_m * _m) != 0 ? 4 : 0);
+        const int edge = a * 7 + dir - 1;
+        int & point = _edges[edge];
+        if (point >= 0)
+            return point;
+
+        float xa[3], xb[3];
+        _position(a, xa);
+        _position(b, xb);
+        const float da = _d[a], db = _d[b];
+        const float t = db != da ?
+            std::max(0.f, std::min(1.f, (_iso - da) / (db - da))) : 0.5f;
+        point = _mesh->pointCount();
+        for (int k = 0; k < 3; ++k)
+            _mesh->points.push_back(xa[k] + t * (xb[k] - xa[k]));
+        _mesh->edges.push_back(edge);
+        return point;
+    }
+
+    //! Adds triangle (a, b, c), flipped if it doesn't face dir.
+    void
+    _triangle(const int a, const int b, int c, const float dir[3])
+    {
+        int p[3] = { a, b, c };
+        const float * x0 = &_mesh->points[3 * p[0]];
+        const float * x1 = &_mesh->points[3 * p[1]];
+        const float * x2 = &_mesh->points[3 * p[2]];
+        const float e1[3] = { x1[0] - x0[0], x1[1] - x0[1], x1[2] - x0[2] };
+        const float e2[3] = { x2[0] - x0[0], x2[1] - x0[1], x2[2] - x0[2] };
+        const float normal[3] = { e1[1] * e2[2] - e1[2] * e2[1],
+                                  e1[2] * e2[0] - e1[0] * e2[2],
+                                  e1[0] * e2[1] - e1[1] * e2[0] };
+        if (normal[0] * dir[0] + normal[1] * dir[1] + normal[2] * dir[2] <
+            0.f)
+            std::swap(p[1], p[2]);
+        _mesh->triangles.push_back(p[0]);
+        _mesh->triangles.push_back(p[1]);
+        _mesh->triangles.push_back(p[2]);
+    }
+
+    void
+    _tetrahedron(const int tet[4])
+    {
+        int in[4], out[4];
+        int nIn = 0, nOut = 0;
+        for (int v = 0; v < 4; ++v) {
+            if (_d[tet[v]] < _iso)
+                in[nIn++] = tet[v];
+            else
+                out[nOut++] = tet[v];
+        }
+        if (nIn == 0 || nOut == 0)
+            return;
+
+        // From the nodes below iso to the ones above
+        float dir[3] = { 0.f, 0.f, 0.f };
+        for (int v = 0; v < 4; ++v) {
+            float x[3];
+            _position(tet[v], x);
+            const float w = _d[tet[v]] < _iso ? -1.f / nIn : 1.f / nOut;
+            for (int k = 0; k < 3; ++k)
+                dir[k] += w * x[k];
+        }
+
+        if (nIn == 1 || nOut == 1) {
+            const int apex = nIn == 1 ? in[0] : out[0];
+            const int * base = nIn == 1 ? out : in;
+            _triangle(_edgePoint(apex, base[0]), _edgePoint(apex, base[1]),
+                      _edgePoint(apex, base[2]), dir);
+            return;
+        }
+
+        const int q[4] = { _edgePoint(in[0], out[0]),
+                           _edgePoint(in[0], out[1]),
+                           _edgePoint(in[1], out[1]),
+                           _edgePoint(in[1], out[0]) };
+        _triangle(q[0], q[1], q[2], dir);
+        _triangle(q[0], q[2], q[3], dir);
+    }
+
+    const float *    _d;
+    int              _m;
+    const float *    _o;
+    float            _h;
+    float            _iso;
+    TileMesh *       _mesh;
+    std::vector<int> _edges;  //!< per node and direction, -1 if none yet
+};
+
+} // namespace NbAi
+
+#endif // NBAI_ISOSURFACE_H
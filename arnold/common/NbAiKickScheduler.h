@@ -0,0 +1,294 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiKickScheduler.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+// Runs kick on the ASS files Arnold-ASS-Write produces, several frames at a
+// time. Naiad steps the graph one frame after the other; each frame submits
+// its kick and goes on with the next while up to jobs() kicks run as child
+// processes. Submitting blocks only while every slot is taken. With several
+// jobs each kick writes its output to a log next to its ASS file, with one
+// job it writes to the console as before; its exit code and wall time are
+// reported once it has been reaped. An ASS file is only rewritten once the
+// kicks reading it are done, see reserve(). wait() blocks until all kicks
+// are done, and summarizes them when several ran at a time; the op calls it
+// on the last frame of the range. The host calls shutdown() when it unloads
+// the plug-in; kicks still running when the process exits without it are
+// left to finish on their own.
+//
+// Without fork (Windows) kicks run one at a time through system(), as
+// before.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_KICK_SCHEDULER_H
+#define NBAI_KICK_SCHEDULER_H
+
+#include <Nb.h>
+
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char ** environ;
+#endif
+
+namespace NbAi
+{
+
+class KickScheduler
+{
+public:
+    static KickScheduler &
+    instance()
+    {
+        static KickScheduler scheduler;
+        return scheduler;
+    }
+
+    //! Number of kicks that may run at the same time.
+    void setJobs(const int jobs) { _jobs = jobs > 0 ? jobs : 1; }
+    int  jobs() const            { return _jobs; }
+
+    //! Blocks until no running kick reads input, before it is rewritten. An
+    //! input that doesn't change between frames (no frame number in its
+    //! name) thus runs one kick at a time, with a warning.
+    void
+    reserve(const std::string & input)
+    {
+#ifndef _WIN32
+        for (;;){
+            _reap(false);
+            bool busy = false;
+            for (size_t j = 0; j < _running.size() && !busy; ++j)
+                busy = _running[j].input == input;
+            if (!busy)
+                return;
+            if (!_warned){
+                NB_WARNING("Kick input " << input << " is the same for "
+                           "every frame, kicking one frame at a time");
+                _warned = true;
+            }
+            _reap(true);
+        }
+#endif
+    }
+
+    //! Runs the shell command reading input for frame, with its output
+    //! going to log, or to the console if log is empty. Blocks while jobs()
+    //! kicks are running.
+    void
+    submit(const std::string & command, const std::string & input,
+           const std::string & log, const int frame)
+    {
+        Job job;
+        job.command = command;
+        job.input = input;
+        job.log = log;
+        job.frame = frame;
+        job.status = -1;
+
+        //Wall time of the batch from the first kick launched
+        if (_running.empty() && _done.empty())
+            _first = _now();
+
+#ifdef _WIN32
+        job.start = _now();
+        job.status = ::system((log.empty() ? command :
+                               command + " > \"" + log + "\" 2>&1").c_str());
+        job.end = _now();
+        _finish(job);
+#else
+        //Free a slot
+        while (static_cast<int>(_running.size()) >= _jobs)
+            _reap(true);
+
+        //Everything the child needs is built here, it only calls
+        //async-signal-safe functions
+        const std::string shell = log.empty() ? command :
+            "(" + command + ") > '" + log + "' 2>&1";
+        char * const argv[] = { const_cast<char *>("sh"),
+                                const_cast<char *>("-c"),
+                                const_cast<char *>(shell.c_str()), NULL };
+
+        NB_INFO("Kick frame " << frame << ": " << command);
+        job.start = _now();
+        job.pid = fork();
+        if (job.pid == 0){
+            execve("/bin/sh", argv, environ);
+            _exit(127);
+        }
+        if (job.pid < 0){
+            NB_WARNING("Can't start kick for frame " << frame <<
+                       ", running it in the foreground");
+            job.status = ::system(command.c_str());
+            job.end = _now();
+            _finish(job);
+            return;
+        }
+        _running.push_back(job);
+
+        //Report the ones that are done already
+        _reap(false);
+#endif
+    }
+
+    //! Blocks until every submitted kick is done, and summarizes them if
+    //! more than one could run at a time.
+    void
+    wait()
+    {
+#ifndef _WIN32
+        while (!_running.empty())
+            _reap(true);
+#endif
+        _warned = false;
+        if (_done.empty())
+            return;
+        if (_jobs <= 1){
+            _done.clear();
+            return;
+        }
+
+        int failed = 0;
+        double total = 0;
+        for (size_t j = 0; j < _done.size(); ++j){
+            total += _done[j].end - _done[j].start;
+            if (_done[j].status != 0)
+                ++failed;
+        }
+        NB_INFO("Kicked " << _done.size() << " frames, " << failed <<
+                " failed, " << total << "s of renders in " <<
+                _now() - _first << "s with " << _jobs << " jobs");
+        _done.clear();
+    }
+
+    //! Waits for the kicks still running. Called when the plug-in is
+    //! unloaded, not from a static destructor, so that logging still works.
+    void
+    shutdown()
+    { wait(); }
+
+private:
+    struct Job
+    {
+        std::string command;
+        std::string input;
+        std::string log;
+        int         frame;
+        double      start;
+        double      end;
+        int         status;
+#ifndef _WIN32
+        pid_t       pid;
+#endif
+    };
+
+    KickScheduler()
+        : _jobs(1), _first(0), _warned(false)
+    {}
+
+    static double
+    _now()
+    {
+#ifdef _WIN32
+        return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return tv.tv_sec + 1e-6 * tv.tv_usec;
+#endif
+    }
+
+    void
+    _finish(const Job & job)
+    {
+        const std::string log = job.log.empty() ? "" : ", log " + job.log;
+        if (job.status == 0)
+            NB_INFO("Kick frame " << job.frame << " done in " <<
+                    job.end - job.start << "s" << log);
+        else
+            NB_WARNING("Kick frame " << job.frame << " failed with " <<
+                       job.status << " after " << job.end - job.start <<
+                       "s" << log);
+        _done.push_back(job);
+    }
+
+#ifndef _WIN32
+    //! Collects finished kicks, waiting for one if block is set. Only our
+    //! own children are waited for, the host may have others.
+    void
+    _reap(const bool block)
+    {
+        for (;;){
+            bool reaped = false;
+            for (size_t j = 0; j < _running.size(); ){
+                int status;
+                const pid_t pid = waitpid(_running[j].pid, &status, WNOHANG);
+                if (pid == 0){
+                    ++j;
+                    continue;
+                }
+                Job job = _running[j];
+                _running.erase(_running.begin() + j);
+                job.end = _now();
+                job.status = pid > 0 && WIFEXITED(status) ?
+                    WEXITSTATUS(status) : -1;
+                _finish(job);
+                reaped = true;
+            }
+            if (reaped || !block || _running.empty())
+                return;
+            usleep(50000);
+        }
+    }
+#endif
+
+    int              _jobs;
+    double           _first;    //!< launch of the first kick of a batch
+    bool             _warned;   //!< reserve() warned in this batch
+    std::vector<Job> _running;
+    std::vector<Job> _done;
+};
+
+} // namespace NbAi
+
+#endif // NBAI_KICK_SCHEDULER_H
@@ -75,6 +75,11 @@ public:
 
         AiNodeSetInt(options, "threads", _p.getThreads());
 
+        //Frame rate, for shaders that turn velocities into shutter offsets
+        if (AiNodeLookUpUserParameter(options, "fps") == NULL)
+            AiNodeDeclare(options, "fps", "constant FLOAT");
+        AiNodeSetFlt(options, "fps", static_cast<float>(_p.getFPS()));
+
         //Create Output node in Arnold
         AtNode * driver = AiNode(_p.getImageFormat());
         AiNodeSetStr(driver, "name", "render");
@@ -144,6 +149,7 @@ public:
 protected:
     const OutputParams &                     _p;
     const em::array1<const Nb::Body*> & _bodies;
+    mutable BoundsCache                  _bounds;   //!< of _bodies
 // ----------------------------------------------------------------------------
     AtNode *
     _createImplicitNode(const Nb::Body *     body,
@@ -37,20 +37,38 @@
 #ifndef NBAIOUTPUTASSASCIIWRITE_H_
 #define NBAIOUTPUTASSASCIIWRITE_H_
 
-#include <NbAiOutputRender.h>
+#include <NbAiOutputAssWrite.h>
 
 namespace NbAi{
 
-class OutputAssAsciiWrite : public OutputRender
+//Writes the same scene as Arnold-ASS-Write without kicking it. Meshes and
+//particles become naiad_geo procedural stubs unless Inline Geometry is on.
+class OutputAssAsciiWrite : public OutputAssWrite
 {
 public:
     OutputAssAsciiWrite(const NbAi::OutputParams &               p,
                         const em::array1<const Nb::Body*> & bodies,
                         const Nb::Body *                    camera,
                         const Nb::TimeBundle &                  tb) :
-                            OutputRender(p, bodies, camera, tb)
+                            OutputAssWrite(p, bodies, camera, tb)
     {
-        _allowImplicit = false;
+    };
+// ----------------------------------------------------------------------------
+    virtual void
+    processBodies(const Nb::TimeBundle & tb) const
+    {
+        //Fields only as meshes, there is no implicit shader to point to
+        for(int i = 0; i < _bodies.size(); ++i) {
+            const Nb::Body* body = _bodies.at(i);
+            Nb::String channel;
+            float iso;
+            if (body->has_prop("type") &&
+                    body->prop1s("type")->eval(tb) == Nb::String("Implicit") &&
+                    !NbAi::bodyImplicitMesh(body, tb, channel, iso))
+                NB_THROW("Field data is not allowed.");
+        }
+
+        OutputAssWrite::processBodies(tb);
     };
 // ----------------------------------------------------------------------------
     virtual void
@@ -58,7 +76,7 @@ public:
     {
         NB_INFO("Creating ASCII ass: " << _p.getOutputAss());
 
-        AiASSWrite(_p.getOutputAss(), AI_NODE_ALL, FALSE);
+        _writeAss();
     };
 };
 
@@ -37,6 +37,9 @@
 #define NBAIOUTPUTASSWRITE_H_
 
 #include <NbAiOutput.h>
+#include <NbAiKickScheduler.h>
+
+#include <NbEmpReader.h>
 
 namespace NbAi{
 
@@ -49,7 +52,8 @@ public:
                    const Nb::TimeBundle &                  tb) :
                        Output(p, bodies, camera, tb)
     {
-        AiLoadPlugin(_p.getImplicitShader());
+        if (std::string(_p.getImplicitShader()).size() > 0)
+            AiLoadPlugin(_p.getImplicitShader());
     };
 // ----------------------------------------------------------------------------
     virtual void
@@ -74,46 +78,259 @@ public:
     {
         NB_INFO("Creating ass: " << _p.getOutputAss());
 
-        AiASSWrite(_p.getOutputAss(), AI_NODE_ALL, FALSE);
+        //Kicks of earlier frames may still be reading the file
+        if (std::string(_p.getKickAss()).size() > 0)
+            KickScheduler::instance().reserve(_p.getOutputAss());
+
+        _writeAss();
 
         _kickAss(tb);
     };
 // ----------------------------------------------------------------------------
-private:
+protected:
+    //Writes the scene. Procedural stubs keep the file small; inlined
+    //geometry arrays are written in Arnold's compressed binary encoding
+    //where the Arnold version has it.
+    void
+    _writeAss() const
+    {
+#if AI_VERSION_ARCH_NUM > 4 || \
+    (AI_VERSION_ARCH_NUM == 4 && AI_VERSION_MAJOR_NUM >= 1)
+        AiASSWrite(_p.getOutputAss(), AI_NODE_ALL, FALSE,
+                   _p.getInlineGeometry());
+#else
+        if (_p.getInlineGeometry())
+            NB_WARNING("This Arnold version writes inlined geometry as "
+                       "plain text, expect large ASS files");
+        AiASSWrite(_p.getOutputAss(), AI_NODE_ALL, FALSE);
+#endif
+    };
+// ----------------------------------------------------------------------------
     void
     _addBody(const Nb::Body * body, const Nb::TimeBundle & tb) const
     {
+        const Nb::String type = body->prop1s("type")->eval(tb);
+        if (type == Nb::String("Mesh") || type == Nb::String("Particle")){
+            if (_p.getInlineGeometry()){
+                _setCommonAtr(_inlineBody(body, tb), body, tb);
+                return;
+            }
+            const int split =
+                body->has_prop("split") ? body->prop1i("split")->eval(tb) : 0;
+            if (split > 0){
+                _addSplitBody(body, tb, split);
+                return;
+            }
+        }
+
         AtNode* node;
         if (body->prop1s("type")->eval(tb) == Nb::String("Mesh")){
             node = _createProceduralNode(body, tb);
-
-            //Tell procedural node what to render
-            AiNodeDeclare(node, "type", "constant STRING");
-            AiNodeSetStr(node, "type", "Polymesh");
+            _setProceduralType(node, body, tb);
         } else if (body->prop1s("type")->eval(tb) == Nb::String("Particle")){
             node = _createProceduralNode(body, tb);
+            _setProceduralType(node, body, tb);
+        } else if (body->prop1s("type")->eval(tb) == Nb::String("Implicit")){
+            Nb::String channel;
+            float iso;
+            if (NbAi::bodyImplicitMesh(body, tb, channel, iso)){
+                //Meshed by naiad_geo when Arnold reaches its bounds
+                node = _createProceduralNode(body, tb);
+                _setProceduralType(node, body, tb);
+            } else {
+                AtNode* nDFnode;
+                node = _createImplicitNode(body, tb, nDFnode);
+
+                AiNodeSetStr(nDFnode, "empcache", _getEmp(body, tb));
+            }
+        }
 
-            AiNodeDeclare(node, "type", "constant STRING");
-            AiNodeSetStr(node, "type", "Points");
+        _setCommonAtr(node, body, tb);
+    };
+// ----------------------------------------------------------------------------
+    //Bakes the geometry itself into the scene, as Arnold-Render does
+    AtNode *
+    _inlineBody(const Nb::Body * body, const Nb::TimeBundle & tb) const
+    {
+        if (body->prop1s("type")->eval(tb) == Nb::String("Mesh"))
+            return NbAi::loadMesh(body,
+                                  _timePerFrame(body->constPointShape()),
+                                  NULL, NULL, NULL,
+                                  NbAi::bodyUserChannels(body, tb),
+                                  NbAi::bodyMotionKeys(body, tb));
 
-            AiNodeDeclare(node, "radius", "constant FLOAT");
-            AiNodeSetFlt(node, "radius", body->prop1f("radius")->eval(tb));
+        const NbAi::ParticleRadius radius = NbAi::particleRadius(body, tb);
+        bool cullCamera;
+        Nb::String cullBox;
+        float cullPad;
+        NbAi::CullRegion cull;
+        if (NbAi::bodyCull(body, tb, cullCamera, cullBox, cullPad))
+            cull = NbAi::cullRegion(cullCamera, cullBox,
+                                    cullPad + radius.bound());
 
-            AiNodeDeclare(node, "mode", "constant STRING");
-            const Nb::String & pMode = body->prop1s("particle-mode")->eval(tb);
-            AiNodeSetStr(node, "mode", pMode.c_str());
-        } else if (body->prop1s("type")->eval(tb) == Nb::String("Implicit")){
-            AtNode* nDFnode;
-            node = _createImplicitNode(body, tb, nDFnode);
+        return NbAi::loadParticles(
+                        body,
+                        body->prop1s("particle-mode")->eval(tb).c_str(),
+                        radius,
+                        _timePerFrame(body->constParticleShape()),
+                        NULL,
+                        NULL,
+                        NbAi::bodyUserChannels(body, tb),
+                        NbAi::bodyMotionKeys(body, tb),
+                        &cull);
+    };
+// ----------------------------------------------------------------------------
+    //Adds one procedural per non-empty cluster of split^3 tiles, bounded by
+    //what the cluster holds. Arnold only expands the clusters rays reach.
+    void
+    _addSplitBody(const Nb::Body *       body,
+                  const Nb::TimeBundle & tb,
+                  const int              split) const
+    {
+        const bool particles =
+            body->prop1s("type")->eval(tb) == Nb::String("Particle");
+        const float radius =
+            particles ? NbAi::particleRadius(body, tb).bound() : 0.f;
+        const float frametime = particles ?
+            _timePerFrame(body->constParticleShape()) :
+            _timePerFrame(body->constPointShape());
+
+        const int motionKeys = NbAi::bodyMotionKeys(body, tb);
+
+        //Meshes without velocity are blurred from the next frame, which the
+        //cluster bounds must hold too (see naiad_geo)
+        const Nb::Body * bodyNext = NULL;
+        if (!particles && frametime == 0 && _p.getTimePerFrame() != 0)
+            bodyNext = _readNextFrame(body, tb);
+
+        const NbAi::SplitGrid grid = NbAi::splitGrid(body, split, &_bounds);
+        std::vector<NbAi::SplitCell> cells;
+        NbAi::splitCells(body, grid, frametime, radius, cells, motionKeys,
+                         bodyNext);
+        delete bodyNext;
+
+        NB_INFO("Splitting " << body->name() << " in " << cells.size()
+                << " procedurals");
+
+        for (size_t c = 0; c < cells.size(); ++c){
+            const NbAi::SplitCell & cell = cells[c];
+            AtNode * node = _createProceduralNode(body, tb, &cell);
+            _setProceduralType(node, body, tb);
+
+            //Which cluster the procedural loads
+            AiNodeDeclare(node, "split_origin", "constant POINT");
+            AiNodeSetPnt(node, "split_origin",
+                         grid.origin[0], grid.origin[1], grid.origin[2]);
+            AiNodeDeclare(node, "split_size", "constant FLOAT");
+            AiNodeSetFlt(node, "split_size", grid.size);
+            AiNodeDeclare(node, "split_x", "constant INT");
+            AiNodeSetInt(node, "split_x", cell.cell[0]);
+            AiNodeDeclare(node, "split_y", "constant INT");
+            AiNodeSetInt(node, "split_y", cell.cell[1]);
+            AiNodeDeclare(node, "split_z", "constant INT");
+            AiNodeSetInt(node, "split_z", cell.cell[2]);
 
-            AiNodeSetStr(nDFnode, "empcache", _getEmp(body, tb));
+            //How many clusters share the body, which naiad_geo holds until
+            //they are all built
+            AiNodeDeclare(node, "split_count", "constant INT");
+            AiNodeSetInt(node, "split_count", static_cast<int>(cells.size()));
+
+            _setCommonAtr(node, body, tb);
+
+            //Node names must be unique
+            std::stringstream ss;
+            ss << AiNodeGetStr(node, "name") << "_" << c;
+            AiNodeSetStr(node, "name", ss.str().c_str());
         }
+    };
+// ----------------------------------------------------------------------------
+    //The body of the next frame, read from its EMP file as naiad_geo reads
+    //it. NULL if there is none.
+    const Nb::Body *
+    _readNextFrame(const Nb::Body * body, const Nb::TimeBundle & tb) const
+    {
+        std::stringstream ss;
+        ss << _getEmp(body, tb) << ".#.emp";
+        const Nb::String empFileName = Nb::sequenceToFilename(
+            "", ss.str(), tb.frame + 1, 0, _p.getPadding());
+        try {
+            Nb::EmpReader empReader(empFileName, body->name());
+            return empReader.ejectBody(body->name());
+        }
+        catch (std::exception &) {
+            return NULL;
+        }
+    };
+// ----------------------------------------------------------------------------
+    //Tells a procedural node what to render
+    void
+    _setProceduralType(AtNode *               node,
+                       const Nb::Body *       body,
+                       const Nb::TimeBundle & tb) const
+    {
+        AiNodeDeclare(node, "type", "constant STRING");
 
-        _setCommonAtr(node, body, tb);
+        AiNodeDeclare(node, "motion_keys", "constant INT");
+        AiNodeSetInt(node, "motion_keys", NbAi::bodyMotionKeys(body, tb));
+
+        const Nb::String userChannels = NbAi::bodyUserChannels(body, tb);
+        if (userChannels.size() > 0){
+            AiNodeDeclare(node, "user_channels", "constant STRING");
+            AiNodeSetStr(node, "user_channels", userChannels.c_str());
+        }
+
+        //Culling happens in naiad_geo, against the camera it renders with
+        bool cullCamera;
+        Nb::String cullBox;
+        float cullPad;
+        if (NbAi::bodyCull(body, tb, cullCamera, cullBox, cullPad)){
+            AiNodeDeclare(node, "cull_camera", "constant BOOL");
+            AiNodeSetBool(node, "cull_camera", cullCamera);
+            AiNodeDeclare(node, "cull_box", "constant STRING");
+            AiNodeSetStr(node, "cull_box", cullBox.c_str());
+            AiNodeDeclare(node, "cull_padding", "constant FLOAT");
+            AiNodeSetFlt(node, "cull_padding", cullPad);
+        }
+
+        if (body->prop1s("type")->eval(tb) == Nb::String("Mesh")){
+            AiNodeSetStr(node, "type", "Polymesh");
+            return;
+        }
+
+        Nb::String channel;
+        float iso;
+        if (NbAi::bodyImplicitMesh(body, tb, channel, iso)){
+            AiNodeSetStr(node, "type", "Isosurface");
+            AiNodeDeclare(node, "channel", "constant STRING");
+            AiNodeSetStr(node, "channel", channel.c_str());
+            AiNodeDeclare(node, "iso", "constant FLOAT");
+            AiNodeSetFlt(node, "iso", iso);
+            return;
+        }
+
+        AiNodeSetStr(node, "type", "Points");
+
+        const NbAi::ParticleRadius radius = NbAi::particleRadius(body, tb);
+        AiNodeDeclare(node, "radius", "constant FLOAT");
+        AiNodeSetFlt(node, "radius", radius.radius);
+        if (radius.channel.size() > 0){
+            AiNodeDeclare(node, "radius_channel", "constant STRING");
+            AiNodeSetStr(node, "radius_channel", radius.channel.c_str());
+            AiNodeDeclare(node, "radius_min", "constant FLOAT");
+            AiNodeSetFlt(node, "radius_min", radius.min);
+            AiNodeDeclare(node, "radius_max", "constant FLOAT");
+            AiNodeSetFlt(node, "radius_max", radius.max);
+        }
+
+        AiNodeDeclare(node, "mode", "constant STRING");
+        const Nb::String & pMode = body->prop1s("particle-mode")->eval(tb);
+        AiNodeSetStr(node, "mode", pMode.c_str());
     };
 // ----------------------------------------------------------------------------
     AtNode *
-    _createProceduralNode(const Nb::Body * body, const Nb::TimeBundle& tb) const
+    _createProceduralNode(const Nb::Body *        body,
+                          const Nb::TimeBundle&   tb,
+                          const NbAi::SplitCell * cell = NULL) const
     {
         AtNode * node = AiNode("procedural");
         //Link to procedural dso
@@ -124,7 +341,39 @@ private:
 
         //So Arnold when to load procedural
         Nb::Vec3f min, max;
-        NbAi::computeMinMax(body, min, max);
+        if (cell != NULL){
+            min = cell->min;
+            max = cell->max;
+        } else if (body->prop1s("type")->eval(tb) == Nb::String("Implicit")){
+            body->bounds(min, max);
+        } else {
+            //Padded as the split clusters are: by the point radius and by
+            //how far the points move over the motion keys
+            NbAi::computeMinMax(body, min, max, false, &_bounds);
+            const bool particles =
+                body->prop1s("type")->eval(tb) == Nb::String("Particle");
+            const float frametime = particles ?
+                _timePerFrame(body->constParticleShape()) :
+                _timePerFrame(body->constPointShape());
+            const float pad = NbAi::motionPad(body, frametime) +
+                (particles ? NbAi::particleRadius(body, tb).bound() : 0.f);
+            for (int k = 0; k < 3; ++k){
+                min[k] -= pad;
+                max[k] += pad;
+            }
+
+            //Meshes without velocity are blurred from the next frame
+            if (!particles && frametime == 0 && _p.getTimePerFrame() != 0){
+                const Nb::Body * bodyNext = _readNextFrame(body, tb);
+                if (bodyNext != NULL){
+                    Nb::Vec3f nextMin, nextMax;
+                    NbAi::computeMinMax(bodyNext, nextMin, nextMax);
+                    NbAi::minMaxLocal(nextMin, min, max);
+                    NbAi::minMaxLocal(nextMax, min, max);
+                    delete bodyNext;
+                }
+            }
+        }
         AiNodeSetPnt(node, "min", min[0], min[1], min[2]);
         AiNodeSetPnt(node, "max", max[0], max[1], max[2]);
 
@@ -174,8 +423,21 @@ private:
                 ss << " -l " << proceduralPath.substr(0, found);
             }
 
-            //Run system command (only linux?)
-            ::system(ss.str().c_str());
+            //Threads per kick, so that several fit on the machine
+            if (_p.getKickThreads() > 0)
+                ss << " -t " << _p.getKickThreads();
+
+            //Runs next to the following frames, up to Kick Jobs at a time,
+            //each with its own log. A single kick writes to the console.
+            KickScheduler & scheduler = KickScheduler::instance();
+            const bool single = _p.getKickJobs() <= 1;
+            scheduler.setJobs(_p.getKickJobs());
+            scheduler.submit(ss.str(), _p.getOutputAss(),
+                             single ? std::string() :
+                                 std::string(_p.getOutputAss()) + ".log",
+                             tb.frame);
+            if (single)
+                scheduler.wait();
         }
     };
 };
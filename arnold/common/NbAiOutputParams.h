@@ -54,7 +54,10 @@ public:
                  const int                 padding,
                  const Nb::String        outputAss = Nb::String(""),
                  const Nb::String          kickAss = Nb::String(""),
-                 const Nb::String          geoProc = Nb::String("")
+                 const Nb::String          geoProc = Nb::String(""),
+                 const int                kickJobs = 1,
+                 const int             kickThreads = 0,
+                 const bool         inlineGeometry = false
                 ):
                      _implicitShader(implicitShader),
                      _assScene(assScene),
@@ -69,7 +72,10 @@ public:
                      _timePerFrame( _motionBlur != 0 ? 1.f / _fps : 0.f),
                      _outputAss(outputAss),
                      _kickAss(kickAss),
-                     _geoProc(geoProc)
+                     _geoProc(geoProc),
+                     _kickJobs(kickJobs),
+                     _kickThreads(kickThreads),
+                     _inlineGeometry(inlineGeometry)
     {
         //
     };
@@ -88,6 +94,9 @@ public:
     const char * getOutputAss()      const { return _outputAss.c_str();};
     const char * getKickAss()        const { return _kickAss.c_str();};
     const char * getGeoProc()        const { return _geoProc.c_str();};
+    int          getKickJobs()       const { return _kickJobs;};
+    int          getKickThreads()    const { return _kickThreads;};
+    bool         getInlineGeometry() const { return _inlineGeometry;};
 // ----------------------------------------------------------------------------
     friend std::ostream &
     operator << (std::ostream& os,const OutputParams& p)
@@ -105,7 +114,10 @@ public:
                   << "\tTime Per Frame: " << p._timePerFrame << "\n"
                   << "\tOutput Ass: " << p._outputAss << "\n"
                   << "\tKick Ass: " << p._kickAss << "\n"
-                  << "\tGeo Procedural: " << p._geoProc << std::endl;
+                  << "\tGeo Procedural: " << p._geoProc << "\n"
+                  << "\tKick Jobs: " << p._kickJobs << "\n"
+                  << "\tKick Threads: " << p._kickThreads << "\n"
+                  << "\tInline Geometry: " << p._inlineGeometry << std::endl;
     };
 // ----------------------------------------------------------------------------
 private:
@@ -126,6 +138,9 @@ private:
     const Nb::String      _outputAss;
     const Nb::String        _kickAss;
     const Nb::String        _geoProc;
+    const int              _kickJobs;
+    const int           _kickThreads;
+    const bool       _inlineGeometry;
 // ----------------------------------------------------------------------------
     Nb::String
     _ArnoldImageFormat(const Nb::String & s) const
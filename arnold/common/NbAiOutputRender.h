@@ -70,19 +70,44 @@ public:
                 const float tFrame(_timePerFrame(body->constPointShape()));
 
                 //Let Arnold render directly from Mesh Shape
-                node = NbAi::loadMesh(body, tFrame);
+                node = NbAi::loadMesh(body, tFrame, NULL, NULL, NULL,
+                                      NbAi::bodyUserChannels(body, tb),
+                                      NbAi::bodyMotionKeys(body, tb));
             } else if(body->prop1s("type")->eval(tb) == Nb::String("Particle")){
                 const float tFrame(_timePerFrame(body->constParticleShape()));
+                const NbAi::ParticleRadius radius =
+                    NbAi::particleRadius(body, tb);
+
+                //Cull against the camera set up by Output
+                bool cullCamera;
+                Nb::String cullBox;
+                float cullPad;
+                NbAi::CullRegion cull;
+                if (NbAi::bodyCull(body, tb, cullCamera, cullBox, cullPad))
+                    cull = NbAi::cullRegion(cullCamera, cullBox,
+                                            cullPad + radius.bound());
 
                 //Let Arnold render directly from Particle Shape
                 node = NbAi::loadParticles(
                                 body,
                                 body->prop1s("particle-mode")->eval(tb).c_str(),
-                                body->prop1f("radius")->eval(tb),
-                                tFrame
+                                radius,
+                                tFrame,
+                                NULL,
+                                NULL,
+                                NbAi::bodyUserChannels(body, tb),
+                                NbAi::bodyMotionKeys(body, tb),
+                                &cull
                               );
             }else if (body->prop1s("type")->eval(tb) == Nb::String("Implicit")){
-                if (_allowImplicit){
+                Nb::String channel;
+                float iso;
+                if (NbAi::bodyImplicitMesh(body, tb, channel, iso)){
+                    //Mesh the surface once instead of sampling it per ray
+                    node = NbAi::loadIsosurface(
+                        body, channel, iso,
+                        _timePerFrame(body->constFieldShape()));
+                } else if (_allowImplicit){
                     AtNode* nDFnode;
                     node = _createImplicitNode(body, tb, nDFnode);
 
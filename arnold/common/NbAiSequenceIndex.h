@@ -0,0 +1,154 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiSequenceIndex.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Which frames of an EMP sequence are on disk. An index lists the names in
+// the directory of the sequence and keeps the frame numbers of the files
+// matching it, so existence and next or previous frame queries are answered
+// from memory without touching the files. The size and modification time of
+// a frame are only read from its file when a query asks for them. The time of the directory is checked at most every
+// few seconds, and the directory listed again only when that time changed,
+// that is when files are added, removed or renamed in it. A listing made
+// within the second the directory last changed may miss files added in that
+// second, so it is redone at the next check.
+//
+// Procedurals share one index per sequence through the empFrame() functions,
+// which are safe to call concurrently. The shared indices are listed afresh once the
+// session has no references left. Callers must hold a session reference
+// (NbAiSession.h).
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_SEQUENCE_INDEX_H
+#define NBAI_SEQUENCE_INDEX_H
+
+#include <../common/NbAiSession.h>
+
+#include <stdint.h>
+#include <set>
+#include <string>
+
+namespace Nb
+{
+class String;
+}
+
+namespace NbAi
+{
+
+//! One file of a sequence.
+struct SequenceFrame
+{
+    SequenceFrame() : frame(0), bytes(0), mtime(0) {}
+
+    int     frame;
+    int64_t bytes;
+    int64_t mtime;
+};
+
+// SequenceIndex
+// -------------
+//! The frames on disk of a sequence such as "path/name.#.emp", frame numbers
+//! padded to 'padding' digits as by Nb::sequenceToFilename(). Not safe to
+//! refresh while other threads query it.
+
+class NBAI_SESSION_API SequenceIndex
+{
+public:
+    //! Throws if the sequence has no '#'. The directory is not listed until
+    //! the first refresh(), and its time checked at most every
+    //! refreshSeconds after that.
+    SequenceIndex(const Nb::String & sequence, int padding,
+                  int refreshSeconds = 2);
+
+    //! Lists the directory if it changed since the last listing. Returns
+    //! true if it did. A missing directory holds no frames.
+    bool refresh();
+
+    //! True if the frame is on disk, its size and time in 'info' if given.
+    //! Without 'info' the listing answers, with it the file is stat'ed.
+    bool exists(int frame, SequenceFrame * info = NULL) const;
+
+    //! The first frame on disk after 'frame', false if there is none.
+    bool next(int frame, SequenceFrame & info) const;
+
+    //! The last frame on disk before 'frame', false if there is none.
+    bool previous(int frame, SequenceFrame & info) const;
+
+    //! Number of frames on disk.
+    int size() const
+    { return static_cast<int>(_frames.size()); }
+
+private:
+    bool _list();
+    bool _stat(int frame, SequenceFrame & info) const;
+
+    std::string   _directory;
+    std::string   _prefix;    //!< file name before the frame number
+    std::string   _suffix;    //!< file name after the frame number
+    int           _padding;
+    int           _refreshSeconds;
+    int64_t       _checked;   //!< when the directory time was last read
+    int64_t       _mtime;     //!< of the directory when listed
+    bool          _racy;      //!< listed within the second it was modified
+    bool          _listed;
+    std::set<int> _frames;
+};
+
+//! Looks 'frame' up in the shared index of 'sequence', refreshing it first.
+//! Same as SequenceIndex::exists().
+NBAI_SESSION_API bool
+empFrame(const Nb::String & sequence, int padding, int frame,
+         SequenceFrame * info = NULL);
+
+//! The first frame of 'sequence' on disk after 'frame', from the shared
+//! index. Same as SequenceIndex::next().
+NBAI_SESSION_API bool
+empNextFrame(const Nb::String & sequence, int padding, int frame,
+             SequenceFrame & info);
+
+//! The last frame of 'sequence' on disk before 'frame', from the shared
+//! index. Same as SequenceIndex::previous().
+NBAI_SESSION_API bool
+empPreviousFrame(const Nb::String & sequence, int padding, int frame,
+                 SequenceFrame & info);
+
+//! Forgets every shared listing, directories are listed again when next
+//! asked. Called when the session loses its last reference.
+NBAI_SESSION_API void flushSequenceIndex();
+
+} // namespace NbAi
+
+#endif // NBAI_SEQUENCE_INDEX_H
@@ -0,0 +1,103 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiSession.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// One Naiad Base session shared by every Naiad plug-in node in the process.
+// Procedurals and shaders are initialized concurrently by Arnold, so none of
+// them may call Nb::begin() or Nb::end() directly: each node acquires the
+// session when it is initialized and releases it when it is cleaned up. The
+// session begins with the first acquire and ends with the last release.
+// While the body cache keeps bodies for the next frame (NbAiBodyCache.h) it
+// ends with a later release instead, or when the host calls endSession()
+// after its last render. It is never ended from a static destructor, whose
+// order against Nb's is unspecified.
+//
+// The count lives in the NbAiSession shared library so that it is the same
+// for all plug-ins, whichever of them Arnold loads first.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_SESSION_H
+#define NBAI_SESSION_H
+
+#if defined(_WIN32)
+#  if defined(NBAI_SESSION_EXPORTS)
+#    define NBAI_SESSION_API __declspec(dllexport)
+#  else
+#    define NBAI_SESSION_API __declspec(dllimport)
+#  endif
+#else
+#  define NBAI_SESSION_API
+#endif
+
+namespace NbAi
+{
+
+//! Begins the Naiad Base session if this is the first reference.
+NBAI_SESSION_API void acquireSession();
+
+//! Ends the Naiad Base session if this was the last reference and no
+//! bodies are kept for the next frame.
+NBAI_SESSION_API void releaseSession();
+
+//! Number of references currently held.
+NBAI_SESSION_API int sessionReferences();
+
+//! Drops the bodies kept for a next frame and ends the session, if no node
+//! holds a reference. For hosts that keep the plug-ins loaded across
+//! renders, once the last one is done.
+NBAI_SESSION_API void endSession();
+
+// Session
+// -------
+//! Holds a session reference for its lifetime.
+
+class Session
+{
+public:
+    Session()
+    { acquireSession(); }
+
+    ~Session()
+    { releaseSession(); }
+
+private:
+    Session(const Session&);
+    Session& operator=(const Session&);
+};
+
+} // namespace NbAi
+
+#endif // NBAI_SESSION_H
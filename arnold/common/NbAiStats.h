@@ -0,0 +1,202 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiStats.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Load times and memory of the Naiad procedurals. naiad_geo times the
+// stages of building a node:
+//
+//   read      getting the bodies from the EMP files, or from the body cache
+//   select    picking the triangles or particles of a split cluster or of
+//             a cull region
+//   channels  uvs, radii and user data
+//   motion    motion keys
+//   arrays    allocating the Arnold arrays, copying positions and indices
+//   mesh      extracting the surface of an implicit rendered as a mesh
+//
+// and counts the bytes of the arrays it hands to Arnold and of the EMP files
+// its bodies come from. Particles and iso-surfaces are copied in one pass
+// over the blocks or tiles; the time of that pass is shared among arrays,
+// motion and channels by the thread time each took.
+//
+// NAIAD_ARNOLD_STATS sets what is reported through AiMsgInfo once a node is
+// built: 0 (default) nothing, 1 one line per procedural, 2 every stage as
+// well. If NAIAD_ARNOLD_STATS_FILE names a file, each procedural appends
+// one line to it with a JSON object of its counters, whatever the level.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_STATS_H
+#define NBAI_STATS_H
+
+#include <../common/NbAiSession.h>
+
+//Arnold API
+#include <ai_array.h>
+#include <ai_params.h>
+
+#include <sys/stat.h>
+#include <stdint.h>
+#include <ctime>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+namespace NbAi
+{
+
+enum LoadStage
+{
+    StageRead = 0,
+    StageSelect,
+    StageChannels,
+    StageMotion,
+    StageArrays,
+    StageMesh,
+    StageCount
+};
+
+//! Seconds since some fixed point, for differences only.
+inline double
+wallTime()
+{
+#ifdef _WIN32
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+#endif
+}
+
+//! Seconds since 'since', which is set to now.
+inline double
+lapTime(double & since)
+{
+    const double now = wallTime();
+    const double seconds = now - since;
+    since = now;
+    return seconds;
+}
+
+// LoadStats
+// ---------
+//! The counters of one procedural.
+
+struct LoadStats
+{
+    explicit LoadStats(const std::string & nodeName)
+        : node(nodeName), elements(0), arrayBytes(0), empBytes(0),
+          start(wallTime())
+    {
+        for (int s = 0; s < StageCount; ++s)
+            seconds[s] = 0;
+    }
+
+    //! Counts an array handed to Arnold.
+    void addArray(const AtArray * array)
+    {
+        if (array != NULL)
+            arrayBytes += int64_t(array->nelements) * array->nkeys *
+                AiParamGetTypeSize(array->type);
+    }
+
+    //! Counts an EMP file a body was read from.
+    void addEmp(const std::string & path)
+    {
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0)
+            empBytes += st.st_size;
+        emp += (emp.empty() ? "" : " ") + path;
+    }
+
+    //! Shares the wall time of a pass among stages by their thread times.
+    void addPass(const double wall, const double cpu[StageCount])
+    {
+        double total = 0;
+        for (int s = 0; s < StageCount; ++s)
+            total += cpu[s];
+        if (total > 0)
+            for (int s = 0; s < StageCount; ++s)
+                seconds[s] += wall * cpu[s] / total;
+    }
+
+    std::string node;
+    std::string type;
+    std::string emp;
+    int64_t     elements;
+    int64_t     arrayBytes;
+    int64_t     empBytes;
+    double      start;
+    double      seconds[StageCount];
+};
+
+// StageTimer
+// ----------
+//! Adds the time of a scope to a stage. Does nothing without stats.
+
+class StageTimer
+{
+public:
+    StageTimer(LoadStats * stats, const LoadStage stage)
+        : _stats(stats), _stage(stage),
+          _start(stats != NULL ? wallTime() : 0)
+    {}
+
+    ~StageTimer()
+    {
+        if (_stats != NULL)
+            _stats->seconds[_stage] += wallTime() - _start;
+    }
+
+private:
+    StageTimer(const StageTimer&);
+    StageTimer& operator=(const StageTimer&);
+
+    LoadStats *     _stats;
+    const LoadStage _stage;
+    const double    _start;
+};
+
+//! True if NAIAD_ARNOLD_STATS or NAIAD_ARNOLD_STATS_FILE asks for stats.
+NBAI_SESSION_API bool statsEnabled();
+
+//! Reports the counters of a finished procedural, see above.
+NBAI_SESSION_API void reportStats(const LoadStats & stats);
+
+} // namespace NbAi
+
+#endif // NBAI_STATS_H
@@ -0,0 +1,210 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiTileSampler.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+// Batched sampling of four fields that share a tile layout, typically the
+// distance and the three velocity components. The data tiles of a
+// FieldBounds hold a lattice of nodes with the four values interleaved, so
+// one tile lookup and one set of trilinear weights serve all four fields,
+// and the interpolation runs on SSE registers where available. Tiles own
+// their boundary nodes, so a lookup never touches a neighbour.
+//
+// Like FieldBounds the structure knows nothing about Naiad, nodes are filled
+// through set().
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_TILE_SAMPLER_H
+#define NBAI_TILE_SAMPLER_H
+
+#include <NbAiFieldBounds.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP)
+#define NBAI_TILE_SAMPLER_SSE
+#include <xmmintrin.h>
+#endif
+
+namespace NbAi
+{
+
+class TileSampler4
+{
+public:
+    TileSampler4()
+        : _bounds(0), _cells(0), _nodes(0)
+    {}
+
+    //! Bytes needed for the data tiles of bounds with cells^3 cells per
+    //! tile.
+    static size_t
+    bytesNeeded(const FieldBounds & bounds, const int cells)
+    {
+        const size_t n = cells + 1;
+        return size_t(bounds.dataTileCount()) * n * n * n * 4 * sizeof(float);
+    }
+
+    //! Allocates the nodes for the data tiles of bounds, which must outlive
+    //! the sampler.
+    void
+    init(const FieldBounds & bounds, const int cells)
+    {
+        _bounds = &bounds;
+        _cells = std::max(1, cells);
+        _nodes = (_cells + 1) * (_cells + 1) * (_cells + 1);
+        _values.assign(size_t(bounds.dataTileCount()) * _nodes * 4, 0.f);
+    }
+
+    bool   empty() const { return _values.empty(); }
+    int    cells() const { return _cells; }
+    size_t bytes() const { return _values.size() * sizeof(float); }
+
+    //! Position of node (i, j, k) of a tile.
+    void
+    nodePosition(const int tile, const int i, const int j, const int k,
+                 float x[3]) const
+    {
+        const int * dims = _bounds->dims();
+        _bounds->tileOrigin(tile % dims[0], (tile / dims[0]) % dims[1],
+                            tile / (dims[0] * dims[1]), x);
+        const float h = _bounds->tileSize() / _cells;
+        x[0] += i * h;
+        x[1] += j * h;
+        x[2] += k * h;
+    }
+
+    //! Sets the four values of node (i, j, k) of a data tile.
+    void
+    set(const int tile, const int i, const int j, const int k,
+        const float v[4])
+    {
+        float * dst = &_values[_node(_bounds->dataSlot(tile), i, j, k)];
+        dst[0] = v[0];
+        dst[1] = v[1];
+        dst[2] = v[2];
+        dst[3] = v[3];
+    }
+
+    //! Interpolates the four fields at x. Returns false if x is not inside
+    //! a data tile, out is left untouched then.
+    bool
+    sample(const float x[3], float out[4]) const
+    {
+        int tile, c[3];
+        float w[3];
+        if (!_locate(x, tile, c, w))
+            return false;
+        _trilinear(_bounds->dataSlot(tile), c, w, out);
+        return true;
+    }
+
+private:
+    size_t
+    _node(const int slot, const int i, const int j, const int k) const
+    {
+        return (size_t(slot) * _nodes +
+                (k * (_cells + 1) + j) * (_cells + 1) + i) * 4;
+    }
+
+    bool
+    _locate(const float x[3], int & tile, int c[3], float w[3]) const
+    {
+        if (_values.empty())
+            return false;
+        tile = _bounds->tileIndex(x);
+        if (tile < 0 || !_bounds->hasData(tile))
+            return false;
+        const float * origin = _bounds->origin();
+        for (int k = 0; k < 3; ++k) {
+            const float f = (x[k] - origin[k]) / _bounds->tileSize();
+            const float g = (f - std::floor(f)) * _cells;
+            c[k] = std::min(_cells - 1, static_cast<int>(g));
+            w[k] = std::min(1.f, g - c[k]);
+        }
+        return true;
+    }
+
+    void
+    _trilinear(const int slot, const int c[3], const float w[3],
+               float out[4]) const
+    {
+        const int sy = (_cells + 1) * 4;
+        const int sz = (_cells + 1) * sy;
+        const float * v = &_values[_node(slot, c[0], c[1], c[2])];
+#ifdef NBAI_TILE_SAMPLER_SSE
+        const __m128 wx = _mm_set1_ps(w[0]);
+        const __m128 wy = _mm_set1_ps(w[1]);
+        const __m128 wz = _mm_set1_ps(w[2]);
+        __m128 a, b;
+        a = _mm_loadu_ps(v);
+        b = _mm_loadu_ps(v + 4);
+        const __m128 x00 = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+        a = _mm_loadu_ps(v + sy);
+        b = _mm_loadu_ps(v + sy + 4);
+        const __m128 x10 = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+        a = _mm_loadu_ps(v + sz);
+        b = _mm_loadu_ps(v + sz + 4);
+        const __m128 x01 = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+        a = _mm_loadu_ps(v + sz + sy);
+        b = _mm_loadu_ps(v + sz + sy + 4);
+        const __m128 x11 = _mm_add_ps(a, _mm_mul_ps(wx, _mm_sub_ps(b, a)));
+        const __m128 y0 = _mm_add_ps(x00, _mm_mul_ps(wy, _mm_sub_ps(x10, x00)));
+        const __m128 y1 = _mm_add_ps(x01, _mm_mul_ps(wy, _mm_sub_ps(x11, x01)));
+        _mm_storeu_ps(out, _mm_add_ps(y0, _mm_mul_ps(wz, _mm_sub_ps(y1, y0))));
+#else
+        for (int ch = 0; ch < 4; ++ch) {
+            const float * u = v + ch;
+            const float x00 = u[0]       + w[0] * (u[4]           - u[0]);
+            const float x10 = u[sy]      + w[0] * (u[sy + 4]      - u[sy]);
+            const float x01 = u[sz]      + w[0] * (u[sz + 4]      - u[sz]);
+            const float x11 = u[sz + sy] + w[0] * (u[sz + sy + 4] - u[sz + sy]);
+            const float y0 = x00 + w[1] * (x10 - x00);
+            const float y1 = x01 + w[1] * (x11 - x01);
+            out[ch] = y0 + w[2] * (y1 - y0);
+        }
+#endif
+    }
+
+    const FieldBounds *  _bounds;
+    int                  _cells;    //!< per tile edge
+    int                  _nodes;    //!< per tile
+    std::vector<float>   _values;   //!< per data tile, per node, 4 values
+};
+
+} // namespace NbAi
+
+#endif // NBAI_TILE_SAMPLER_H
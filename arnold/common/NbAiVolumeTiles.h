@@ -0,0 +1,369 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiVolumeTiles.h
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Where a tiled volume is not empty, for renderer-side empty space skipping.
+// The field's tile lattice is covered by a dense grid of tiles. Each tile
+// stores the box of its cells that hold a value, or nothing if all of them
+// are empty. rayExtents() walks the tiles a ray crosses and reports the
+// intervals along it that overlap those boxes, adjacent ones merged, so a
+// ray marcher only steps where there is something to see.
+//
+// The structure knows nothing about Naiad: it is filled through
+// setActive(), see naiad_volume.cc.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef NBAI_VOLUME_TILES_H
+#define NBAI_VOLUME_TILES_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace NbAi
+{
+
+class VolumeTiles
+{
+public:
+    VolumeTiles()
+        : _tileSize(1.f), _cells(1), _activeCount(0)
+    {
+        _origin[0] = _origin[1] = _origin[2] = 0.f;
+        _dims[0] = _dims[1] = _dims[2] = 0;
+    }
+
+    //! Covers the box [min, max] with empty tiles of edge tileSize, each of
+    //! cells^3 cells (at most 255 a side).
+    void
+    init(const float min[3],
+         const float max[3],
+         const float tileSize,
+         const int   cells)
+    {
+        _tileSize = tileSize;
+        _cells = std::max(1, std::min(255, cells));
+        for (int k = 0; k < 3; ++k) {
+            _origin[k] = min[k];
+            _dims[k] = std::max(1, static_cast<int>(
+                std::ceil((max[k] - min[k]) / tileSize - 0.001f)));
+        }
+        _box.assign(size_t(tileCount()) * 6, 0);
+        for (size_t t = 0; t < _box.size(); t += 6)
+            _box[t] = 1;  // lo > hi, empty
+        _activeCount = 0;
+    }
+
+    int           tileCount() const { return _dims[0] * _dims[1] * _dims[2]; }
+    const int *   dims()      const { return _dims; }
+    const float * origin()    const { return _origin; }
+    float         tileSize()  const { return _tileSize; }
+    int           cells()     const { return _cells; }
+
+    //! Lower corner of tile (i, j, k).
+    void
+    tileOrigin(const int i, const int j, const int k, float o[3]) const
+    {
+        o[0] = _origin[0] + i * _tileSize;
+        o[1] = _origin[1] + j * _tileSize;
+        o[2] = _origin[2] + k * _tileSize;
+    }
+
+    //! Index of the tile holding x, -1 outside the grid.
+    int
+    tileIndex(const float x[3]) const
+    {
+        int c[3];
+        for (int k = 0; k < 3; ++k) {
+            const float f = (x[k] - _origin[k]) / _tileSize;
+            if (!(f >= 0.f))
+                return -1;
+            c[k] = static_cast<int>(f);
+            if (c[k] >= _dims[k])
+                return -1;
+        }
+        return (c[2] * _dims[1] + c[1]) * _dims[0] + c[0];
+    }
+
+    //! Sets the cells lo to hi (inclusive, per axis) of a tile as the ones
+    //! holding a value. Different tiles may be set concurrently.
+    void
+    setActive(const int tile, const int lo[3], const int hi[3])
+    {
+        unsigned char * box = &_box[size_t(tile) * 6];
+        for (int k = 0; k < 3; ++k) {
+            box[k] = static_cast<unsigned char>(
+                std::max(0, std::min(_cells - 1, lo[k])));
+            box[3 + k] = static_cast<unsigned char>(
+                std::max(0, std::min(_cells - 1, hi[k])));
+        }
+    }
+
+    bool
+    active(const int tile) const
+    {
+        return tile >= 0 &&
+            _box[size_t(tile) * 6] <= _box[size_t(tile) * 6 + 3];
+    }
+
+    //! Grows the active cells by n cells in every direction, into the
+    //! neighbouring tiles as well, so that they cover what an interpolating
+    //! sampler reaches from them. n must not exceed cells().
+    void
+    dilate(const int n)
+    {
+        std::vector<unsigned char> grown(_box);
+        for (int t = 0; t < tileCount(); ++t) {
+            const int ti = t % _dims[0];
+            const int tj = (t / _dims[0]) % _dims[1];
+            const int tk = t / (_dims[0] * _dims[1]);
+            const int tc[3] = { ti, tj, tk };
+            int lo[3], hi[3];
+            bool any = false;
+            for (int dk = -1; dk <= 1; ++dk)
+                for (int dj = -1; dj <= 1; ++dj)
+                    for (int di = -1; di <= 1; ++di) {
+                        const int nc[3] = { ti + di, tj + dj, tk + dk };
+                        if (nc[0] < 0 || nc[0] >= _dims[0] ||
+                            nc[1] < 0 || nc[1] >= _dims[1] ||
+                            nc[2] < 0 || nc[2] >= _dims[2])
+                            continue;
+                        const int nt =
+                            (nc[2] * _dims[1] + nc[1]) * _dims[0] + nc[0];
+                        if (!active(nt))
+                            continue;
+                        // The neighbour's grown box, in this tile's cells
+                        const unsigned char * box = &_box[size_t(nt) * 6];
+                        int a[3], b[3];
+                        bool overlaps = true;
+                        for (int k = 0; k < 3; ++k) {
+                            const int shift = (nc[k] - tc[k]) * _cells;
+                            a[k] = std::max(0, box[k] + shift - n);
+                            b[k] = std::min(_cells - 1,
+                                            box[3 + k] + shift + n);
+                            overlaps = overlaps && a[k] <= b[k];
+                        }
+                        if (!overlaps)
+                            continue;
+                        for (int k = 0; k < 3; ++k) {
+                            lo[k] = any ? std::min(lo[k], a[k]) : a[k];
+                            hi[k] = any ? std::max(hi[k], b[k]) : b[k];
+                        }
+                        any = true;
+                    }
+            if (any)
+                for (int k = 0; k < 3; ++k) {
+                    grown[size_t(t) * 6 + k] =
+                        static_cast<unsigned char>(lo[k]);
+                    grown[size_t(t) * 6 + 3 + k] =
+                        static_cast<unsigned char>(hi[k]);
+                }
+        }
+        _box.swap(grown);
+    }
+
+    //! Counts the active tiles, call once every tile is set.
+    int
+    countActive()
+    {
+        _activeCount = 0;
+        for (int t = 0; t < tileCount(); ++t)
+            if (active(t))
+                ++_activeCount;
+        return _activeCount;
+    }
+
+    int activeCount() const { return _activeCount; }
+
+    //! World box of the active cells of a tile.
+    void
+    activeBounds(const int tile, float min[3], float max[3]) const
+    {
+        const unsigned char * box = &_box[size_t(tile) * 6];
+        float o[3];
+        tileOrigin(tile % _dims[0], (tile / _dims[0]) % _dims[1],
+                   tile / (_dims[0] * _dims[1]), o);
+        const float h = _tileSize / _cells;
+        for (int k = 0; k < 3; ++k) {
+            min[k] = o[k] + box[k] * h;
+            max[k] = o[k] + (box[3 + k] + 1) * h;
+        }
+    }
+
+    //! World box of all active cells, false if there are none.
+    bool
+    bounds(float min[3], float max[3]) const
+    {
+        bool any = false;
+        for (int t = 0; t < tileCount(); ++t) {
+            if (!active(t))
+                continue;
+            float tmin[3], tmax[3];
+            activeBounds(t, tmin, tmax);
+            for (int k = 0; k < 3; ++k) {
+                min[k] = any ? std::min(min[k], tmin[k]) : tmin[k];
+                max[k] = any ? std::max(max[k], tmax[k]) : tmax[k];
+            }
+            any = true;
+        }
+        return any;
+    }
+
+    //! Calls add(ta, tb) for each interval of [t0, t1] along the ray
+    //! origin + t * direction that crosses active cells, in order. The
+    //! tiles are walked front to back; intervals that touch are merged.
+    template <class Add> void
+    rayExtents(const float origin[3],
+               const float direction[3],
+               const float t0,
+               const float t1,
+               Add &       add) const
+    {
+        if (_activeCount == 0)
+            return;
+
+        // Clip to the grid
+        float gmin[3], gmax[3];
+        for (int k = 0; k < 3; ++k) {
+            gmin[k] = _origin[k];
+            gmax[k] = _origin[k] + _dims[k] * _tileSize;
+        }
+        float tEnter = t0, tExit = t1;
+        if (!_slab(origin, direction, gmin, gmax, tEnter, tExit))
+            return;
+
+        // First tile, from a point just inside the grid
+        const float tMid = tEnter + 1e-4f * (tExit - tEnter);
+        int c[3], step[3];
+        float tNext[3], tDelta[3];
+        for (int k = 0; k < 3; ++k) {
+            const float x = origin[k] + tMid * direction[k];
+            c[k] = std::max(0, std::min(_dims[k] - 1, static_cast<int>(
+                std::floor((x - _origin[k]) / _tileSize))));
+            if (direction[k] > 0.f) {
+                step[k] = 1;
+                tNext[k] = (_origin[k] + (c[k] + 1) * _tileSize - origin[k]) /
+                    direction[k];
+                tDelta[k] = _tileSize / direction[k];
+            } else if (direction[k] < 0.f) {
+                step[k] = -1;
+                tNext[k] = (_origin[k] + c[k] * _tileSize - origin[k]) /
+                    direction[k];
+                tDelta[k] = -_tileSize / direction[k];
+            } else {
+                step[k] = 0;
+                tNext[k] = std::numeric_limits<float>::max();
+                tDelta[k] = std::numeric_limits<float>::max();
+            }
+        }
+
+        // Current run of touching intervals
+        bool  open = false;
+        float runStart = 0.f, runEnd = 0.f;
+        const float gap = 1e-5f * _tileSize;
+
+        float t = tEnter;
+        while (t < tExit) {
+            const int axis = tNext[0] < tNext[1] ?
+                (tNext[0] < tNext[2] ? 0 : 2) :
+                (tNext[1] < tNext[2] ? 1 : 2);
+            const float tileExit = std::min(tExit, tNext[axis]);
+
+            const int tile = (c[2] * _dims[1] + c[1]) * _dims[0] + c[0];
+            if (active(tile)) {
+                float bmin[3], bmax[3];
+                activeBounds(tile, bmin, bmax);
+                float a = t, b = tileExit;
+                if (_slab(origin, direction, bmin, bmax, a, b)) {
+                    if (open && a <= runEnd + gap) {
+                        runEnd = std::max(runEnd, b);
+                    } else {
+                        if (open)
+                            add(runStart, runEnd);
+                        open = true;
+                        runStart = a;
+                        runEnd = b;
+                    }
+                }
+            }
+
+            t = tileExit;
+            c[axis] += step[axis];
+            if (c[axis] < 0 || c[axis] >= _dims[axis])
+                break;
+            tNext[axis] += tDelta[axis];
+        }
+        if (open)
+            add(runStart, runEnd);
+    }
+
+    //! Bytes held by the tiles.
+    size_t bytes() const { return _box.size(); }
+
+private:
+    //! Clips [ta, tb] to the part of the ray inside [min, max].
+    static bool
+    _slab(const float o[3], const float d[3],
+          const float min[3], const float max[3], float & ta, float & tb)
+    {
+        for (int k = 0; k < 3; ++k) {
+            if (d[k] == 0.f) {
+                if (o[k] < min[k] || o[k] > max[k])
+                    return false;
+                continue;
+            }
+            float n = (min[k] - o[k]) / d[k];
+            float f = (max[k] - o[k]) / d[k];
+            if (n > f)
+                std::swap(n, f);
+            ta = std::max(ta, n);
+            tb = std::min(tb, f);
+        }
+        return ta <= tb;
+    }
+
+    float                      _origin[3];
+    float                      _tileSize;
+    int                        _dims[3];
+    int                        _cells;
+    int                        _activeCount;
+    std::vector<unsigned char> _box;  //!< per tile, lo[3] then hi[3] cells
+};
+
+} // namespace NbAi
+
+#endif // NBAI_VOLUME_TILES_H
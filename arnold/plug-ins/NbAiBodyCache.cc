@@ -0,0 +1,347 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiBodyCache.cc
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+
+#define NBAI_SESSION_EXPORTS
+#include <../common/NbAiBodyCache.h>
+
+//Naiad Base API
+#include <Nb.h>
+#include <NbBody.h>
+#include <NbEmpReader.h>
+
+//Arnold API
+#include <ai_critsec.h>
+#include <ai_msg.h>
+
+#include <sys/stat.h>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+namespace
+{
+
+struct Key
+{
+    std::string path;
+    std::string body;
+    int64_t     mtime;
+
+    bool operator<(const Key & rhs) const
+    {
+        if (path != rhs.path)
+            return path < rhs.path;
+        if (body != rhs.body)
+            return body < rhs.body;
+        return mtime < rhs.mtime;
+    }
+};
+
+// Entry
+// -----
+//! One cached body. The thread that creates an entry reads the body while
+//! holding 'loading', threads asking for the same body meanwhile wait on it.
+//! 'next' is set while the body was last acquired as a next frame, 'kept'
+//! once it has outlived a session for that.
+
+struct Entry
+{
+    Entry()
+        : body(NULL), references(0), bytes(0), lastUse(0), failed(false),
+          next(false), kept(false)
+    { AiCritSecInit(&loading); }
+
+    ~Entry()
+    { AiCritSecClose(&loading); }
+
+    const Nb::Body * body;
+    int              references;
+    int64_t          bytes;
+    uint64_t         lastUse;
+    bool             failed;
+    bool             next;
+    bool             kept;
+    AtCritSec        loading;
+};
+
+typedef std::map<Key, Entry *>                EntryMap;
+typedef std::map<const Nb::Body *, EntryMap::iterator> BodyMap;
+
+struct CacheState
+{
+    CacheState()
+        : budget(2048*int64_t(1024*1024)), clock(0), keepNext(false)
+    {
+        AiCritSecInit(&lock);
+        const char * env = std::getenv("NAIAD_ARNOLD_BODY_CACHE_MB");
+        if (env != NULL)
+            budget = std::atoi(env)*int64_t(1024*1024);
+        env = std::getenv("NAIAD_ARNOLD_KEEP_NEXT_FRAME");
+        if (env != NULL)
+            keepNext = (std::atoi(env) != 0);
+    }
+
+    // Bodies still cached here are left to the process: Nb may be gone
+    // already, endSession() is where they are released.
+    ~CacheState()
+    { AiCritSecClose(&lock); }
+
+    AtCritSec lock;
+    EntryMap  entries;
+    BodyMap   bodies;
+    int64_t   budget;
+    uint64_t  clock;
+    bool      keepNext;
+};
+
+CacheState cache;
+
+//! Size and modification time of a file, false if it doesn't exist.
+bool
+fileStat(const std::string & path, int64_t & bytes, int64_t & mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    bytes = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+//! Removes an unreferenced entry. Expects the cache lock.
+void
+erase(EntryMap::iterator it)
+{
+    Entry * entry = it->second;
+    if (entry->body != NULL)
+        cache.bodies.erase(entry->body);
+    delete entry->body;
+    delete entry;
+    cache.entries.erase(it);
+}
+
+//! Drops unreferenced entries, least recently used first, until they fit
+//! in budget. Next frames go last and failed reads always go. Expects the
+//! cache lock.
+void
+evict(const int64_t budget)
+{
+    int64_t retained = 0;
+    for (EntryMap::iterator it = cache.entries.begin();
+         it != cache.entries.end(); ) {
+        EntryMap::iterator cur = it++;
+        if (cur->second->references > 0)
+            continue;
+        if (cur->second->failed)
+            erase(cur);
+        else
+            retained += cur->second->bytes;
+    }
+
+    while (retained > budget) {
+        EntryMap::iterator oldest = cache.entries.end();
+        for (EntryMap::iterator it = cache.entries.begin();
+             it != cache.entries.end(); ++it) {
+            if (it->second->references > 0)
+                continue;
+            if (oldest == cache.entries.end() ||
+                it->second->next < oldest->second->next ||
+                (it->second->next == oldest->second->next &&
+                 it->second->lastUse < oldest->second->lastUse))
+                oldest = it;
+        }
+        if (oldest == cache.entries.end())
+            break;
+#ifndef NDEBUG
+        std::cerr << "NbAi:: Evicting body '" << oldest->first.body
+                  << "' of " << oldest->first.path << "\n";
+#endif
+        retained -= oldest->second->bytes;
+        erase(oldest);
+    }
+}
+
+} // anonymous namespace
+
+namespace NbAi
+{
+
+const Nb::Body *
+acquireBody(const Nb::String & empFileName, const Nb::String & bodyName,
+            const bool nextFrame)
+{
+    Key key;
+    key.path = empFileName;
+    key.body = bodyName;
+    int64_t bytes = 0;
+    if (!fileStat(key.path, bytes, key.mtime))
+        NB_THROW("Can't read EMP file: " << empFileName);
+
+    AiCritSecEnter(&cache.lock);
+
+    // A different version of the same file is stale once unreferenced.
+    for (EntryMap::iterator it = cache.entries.begin();
+         it != cache.entries.end(); ) {
+        EntryMap::iterator cur = it++;
+        if (cur->first.path == key.path && cur->first.mtime != key.mtime &&
+            cur->second->references == 0)
+            erase(cur);
+    }
+
+    EntryMap::iterator it = cache.entries.find(key);
+    if (it != cache.entries.end() && it->second->failed &&
+        it->second->references == 0) {
+        erase(it);
+        it = cache.entries.end();
+    }
+
+    Entry * entry = NULL;
+    bool    load = false;
+    if (it == cache.entries.end()) {
+        entry = new Entry();
+        entry->bytes = bytes;
+        AiCritSecEnter(&entry->loading);
+        it = cache.entries.insert(EntryMap::value_type(key, entry)).first;
+        load = true;
+    } else {
+        entry = it->second;
+    }
+    ++entry->references;
+    entry->lastUse = ++cache.clock;
+#ifndef NDEBUG
+    if (entry->kept && !nextFrame)
+        std::cerr << "NbAi:: Promoted next frame body '" << bodyName
+                  << "' of " << empFileName << "\n";
+#endif
+    entry->next = nextFrame;
+    entry->kept = false;
+
+    AiCritSecLeave(&cache.lock);
+
+    if (load) {
+        // Read outside the cache lock, other bodies load concurrently.
+        const Nb::Body * body = NULL;
+        try {
+            Nb::EmpReader empReader(empFileName, bodyName);
+            body = empReader.ejectBody(bodyName);
+        }
+        catch (std::exception & e) {
+            AiMsgError("%s", e.what());
+        }
+
+        AiCritSecEnter(&cache.lock);
+        entry->body = body;
+        entry->failed = (body == NULL);
+        if (body != NULL)
+            cache.bodies[body] = it;
+        AiCritSecLeave(&cache.lock);
+        AiCritSecLeave(&entry->loading);
+    } else {
+        // Wait for the thread reading the body.
+        AiCritSecEnter(&entry->loading);
+        AiCritSecLeave(&entry->loading);
+    }
+
+    if (entry->failed) {
+        AiCritSecEnter(&cache.lock);
+        --entry->references;
+        AiCritSecLeave(&cache.lock);
+        NB_THROW("Can't read body '" << bodyName << "' from " << empFileName);
+    }
+
+#ifndef NDEBUG
+    std::cerr << "NbAi:: " << (load ? "Read" : "Shared") << " body '"
+              << bodyName << "' of " << empFileName << "\n";
+#endif
+    return entry->body;
+}
+
+void
+releaseBody(const Nb::Body * body)
+{
+    if (body == NULL)
+        return;
+
+    AiCritSecEnter(&cache.lock);
+    BodyMap::iterator it = cache.bodies.find(body);
+    if (it != cache.bodies.end()) {
+        Entry * entry = it->second->second;
+        if (0 < entry->references && 0 == --entry->references)
+            evict(cache.budget);
+    }
+    AiCritSecLeave(&cache.lock);
+}
+
+void
+setBodyCacheBudget(const int64_t bytes)
+{
+    AiCritSecEnter(&cache.lock);
+    cache.budget = bytes;
+    evict(cache.budget);
+    AiCritSecLeave(&cache.lock);
+}
+
+void
+flushBodyCache()
+{
+    AiCritSecEnter(&cache.lock);
+    evict(0);
+    AiCritSecLeave(&cache.lock);
+}
+
+bool
+keepNextFrameBodies()
+{
+    AiCritSecEnter(&cache.lock);
+    for (EntryMap::iterator it = cache.entries.begin();
+         it != cache.entries.end(); ) {
+        EntryMap::iterator cur = it++;
+        Entry * entry = cur->second;
+        if (entry->references > 0)
+            continue;
+        if (!cache.keepNext || !entry->next || entry->kept || entry->failed)
+            erase(cur);
+        else
+            entry->kept = true;
+    }
+    evict(cache.budget);
+    const bool kept = !cache.entries.empty();
+    AiCritSecLeave(&cache.lock);
+    return kept;
+}
+
+} // namespace NbAi
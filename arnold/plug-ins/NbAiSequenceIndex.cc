@@ -0,0 +1,365 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiSequenceIndex.cc
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+
+#define NBAI_SESSION_EXPORTS
+#include <../common/NbAiSequenceIndex.h>
+
+//Naiad Base API
+#include <Nb.h>
+
+//Arnold API
+#include <ai_critsec.h>
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#endif
+
+namespace
+{
+
+//! Size and modification time of a file or directory, false if it doesn't
+//! exist.
+bool
+fileStat(const std::string & path, int64_t & bytes, int64_t & mtime)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+    bytes = st.st_size;
+    mtime = st.st_mtime;
+    return true;
+}
+
+//! Names of the entries of a directory, false if it can't be read.
+bool
+listDirectory(const std::string & directory, std::vector<std::string> & names)
+{
+#ifdef _WIN32
+    struct _finddata_t entry;
+    const intptr_t handle =
+        _findfirst((directory + "\\*").c_str(), &entry);
+    if (handle == -1)
+        return false;
+    do {
+        names.push_back(entry.name);
+    } while (_findnext(handle, &entry) == 0);
+    _findclose(handle);
+#else
+    DIR * dir = opendir(directory.c_str());
+    if (dir == NULL)
+        return false;
+    while (const struct dirent * entry = readdir(dir))
+        names.push_back(entry->d_name);
+    closedir(dir);
+#endif
+    return true;
+}
+
+//! The frame number as Nb::sequenceToFilename() writes it.
+std::string
+frameName(const int frame, const int padding)
+{
+    char buf[32];
+    std::sprintf(buf, "%0*d", padding, frame);
+    return buf;
+}
+
+} // anonymous namespace
+
+namespace NbAi
+{
+
+SequenceIndex::SequenceIndex(const Nb::String & sequence, const int padding,
+                             const int refreshSeconds)
+    : _padding(padding), _refreshSeconds(refreshSeconds), _checked(0),
+      _mtime(0), _racy(false), _listed(false)
+{
+    const std::string path(sequence);
+    std::string::size_type slash = path.find_last_of("/");
+#ifdef _WIN32
+    const std::string::size_type backslash = path.find_last_of("\\");
+    if (backslash != std::string::npos &&
+        (slash == std::string::npos || backslash > slash))
+        slash = backslash;
+#endif
+    const std::string::size_type base =
+        (slash == std::string::npos) ? 0 : slash + 1;
+    const std::string::size_type hash = path.find('#', base);
+    if (hash == std::string::npos)
+        NB_THROW("Not a frame sequence: " << sequence);
+
+    _directory = (slash == std::string::npos) ? "." :
+                 (slash == 0) ? "/" : path.substr(0, slash);
+    _prefix = path.substr(base, hash - base);
+    _suffix = path.substr(hash + 1);
+}
+
+bool
+SequenceIndex::refresh()
+{
+    const int64_t now = static_cast<int64_t>(std::time(NULL));
+    if (_listed && now - _checked < _refreshSeconds)
+        return false;
+    _checked = now;
+
+    int64_t bytes, mtime;
+    if (!fileStat(_directory, bytes, mtime)) {
+        const bool changed = !_listed || !_frames.empty();
+        _frames.clear();
+        _listed = true;
+        _racy = false;
+        _mtime = -1;
+        return changed;
+    }
+    if (_listed && !_racy && mtime == _mtime)
+        return false;
+
+    _mtime = mtime;
+    _racy = (mtime + 1 >= now);
+    _listed = true;
+    return _list();
+}
+
+bool
+SequenceIndex::_list()
+{
+    std::vector<std::string> names;
+    _frames.clear();
+    if (!listDirectory(_directory, names))
+        return true;
+
+    const std::string::size_type fixed = _prefix.size() + _suffix.size();
+    for (size_t i = 0; i < names.size(); ++i) {
+        const std::string & name = names[i];
+        if (name.size() <= fixed || name.size() > fixed + 11 ||
+            name.compare(0, _prefix.size(), _prefix) != 0 ||
+            name.compare(name.size() - _suffix.size(), _suffix.size(),
+                         _suffix) != 0)
+            continue;
+
+        // Only the digits Nb::sequenceToFilename() writes for the frame
+        const std::string digits =
+            name.substr(_prefix.size(), name.size() - fixed);
+        if (digits.find_first_not_of("-0123456789") != std::string::npos)
+            continue;
+        const int frame = std::atoi(digits.c_str());
+        if (frameName(frame, _padding) == digits)
+            _frames.insert(frame);
+    }
+
+#ifndef NDEBUG
+    std::cerr << "NbAi:: Listed " << _frames.size() << " frames of "
+              << _directory << "/" << _prefix << "#" << _suffix << "\n";
+#endif
+    return true;
+}
+
+bool
+SequenceIndex::_stat(const int frame, SequenceFrame & info) const
+{
+    info.frame = frame;
+    return fileStat(_directory + "/" + _prefix + frameName(frame, _padding) +
+                    _suffix, info.bytes, info.mtime);
+}
+
+bool
+SequenceIndex::exists(const int frame, SequenceFrame * info) const
+{
+    if (_frames.count(frame) == 0)
+        return false;
+    return info == NULL || _stat(frame, *info);
+}
+
+bool
+SequenceIndex::next(const int frame, SequenceFrame & info) const
+{
+    // Frames removed since the listing are skipped
+    for (std::set<int>::const_iterator it = _frames.upper_bound(frame);
+         it != _frames.end(); ++it)
+        if (_stat(*it, info))
+            return true;
+    return false;
+}
+
+bool
+SequenceIndex::previous(const int frame, SequenceFrame & info) const
+{
+    for (std::set<int>::const_iterator it = _frames.lower_bound(frame);
+         it != _frames.begin(); )
+        if (_stat(*--it, info))
+            return true;
+    return false;
+}
+
+} // namespace NbAi
+
+namespace
+{
+
+// Shared
+// ------
+//! An index shared by all procedurals. 'lock' serializes its refresh and
+//! queries, so that procedurals of different sequences don't wait on each
+//! other's directory listings. Shared indices live as long as the process:
+//! a thread may be about to lock one when another flushes.
+
+struct Shared
+{
+    Shared(const Nb::String & sequence, const int padding)
+        : index(sequence, padding), stale(false)
+    { AiCritSecInit(&lock); }
+
+    ~Shared()
+    { AiCritSecClose(&lock); }
+
+    NbAi::SequenceIndex index;
+    bool                stale;  //!< flushed, to be listed from scratch
+    AtCritSec           lock;
+};
+
+typedef std::map<std::pair<std::string, int>, Shared *> SharedMap;
+
+struct IndexState
+{
+    IndexState()
+    { AiCritSecInit(&lock); }
+
+    ~IndexState()
+    {
+        for (SharedMap::iterator it = indices.begin();
+             it != indices.end(); ++it)
+            delete it->second;
+        AiCritSecClose(&lock);
+    }
+
+    AtCritSec lock;
+    SharedMap indices;
+};
+
+IndexState state;
+
+//! The shared index of a sequence, refreshed and locked. Throws like
+//! SequenceIndex's constructor.
+Shared *
+enter(const Nb::String & sequence, const int padding)
+{
+    const SharedMap::key_type key(std::string(sequence), padding);
+
+    AiCritSecEnter(&state.lock);
+    SharedMap::iterator it = state.indices.find(key);
+    Shared * shared = NULL;
+    if (it != state.indices.end()) {
+        shared = it->second;
+    } else {
+        try {
+            shared = new Shared(sequence, padding);
+        }
+        catch (...) {
+            AiCritSecLeave(&state.lock);
+            throw;
+        }
+        state.indices[key] = shared;
+    }
+    AiCritSecLeave(&state.lock);
+
+    AiCritSecEnter(&shared->lock);
+    if (shared->stale) {
+        shared->index = NbAi::SequenceIndex(sequence, padding);
+        shared->stale = false;
+    }
+    shared->index.refresh();
+    return shared;
+}
+
+} // anonymous namespace
+
+namespace NbAi
+{
+
+bool
+empFrame(const Nb::String & sequence, const int padding, const int frame,
+         SequenceFrame * info)
+{
+    Shared * shared = enter(sequence, padding);
+    const bool found = shared->index.exists(frame, info);
+    AiCritSecLeave(&shared->lock);
+    return found;
+}
+
+bool
+empNextFrame(const Nb::String & sequence, const int padding, const int frame,
+             SequenceFrame & info)
+{
+    Shared * shared = enter(sequence, padding);
+    const bool found = shared->index.next(frame, info);
+    AiCritSecLeave(&shared->lock);
+    return found;
+}
+
+bool
+empPreviousFrame(const Nb::String & sequence, const int padding,
+                 const int frame, SequenceFrame & info)
+{
+    Shared * shared = enter(sequence, padding);
+    const bool found = shared->index.previous(frame, info);
+    AiCritSecLeave(&shared->lock);
+    return found;
+}
+
+void
+flushSequenceIndex()
+{
+    AiCritSecEnter(&state.lock);
+    for (SharedMap::iterator it = state.indices.begin();
+         it != state.indices.end(); ++it) {
+        AiCritSecEnter(&it->second->lock);
+        it->second->stale = true;
+        AiCritSecLeave(&it->second->lock);
+    }
+    AiCritSecLeave(&state.lock);
+}
+
+} // namespace NbAi
@@ -0,0 +1,142 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiSession.cc
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+
+#define NBAI_SESSION_EXPORTS
+#include <../common/NbAiSession.h>
+#include <../common/NbAiBodyCache.h>
+#include <../common/NbAiSequenceIndex.h>
+
+//Naiad Base API
+#include <Nb.h>
+
+//Arnold API
+#include <ai_critsec.h>
+
+namespace
+{
+
+// SessionState
+// ------------
+//! Reference count and its lock. Constructed when the library is loaded,
+//! before any plug-in can run. The session stays begun without references
+//! while the body cache keeps next frame bodies (NbAiBodyCache.h), until a
+//! later release or endSession().
+
+struct SessionState
+{
+    SessionState()
+        : references(0), begun(false)
+    { AiCritSecInit(&lock); }
+
+    ~SessionState()
+    { AiCritSecClose(&lock); }
+
+    AtCritSec lock;
+    int       references;
+    bool      begun;
+};
+
+SessionState state;
+
+} // anonymous namespace
+
+namespace NbAi
+{
+
+void acquireSession()
+{
+    AiCritSecEnter(&state.lock);
+    try {
+        if (!state.begun) {
+            Nb::begin();
+            state.begun = true;
+        }
+        ++state.references;
+    }
+    catch (...) {
+        AiCritSecLeave(&state.lock);
+        throw;
+    }
+    AiCritSecLeave(&state.lock);
+}
+
+void releaseSession()
+{
+    AiCritSecEnter(&state.lock);
+    if (0 < state.references && 0 == --state.references) {
+        try {
+            // The next render lists the sequences afresh
+            flushSequenceIndex();
+
+            // Cached bodies can't outlive the session, which is kept for
+            // the bodies the next render will ask for.
+            if (!keepNextFrameBodies()) {
+                state.begun = false;
+                Nb::end();
+            }
+        }
+        catch (...) {
+            // Nothing sensible to do while a node is being torn down.
+        }
+    }
+    AiCritSecLeave(&state.lock);
+}
+
+int sessionReferences()
+{
+    AiCritSecEnter(&state.lock);
+    const int references(state.references);
+    AiCritSecLeave(&state.lock);
+    return references;
+}
+
+void endSession()
+{
+    AiCritSecEnter(&state.lock);
+    if (state.references == 0 && state.begun) {
+        try {
+            flushBodyCache();
+            state.begun = false;
+            Nb::end();
+        }
+        catch (...) {
+            // The host is shutting down, nothing sensible to do.
+        }
+    }
+    AiCritSecLeave(&state.lock);
+}
+
+} // namespace NbAi
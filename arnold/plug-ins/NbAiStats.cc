@@ -0,0 +1,163 @@
+// ----------------------------------------------------------------------------
+//
+// NbAiStats.cc
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+
+#define NBAI_SESSION_EXPORTS
+#include <../common/NbAiStats.h>
+
+//Arnold API
+#include <ai_critsec.h>
+#include <ai_msg.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+namespace
+{
+
+const char * stageNames[NbAi::StageCount] =
+    { "read", "select", "channels", "motion", "arrays", "mesh" };
+
+struct StatsState
+{
+    StatsState()
+        : level(0)
+    {
+        AiCritSecInit(&lock);
+        const char * env = std::getenv("NAIAD_ARNOLD_STATS");
+        if (env != NULL)
+            level = std::atoi(env);
+        env = std::getenv("NAIAD_ARNOLD_STATS_FILE");
+        if (env != NULL)
+            file = env;
+    }
+
+    ~StatsState()
+    { AiCritSecClose(&lock); }
+
+    AtCritSec   lock;
+    int         level;
+    std::string file;
+};
+
+StatsState state;
+
+//! A string as a JSON string literal.
+std::string
+quoted(const std::string & s)
+{
+    std::string q("\"");
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            q += '\\';
+            q += c;
+        } else if (c < 0x20) {
+            char hex[8];
+            std::sprintf(hex, "\\u%04x", c);
+            q += hex;
+        } else {
+            q += c;
+        }
+    }
+    return q + "\"";
+}
+
+double
+megabytes(const int64_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+} // anonymous namespace
+
+namespace NbAi
+{
+
+bool
+statsEnabled()
+{
+    return state.level > 0 || !state.file.empty();
+}
+
+void
+reportStats(const LoadStats & stats)
+{
+    const double total = wallTime() - stats.start;
+
+    if (state.level > 0)
+        AiMsgInfo("naiad_geo: %s: %s, %lld elements in %.3fs, "
+                  "arrays %.1f MB, EMP %.1f MB", stats.node.c_str(),
+                  stats.type.c_str(), static_cast<long long>(stats.elements),
+                  total, megabytes(stats.arrayBytes),
+                  megabytes(stats.empBytes));
+    if (state.level > 1)
+        AiMsgInfo("naiad_geo: %s: read %.3fs, select %.3fs, "
+                  "channels %.3fs, motion %.3fs, arrays %.3fs, mesh %.3fs",
+                  stats.node.c_str(),
+                  stats.seconds[StageRead], stats.seconds[StageSelect],
+                  stats.seconds[StageChannels], stats.seconds[StageMotion],
+                  stats.seconds[StageArrays], stats.seconds[StageMesh]);
+
+    if (state.file.empty())
+        return;
+
+    std::ostringstream json;
+    json << "{\"node\": " << quoted(stats.node)
+         << ", \"type\": " << quoted(stats.type)
+         << ", \"emp\": " << quoted(stats.emp)
+         << ", \"elements\": " << stats.elements
+         << ", \"array_bytes\": " << stats.arrayBytes
+         << ", \"emp_bytes\": " << stats.empBytes
+         << ", \"seconds\": {\"total\": " << total;
+    for (int s = 0; s < StageCount; ++s)
+        json << ", " << quoted(stageNames[s]) << ": " << stats.seconds[s];
+    json << "}}\n";
+
+    //Procedurals finish concurrently, one line at a time
+    AiCritSecEnter(&state.lock);
+    FILE * f = std::fopen(state.file.c_str(), "a");
+    if (f != NULL) {
+        std::fputs(json.str().c_str(), f);
+        std::fclose(f);
+    } else {
+        AiMsgWarning("naiad_geo: Can't write stats to %s",
+                     state.file.c_str());
+    }
+    AiCritSecLeave(&state.lock);
+}
+
+} // namespace NbAi
@@ -43,16 +43,325 @@
 #include <NbFilename.h>
 #include <NbEmpSequenceReader.h>
 
+#include <../common/NbAiSession.h>
+#include <../common/NbAiBodyCache.h>
+#include <../common/NbAiFieldBounds.h>
+#include <../common/NbAiAdvectedField.h>
+#include <../common/NbAiTileSampler.h>
+
 #include <iostream>
+#include <cmath>
+#include <vector>
 
 AI_SHADER_NODE_EXPORT_METHODS(NaiadDistanceMethods);
 
-const Nb::Body* body(0);
-const Nb::Field1f* fldDistance(0);
-const Nb::Field1f* u(0);
-const Nb::Field1f* v(0);
-const Nb::Field1f* w(0);
-float              level(0);
+// Everything one shader instance uses. Several implicits may be rendered
+// with their own naiad_distance_field, so nothing is kept in globals.
+struct NaiadDistanceData
+{
+    NaiadDistanceData()
+        : body(0), ownsBody(false), fldDistance(0), u(0), v(0), w(0),
+          level(0), dt(1./24.), accelerate(false), band(0)
+    {}
+
+    const Nb::Body*    body;
+    bool               ownsBody;    // acquired from the body cache
+    const Nb::Field1f* fldDistance;
+    const Nb::Field1f* u;
+    const Nb::Field1f* v;
+    const Nb::Field1f* w;
+    float              level;
+    double             dt;          // seconds per frame
+
+    // Early outs away from the surface, see NbAiFieldBounds.h
+    bool               accelerate;
+    NbAi::FieldBounds  bounds;
+    float              band;        // world units
+
+    // Distance advected to a few shutter times, see NbAiAdvectedField.h
+    NbAi::AdvectedField advected;
+
+    // Distance and velocity interleaved, see NbAiTileSampler.h
+    NbAi::TileSampler4  sampler;
+};
+
+// Frame rate of the scene, declared on the options node by NbAi::Output.
+// Scenes written by hand may not have it, assume film then.
+static double
+sceneFps()
+{
+    const AtNode * options = AiUniverseGetOptions();
+    if (options != 0 && AiNodeLookUpUserParameter(options, "fps") != 0) {
+        const float fps = AiNodeGetFlt(options, "fps");
+        if (fps > 0.f)
+            return fps;
+    }
+    return 24.;
+}
+
+// Shutter interval of the render camera, in frames.
+static void
+sceneShutter(float & start, float & end)
+{
+    start = end = 0.f;
+    const AtNode * options = AiUniverseGetOptions();
+    const AtNode * camera = options != 0 ?
+        reinterpret_cast<const AtNode*>(AiNodeGetPtr(options, "camera")) : 0;
+    if (camera != 0) {
+        start = AiNodeGetFlt(camera, "shutter_start");
+        end = AiNodeGetFlt(camera, "shutter_end");
+    }
+}
+
+// The cubic sampler reads two voxels on either side of the sample point, and
+// its Catmull-Rom weights sum to at most 1.25 in absolute value per axis, so
+// a sample overshoots the voxels it reads by at most 1.25^3.
+static const int   cubicHalo = 2;
+static const float cubicOvershoot = 1.25f * 1.25f * 1.25f;
+
+// The quadratic sampler reads the voxels within one and a half voxels.
+static const float quadraticReach = 1.5f;
+
+// Largest |voxel| of the field in every tile of the bounds. The blocks of the
+// field follow the tiles of the layout; tiles without voxels hold the value
+// the field has away from its tiles.
+static void
+tileMaxAbs(const Nb::Field1f &       field,
+           const Nb::TileLayout &    layout,
+           const NbAi::FieldBounds & bounds,
+           const float               background,
+           std::vector<float> &      tileMax)
+{
+    const int blockCount =
+        std::min(field.block_count(), layout.fineTileCount());
+    std::vector<float> blockMax(blockCount, -1.f);
+#pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < blockCount; ++b) {
+        const Nb::Block1f & block = field(b);
+        if (block.size() == 0)
+            continue;
+        float m = 0.f;
+        for (int64_t i = 0; i < block.size(); ++i)
+            m = std::max(m, std::fabs(block(i)));
+        blockMax[b] = m;
+    }
+
+    tileMax.assign(bounds.tileCount(), -1.f);
+    Nb::Vec3f tileMin, tileMaxCorner;
+    for (int b = 0; b < blockCount; ++b) {
+        if (blockMax[b] < 0.f)
+            continue;
+        layout.tileBounds(b, tileMin, tileMaxCorner);
+        const float center[3] = { 0.5f * (tileMin[0] + tileMaxCorner[0]),
+                                  0.5f * (tileMin[1] + tileMaxCorner[1]),
+                                  0.5f * (tileMin[2] + tileMaxCorner[2]) };
+        const int tile = bounds.tileIndex(center);
+        if (tile >= 0)
+            tileMax[tile] = std::max(tileMax[tile], blockMax[b]);
+    }
+    for (size_t t = 0; t < tileMax.size(); ++t)
+        if (tileMax[t] < 0.f)
+            tileMax[t] = std::fabs(background);
+}
+
+// Fills the field bounds from the tiles of the body's layout. Tiles without
+// data are sampled once at their center, tiles with data once per sub-cell.
+// The speed of every tile is bounded by the largest voxel velocity of the
+// tile and of the cubic kernel's halo around it, times the kernel's
+// overshoot, so that constant tiles near data know how far a lookup moves.
+static void
+buildFieldBounds(NaiadDistanceData & data, const int subCells)
+{
+    const Nb::TileLayout & layout = data.body->constLayout();
+    const int tileCount = layout.fineTileCount();
+    if (tileCount == 0)
+        return;
+
+    Nb::Vec3f tileMin, tileMax, min, max;
+    layout.tileBounds(0, tileMin, tileMax);
+    layout.allTileBounds(min, max);
+    const float tileSize = tileMax[0] - tileMin[0];
+
+    // Whatever the field holds away from its tiles
+    const Nb::Vec3f outside(min[0] - tileSize, min[1] - tileSize,
+                            min[2] - tileSize);
+    const float background =
+        Nb::sampleFieldQuadratic1f(outside, layout, *data.fldDistance);
+
+    const float fmin[3] = { min[0], min[1], min[2] };
+    const float fmax[3] = { max[0], max[1], max[2] };
+    NbAi::FieldBounds & bounds = data.bounds;
+    bounds.init(fmin, fmax, tileSize, subCells, background,
+                quadraticReach * layout.cellSize());
+
+    for (int t = 0; t < tileCount; ++t) {
+        layout.tileBounds(t, tileMin, tileMax);
+        const float center[3] = { 0.5f * (tileMin[0] + tileMax[0]),
+                                  0.5f * (tileMin[1] + tileMax[1]),
+                                  0.5f * (tileMin[2] + tileMax[2]) };
+        const int tile = bounds.tileIndex(center);
+        if (tile >= 0)
+            bounds.addDataTile(tile);
+    }
+
+    const int * dims = bounds.dims();
+    const float sub = tileSize / bounds.subCells();
+    const int n = bounds.subCells();
+
+    // Largest velocity components per tile, and how many tiles around a tile
+    // the cubic kernel reaches into
+    std::vector<float> maxAbs[3];
+    float outsideAbs[3];
+    const Nb::Field1f * velocity[3] = { data.u, data.v, data.w };
+    for (int k = 0; k < 3; ++k) {
+        outsideAbs[k] = std::fabs(
+            Nb::sampleFieldCubic1f(outside, layout, *velocity[k]));
+        tileMaxAbs(*velocity[k], layout, bounds, outsideAbs[k], maxAbs[k]);
+    }
+    const int halo = std::max(1, static_cast<int>(
+        std::ceil(cubicHalo * layout.cellSize() / tileSize)));
+
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < bounds.tileCount(); ++tile) {
+        const int i = tile % dims[0];
+        const int j = (tile / dims[0]) % dims[1];
+        const int k = tile / (dims[0] * dims[1]);
+
+        // Past the grid the velocity is whatever it is away from the tiles
+        float u[3] = { 0.f, 0.f, 0.f };
+        for (int c = k - halo; c <= k + halo; ++c)
+            for (int b = j - halo; b <= j + halo; ++b)
+                for (int a = i - halo; a <= i + halo; ++a) {
+                    const bool inside = a >= 0 && a < dims[0] &&
+                        b >= 0 && b < dims[1] && c >= 0 && c < dims[2];
+                    const int t = inside ? (c * dims[1] + b) * dims[0] + a
+                                         : -1;
+                    for (int d = 0; d < 3; ++d)
+                        u[d] = std::max(u[d], inside ? maxAbs[d][t]
+                                                     : outsideAbs[d]);
+                }
+        bounds.setMaxSpeed(tile, cubicOvershoot *
+                           std::sqrt(u[0]*u[0] + u[1]*u[1] + u[2]*u[2]));
+
+        float o[3];
+        bounds.tileOrigin(i, j, k, o);
+
+        if (!bounds.hasData(tile)) {
+            const Nb::Vec3f x(o[0] + 0.5f * tileSize, o[1] + 0.5f * tileSize,
+                              o[2] + 0.5f * tileSize);
+            bounds.setConstant(tile, Nb::sampleFieldQuadratic1f(
+                                   x, layout, *data.fldDistance));
+            continue;
+        }
+
+        for (int c = 0; c < n; ++c)
+            for (int b = 0; b < n; ++b)
+                for (int a = 0; a < n; ++a) {
+                    const Nb::Vec3f x(o[0] + (a + 0.5f) * sub,
+                                      o[1] + (b + 0.5f) * sub,
+                                      o[2] + (c + 0.5f) * sub);
+                    bounds.setSubCell(tile, a, b, c, Nb::sampleFieldQuadratic1f(
+                                          x, layout, *data.fldDistance));
+                }
+    }
+    bounds.finish();
+}
+
+// Bakes the distance advected back along the velocity, exactly as
+// shader_evaluate does it, at the nodes of every data tile for each of the
+// given shutter times. The node spacing starts at the voxel size and is
+// coarsened until the bake fits in maxBytes.
+static void
+bakeAdvectedField(NaiadDistanceData &        data,
+                  const std::vector<float> & times,
+                  const size_t               maxBytes)
+{
+    const Nb::TileLayout & layout = data.body->constLayout();
+    const NbAi::FieldBounds & bounds = data.bounds;
+    int cells = std::max(1, static_cast<int>(
+        bounds.tileSize() / layout.cellSize() + 0.5f));
+    while (cells > 1 &&
+           NbAi::AdvectedField::bytesNeeded(bounds, cells, times.size()) >
+           maxBytes)
+        cells /= 2;
+    if (NbAi::AdvectedField::bytesNeeded(bounds, cells, times.size()) >
+        maxBytes) {
+        AiMsgWarning("naiad_distance_field: %d tiles do not fit in the bake "
+                     "budget, shading unbaked", bounds.dataTileCount());
+        return;
+    }
+
+    NbAi::AdvectedField & advected = data.advected;
+    advected.init(bounds, cells, times);
+
+    const int timeCount = static_cast<int>(times.size());
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < bounds.tileCount(); ++tile) {
+        if (!bounds.hasData(tile))
+            continue;
+        for (int k = 0; k <= cells; ++k)
+            for (int j = 0; j <= cells; ++j)
+                for (int i = 0; i <= cells; ++i) {
+                    float p[3];
+                    advected.nodePosition(tile, i, j, k, p);
+                    const Nb::Vec3f x(p[0], p[1], p[2]);
+                    const float ux =
+                        -Nb::sampleFieldCubic1f(x, layout, *data.u);
+                    const float vx =
+                        -Nb::sampleFieldCubic1f(x, layout, *data.v);
+                    const float wx =
+                        -Nb::sampleFieldCubic1f(x, layout, *data.w);
+                    for (int t = 0; t < timeCount; ++t) {
+                        const float s = static_cast<float>(times[t] * data.dt);
+                        const Nb::Vec3f y(x[0] + s*ux, x[1] + s*vx,
+                                          x[2] + s*wx);
+                        advected.set(tile, t, i, j, k,
+                                     Nb::sampleFieldQuadratic1f(
+                                         y, layout, *data.fldDistance));
+                    }
+                }
+    }
+}
+
+// Copies distance and velocity at the voxel corners of every data tile into
+// the sampler, in parallel over tiles.
+static void
+buildTileSampler(NaiadDistanceData & data, const size_t maxBytes)
+{
+    const Nb::TileLayout & layout = data.body->constLayout();
+    const NbAi::FieldBounds & bounds = data.bounds;
+    const int cells = std::max(1, static_cast<int>(
+        bounds.tileSize() / layout.cellSize() + 0.5f));
+    if (NbAi::TileSampler4::bytesNeeded(bounds, cells) > maxBytes) {
+        AiMsgWarning("naiad_distance_field: %d tiles do not fit in the "
+                     "sampler budget, using the Naiad samplers",
+                     bounds.dataTileCount());
+        return;
+    }
+
+    NbAi::TileSampler4 & sampler = data.sampler;
+    sampler.init(bounds, cells);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < bounds.tileCount(); ++tile) {
+        if (!bounds.hasData(tile))
+            continue;
+        for (int k = 0; k <= cells; ++k)
+            for (int j = 0; j <= cells; ++j)
+                for (int i = 0; i <= cells; ++i) {
+                    float p[3];
+                    sampler.nodePosition(tile, i, j, k, p);
+                    const Nb::Vec3f x(p[0], p[1], p[2]);
+                    const float v[4] = {
+                        Nb::sampleFieldQuadratic1f(x, layout,
+                                                   *data.fldDistance),
+                        Nb::sampleFieldCubic1f(x, layout, *data.u),
+                        Nb::sampleFieldCubic1f(x, layout, *data.v),
+                        Nb::sampleFieldCubic1f(x, layout, *data.w) };
+                    sampler.set(tile, i, j, k, v);
+                }
+    }
+}
 
 node_parameters
 {
@@ -63,28 +372,80 @@ node_parameters
    AiParameterSTR("channel" , "fluid-distance");
    AiParameterSTR("pointerBody", "");
    AiParameterFLT("level", 0);
+   AiParameterBOOL("accelerate", true);
+   AiParameterINT("accel_subcells", 4);
+   AiParameterFLT("accel_band", 2);
+   AiParameterINT("bake_samples", 0);
+   AiParameterINT("bake_memory", 256);
+   AiParameterBOOL("fast_sampling", false);
 }
 
 shader_evaluate
 {
+   const NaiadDistanceData * data =
+       reinterpret_cast<const NaiadDistanceData*>(AiNodeGetLocalData(node));
+   if (data == 0 || data->fldDistance == 0)
+       return;
+
    try
    {
+       const double time = sg->time;
+
+       // Far from the surface, a conservative distance is enough
+       float far;
+       const float p[3] = { sg->P.x, sg->P.y, sg->P.z };
+       if (data->accelerate &&
+           data->bounds.query(p, std::fabs(time*data->dt), data->band, far)) {
+           sg->out.FLT = data->level + far;
+           return;
+       }
+
+       // Between the baked shutter times
+       if (time != 0 &&
+           data->advected.lookup(p, static_cast<float>(time), far)) {
+           sg->out.FLT = data->level + far;
+           return;
+       }
+
+       // One interpolation for distance and velocity, a second one for
+       // the advected distance
+       float s[4];
+       if (data->sampler.sample(p, s)) {
+           if (time == 0) {
+               sg->out.FLT = data->level + s[0];
+               return;
+           }
+           const float dx = static_cast<float>(time*data->dt);
+           const float q[3] = { p[0] - dx*s[1], p[1] - dx*s[2],
+                                p[2] - dx*s[3] };
+           float d[4];
+           if (data->sampler.sample(q, d)) {
+               sg->out.FLT = data->level + d[0];
+               return;
+           }
+       }
+
        const Nb::Vec3f x(sg->P.x, sg->P.y, sg->P.z);
+       const Nb::TileLayout & layout = data->body->constLayout();
+
+       // Without a shutter offset there is nothing to advect
+       if (time == 0) {
+           sg->out.FLT = data->level +
+               Nb::sampleFieldQuadratic1f(x,layout,*data->fldDistance);
+           return;
+       }
 
        const float ux =
-           -Nb::sampleFieldCubic1f(x,body->constLayout(),*u);
+           -Nb::sampleFieldCubic1f(x,layout,*data->u);
        const float vx =
-           -Nb::sampleFieldCubic1f(x,body->constLayout(),*v);
+           -Nb::sampleFieldCubic1f(x,layout,*data->v);
        const float wx =
-           -Nb::sampleFieldCubic1f(x,body->constLayout(),*w);
+           -Nb::sampleFieldCubic1f(x,layout,*data->w);
 
-       const double dt=1./24.;
-       const double time = sg->time;
-
-       const Nb::Vec3f dx=time*dt*Nb::Vec3f(ux,vx,wx);
+       const Nb::Vec3f dx=time*data->dt*Nb::Vec3f(ux,vx,wx);
        
-       sg->out.FLT = level + 
-           Nb::sampleFieldQuadratic1f(x+dx,body->constLayout(),*fldDistance);
+       sg->out.FLT = data->level + 
+           Nb::sampleFieldQuadratic1f(x+dx,layout,*data->fldDistance);
    }
    catch(std::exception& e)
    {
@@ -94,10 +455,13 @@ shader_evaluate
 
 node_initialize
 {
+   NaiadDistanceData * data = new NaiadDistanceData;
+   AiNodeSetLocalData(node, data);
+
    try
    {
-       // initialize the Naiad Base (Nb) library
-       Nb::begin();
+       // Naiad Base (Nb) session, shared with the other Naiad nodes
+       NbAi::acquireSession();
 
        if (std::string(AiNodeGetStr(node,"pointerBody")).size() == 0) {
 
@@ -112,30 +476,81 @@ node_initialize
                                       AiNodeGetInt(node,"frame"), // frame
                                       0, // timestep
                                       AiNodeGetInt(node,"padding")); // padding
-           // get access all the bodies in the EMP corresponding to this frame
-           Nb::EmpReader empReader(empFilename,"*");
-           // eject the one we want to render
-           body = empReader.ejectBody(AiNodeGetStr(node,"body"));
+           // get the body we want to render, shared with any other Naiad
+           // node that reads it from the same EMP
+           data->body =
+               NbAi::acquireBody(empFilename, AiNodeGetStr(node,"body"));
+           data->ownsBody = true;
        } else {
            char * end; //dummy
            int64_t address = strtol (AiNodeGetStr(node,"pointerBody"), &end, 0);
-           body = reinterpret_cast<const Nb::Body*> (address);
+           data->body = reinterpret_cast<const Nb::Body*> (address);
 #ifdef DEBUG
            std::cerr << "naiad_distance_field: body from address is "<<
-               body->name() << "\n";
+               data->body->name() << "\n";
 #endif
        }
        
        // get access to the desired distance field
-       fldDistance = &body->constFieldShape().constField1f(
+       data->fldDistance = &data->body->constFieldShape().constField1f(
            AiNodeGetStr(node,"channel")
            );
        // and velocity field...
-       u = &body->constFieldShape().constField3f("velocity",0);
-       v = &body->constFieldShape().constField3f("velocity",1);
-       w = &body->constFieldShape().constField3f("velocity",2);
+       data->u = &data->body->constFieldShape().constField3f("velocity",0);
+       data->v = &data->body->constFieldShape().constField3f("velocity",1);
+       data->w = &data->body->constFieldShape().constField3f("velocity",2);
        // and iso-surface level
-       level = AiNodeGetFlt(node,"level");
+       data->level = AiNodeGetFlt(node,"level");
+
+       // and the frame rate the velocity is scaled with
+       data->dt = 1. / sceneFps();
+
+       // Shutter times to bake, only worth it with motion blur
+       std::vector<float> times;
+       const int bakeSamples = AiNodeGetInt(node,"bake_samples");
+       float shutterStart, shutterEnd;
+       sceneShutter(shutterStart, shutterEnd);
+       if (bakeSamples >= 2 && shutterEnd != shutterStart)
+           for (int t = 0; t < bakeSamples; ++t)
+               times.push_back(shutterStart + t * (shutterEnd - shutterStart) /
+                               (bakeSamples - 1));
+
+       // Early outs, the band is given in voxels. The baked field shares
+       // the tiles of the bounds.
+       const bool accelerate = AiNodeGetBool(node,"accelerate");
+       const bool fast = AiNodeGetBool(node,"fast_sampling");
+       if (accelerate || !times.empty() || fast) {
+           buildFieldBounds(*data, AiNodeGetInt(node,"accel_subcells"));
+           data->band = AiNodeGetFlt(node,"accel_band") *
+               data->body->constLayout().cellSize();
+           data->accelerate = accelerate && data->bounds.tileCount() > 0;
+           AiMsgInfo("naiad_distance_field: %d tiles of bounds, %d KB",
+                     data->bounds.tileCount(),
+                     static_cast<int>(data->bounds.bytes() / 1024));
+       }
+
+       // The sampler and the bake share one budget, the sampler is all or
+       // nothing so it goes first and the bake coarsens to fit the rest
+       size_t budget = size_t(std::max(
+           0, AiNodeGetInt(node,"bake_memory"))) << 20;
+       if (fast) {
+           buildTileSampler(*data, budget);
+           budget -= data->sampler.bytes();
+           if (!data->sampler.empty())
+               AiMsgInfo("naiad_distance_field: sampler at %d cells per "
+                         "tile, %d KB", data->sampler.cells(),
+                         static_cast<int>(data->sampler.bytes() / 1024));
+       }
+
+       if (!times.empty()) {
+           bakeAdvectedField(*data, times, budget);
+           if (!data->advected.empty())
+               AiMsgInfo("naiad_distance_field: baked %d shutter times at "
+                         "%d cells per tile, %d KB",
+                         static_cast<int>(times.size()),
+                         data->advected.cells(),
+                         static_cast<int>(data->advected.bytes() / 1024));
+       }
    }
    catch(std::exception& e)
    {
@@ -145,10 +560,13 @@ node_initialize
 
 node_finish
 {
-    if (std::string(AiNodeGetStr(node,"pointerBody")).size() == 0){
-        delete body;
-        Nb::end();
-    }
+    NaiadDistanceData * data =
+        reinterpret_cast<NaiadDistanceData*>(AiNodeGetLocalData(node));
+    if (data != 0 && data->ownsBody)
+        NbAi::releaseBody(data->body);
+    delete data;
+    AiNodeSetLocalData(node, 0);
+    NbAi::releaseSession();
 }
 
 node_update
@@ -37,24 +37,199 @@
 //Naiad Base API
 #include <Nb.h>
 #include <NbBody.h>
-#include <NbEmpReader.h>
 #include <../common/NbAi.h>
+#include <../common/NbAiSession.h>
+#include <../common/NbAiBodyCache.h>
+#include <../common/NbAiSequenceIndex.h>
+#include <../common/NbAiStats.h>
 #include <sstream>
 #include <iterator>
+#include <map>
 //Arnold API
+#include <ai_critsec.h>
 #include <ai_procedural.h>
-AtNode* node;
-std::vector<const Nb::Body *> * bodies;
+
+//The clusters of a split body (see Arnold-ASS-Write) are procedurals of
+//their own, all on the same body. The first one bins the triangles of the
+//body for all of them, and the bodies they load are held here until the
+//last of split_count clusters is built, so that the body cache doesn't
+//drop a body larger than its budget between two clusters.
+struct SplitShare
+{
+    SplitShare()
+        : users(0), built(0), binned(false)
+    { AiCritSecInit(&binning); }
+
+    ~SplitShare()
+    { AiCritSecClose(&binning); }
+
+    int                           users;    //!< clusters being built
+    int                           built;
+    bool                          binned;
+    NbAi::SplitBins               bins;
+    std::vector<const Nb::Body *> held;
+    AtCritSec                     binning;
+};
+
+typedef std::map<const Nb::Body *, SplitShare *> SplitShareMap;
+
+struct SplitState
+{
+    SplitState()
+        : instances(0)
+    { AiCritSecInit(&lock); }
+
+    ~SplitState()
+    { AiCritSecClose(&lock); }
+
+    AtCritSec     lock;
+    SplitShareMap shares;
+    int           instances;    //!< procedurals alive
+};
+
+SplitState splitState;
+
+//Releases the bodies of a share and deletes it. Expects the state lock.
+void
+dropSplitShare(SplitShareMap::iterator it)
+{
+    for (size_t i = 0; i < it->second->held.size(); ++i)
+        NbAi::releaseBody(it->second->held[i]);
+    delete it->second;
+    splitState.shares.erase(it);
+}
+
+//One cluster of a split body being built: shares the bins of the body and
+//hands the bodies it loaded over to the share when done.
+class SplitUse
+{
+public:
+    SplitUse(const Nb::Body * body, const int count)
+        : _body(body), _count(count), _share(NULL)
+    {
+        AiCritSecEnter(&splitState.lock);
+        SplitShareMap::iterator it = splitState.shares.find(body);
+        if (it == splitState.shares.end())
+            it = splitState.shares.insert(
+                std::make_pair(body, new SplitShare())).first;
+        _share = it->second;
+        ++_share->users;
+        AiCritSecLeave(&splitState.lock);
+    }
+
+    //! The triangle bins of the body, made by the first cluster to ask.
+    const NbAi::SplitBins &
+    bins(const NbAi::SplitGrid & grid)
+    {
+        AiCritSecEnter(&_share->binning);
+        try {
+            if (!_share->binned){
+                _share->bins.build(
+                    grid, _body->constPointShape().constBuffer3f("position"),
+                    _body->constTriangleShape().constBuffer3i("index"));
+                _share->binned = true;
+            }
+        }
+        catch (...) {
+            AiCritSecLeave(&_share->binning);
+            throw;
+        }
+        AiCritSecLeave(&_share->binning);
+        return _share->bins;
+    }
+
+    //! Keeps one reference to each of bodies in the share, releasing the
+    //! others, and clears bodies.
+    void
+    done(std::vector<const Nb::Body *> & bodies)
+    {
+        std::vector<const Nb::Body *> release;
+        AiCritSecEnter(&splitState.lock);
+        for (size_t i = 0; i < bodies.size(); ++i){
+            std::vector<const Nb::Body *> & held = _share->held;
+            if (std::find(held.begin(), held.end(), bodies[i]) == held.end())
+                held.push_back(bodies[i]);
+            else
+                release.push_back(bodies[i]);
+        }
+        bodies.clear();
+        --_share->users;
+        ++_share->built;
+        if (_share->built >= _count && _share->users == 0)
+            dropSplitShare(splitState.shares.find(_body));
+        AiCritSecLeave(&splitState.lock);
+        _share = NULL;
+
+        for (size_t i = 0; i < release.size(); ++i)
+            NbAi::releaseBody(release[i]);
+    }
+
+    ~SplitUse()
+    {
+        //Built or not, this cluster won't be tried again
+        if (_share != NULL){
+            std::vector<const Nb::Body *> none;
+            done(none);
+        }
+    }
+
+private:
+    const Nb::Body * _body;
+    const int        _count;
+    SplitShare *     _share;
+};
+
+//Everything one procedural instance owns. Arnold may expand several
+//instances at once, so nothing else is kept in globals. The bodies are
+//shared through the body cache and only referenced here.
+struct NaiadGeoData
+{
+    NaiadGeoData()
+        : node(NULL)
+    {
+        NbAi::acquireSession();
+        AiCritSecEnter(&splitState.lock);
+        ++splitState.instances;
+        AiCritSecLeave(&splitState.lock);
+    }
+
+    ~NaiadGeoData()
+    {
+        releaseBodies();
+
+        //Clusters never expanded leave their share behind, it goes with
+        //the last procedural
+        AiCritSecEnter(&splitState.lock);
+        if (0 == --splitState.instances)
+            while (!splitState.shares.empty())
+                dropSplitShare(splitState.shares.begin());
+        AiCritSecLeave(&splitState.lock);
+
+        NbAi::releaseSession();
+    }
+
+    void releaseBodies()
+    {
+        for (size_t i = 0; i < bodies.size(); ++i)
+            NbAi::releaseBody(bodies[i]);
+        bodies.clear();
+    }
+
+    AtNode * node;
+    std::vector<const Nb::Body *> bodies;
+};
 
 int Init(AtNode *proc_node, void **user_ptr)
 {
 #ifdef DEBUG
     std::cerr << "naiad_geo: Initiating... \n";
 #endif
+    *user_ptr = NULL;
     try
     {
-        // initialize the Naiad Base (Nb) library
-        Nb::begin();
+        // Naiad Base (Nb) session, shared with other procedurals
+        NaiadGeoData * data = new NaiadGeoData();
+        *user_ptr = data;
 
         //Get emp cache from the data
         Nb::String empCache = AiNodeGetStr(proc_node, "data");
@@ -69,9 +244,11 @@ int Init(AtNode *proc_node, void **user_ptr)
         AiNodeDeclare(proc_node, "padding", "constant INT");
         int padding = AiNodeGetInt(proc_node, "padding");
 
-        std::cerr << "naiad_geo: Data: " << empCache << "\n";
-        std::cerr << "naiad_geo: Frame: " << frame << "\n";
-        std::cerr << "naiad_geo: Padding: " << padding << "\n";
+        //Read the type
+        Nb::String type  = AiNodeGetStr(proc_node, "type");
+
+        AiMsgInfo("naiad_geo: Data: %s, Frame: %d, Padding: %d",
+                  empCache.c_str(), frame, padding);
 
         //Add the .#.emp to the end of the emp cache (
         //Because Arnold treats everything after a # as a comment :)
@@ -88,29 +265,79 @@ int Init(AtNode *proc_node, void **user_ptr)
             padding
             );
 
-        //Read the emp file
-        Nb::EmpReader * empReader(new Nb::EmpReader(empFileName, bodyStr));
-
-        //Eject the body
-        const Nb::Body* body = empReader->ejectBody(bodyStr);
-        delete empReader;
+        //Load times and memory, if asked for (see NbAiStats.h)
+        NbAi::LoadStats loadStats(AiNodeGetStr(proc_node, "name"));
+        NbAi::LoadStats * stats =
+            NbAi::statsEnabled() ? &loadStats : NULL;
+
+        //Get the body, read from the emp file unless another node already
+        //did. Stored right away so it is released whatever happens.
+        const Nb::Body* body;
+        {
+            NbAi::StageTimer timer(stats, NbAi::StageRead);
+            body = NbAi::acquireBody(empFileName, bodyStr);
+            data->bodies.push_back(body);
+        }
+        if (stats != NULL){
+            stats->type = type;
+            stats->addEmp(empFileName);
+        }
 
         //Check framtime. If 0, no motion blur at all.
         AiNodeDeclare(proc_node, "frametime", "constant FLOAT");
         const float frametime = AiNodeGetFlt(proc_node, "frametime");
 
 
-        //Read the type
-        Nb::String type  = AiNodeGetStr(proc_node, "type");
+        //In split mode, only the cluster of tiles this procedural was
+        //written for (see Arnold-ASS-Write)
+        const bool split =
+            AiNodeLookUpUserParameter(proc_node, "split_size") != NULL;
+        NbAi::SplitGrid grid;
+        int cell[3] = {0, 0, 0};
+        if (split){
+            const AtPoint origin = AiNodeGetPnt(proc_node, "split_origin");
+            grid.origin = Nb::Vec3f(origin.x, origin.y, origin.z);
+            grid.size = AiNodeGetFlt(proc_node, "split_size");
+            cell[0] = AiNodeGetInt(proc_node, "split_x");
+            cell[1] = AiNodeGetInt(proc_node, "split_y");
+            cell[2] = AiNodeGetInt(proc_node, "split_z");
+        }
+        const NbAi::SplitGrid * splitGrid = split ? &grid : NULL;
+
+        //Clusters written with their count share the triangle bins and the
+        //bodies of the split body until all are built (see SplitUse)
+        const int splitCount =
+            split && AiNodeLookUpUserParameter(proc_node, "split_count") ?
+            AiNodeGetInt(proc_node, "split_count") : 0;
+        SplitUse splitUse(body, splitCount);
+        NbAi::SplitBins localBins;
+        const NbAi::SplitBins * splitBins = NULL;
+        if (split && type == std::string("Polymesh")){
+            NbAi::StageTimer timer(stats, NbAi::StageSelect);
+            if (splitCount > 0){
+                splitBins = &splitUse.bins(grid);
+            } else {
+                localBins.build(
+                    grid, body->constPointShape().constBuffer3f("position"),
+                    body->constTriangleShape().constBuffer3i("index"));
+                splitBins = &localBins;
+            }
+        }
+
+        //Channels to export as user data (see Arnold-Mesh, Arnold-Particle)
+        const Nb::String userChannels =
+            AiNodeLookUpUserParameter(proc_node, "user_channels") ?
+            AiNodeGetStr(proc_node, "user_channels") : "";
 
-//#ifdef DEBUG
-        std::cerr << "naiad_geo: Reading emp: " << empFileName << "\n";
-        std::cerr << "naiad_geo: Bodies: " << bodyStr << "\n";
-        std::cerr << "naiad_geo: Frametime: " << frametime << "\n";
-        std::cerr << "naiad_geo: Type: " << type << "\n";
-//#endif
+        //Motion keys from velocity (a next frame only ever gives two)
+        const int motionKeys =
+            AiNodeLookUpUserParameter(proc_node, "motion_keys") ?
+            AiNodeGetInt(proc_node, "motion_keys") : 2;
+
+        AiMsgInfo("naiad_geo: Reading emp: %s, Bodies: %s, "
+                  "Frametime: %g, Type: %s", empFileName.c_str(),
+                  bodyStr.c_str(), frametime, type.c_str());
 
-        bodies = new std::vector<const Nb::Body *>();
         if (type == std::string("Polymesh")){
             //If the mesh doesn't have velocity stored @ points,
             //we create from next frame.
@@ -126,66 +353,115 @@ int Init(AtNode *proc_node, void **user_ptr)
                                                 padding
                                              );
 
-                  //Only if it the file exists
-                  if (NbAi::empExists(empFileNameNext)){
+                  //Only if it the file exists, as listed by the index of
+                  //the sequence shared with the other procedurals
+                  if (NbAi::empFrame(empCache, padding, frame + 1)){
 #ifdef DEBUG
                          std::cerr << "naiad_geo: " <<
                                  "Creating motion blur from next frame. \n";
 #endif
-                         Nb::EmpReader* empReaderNext =
-                                 new Nb::EmpReader(empFileNameNext, bodyStr);
-                         const Nb::Body* bodyNext =
-                                 empReaderNext->ejectBody(bodyStr);
-                         // Create node
-                         node = NbAi::loadMesh(body, frametime, bodyNext);
+                         const Nb::Body* bodyNext;
+                         {
+                             NbAi::StageTimer timer(stats, NbAi::StageRead);
+                             bodyNext =
+                                 NbAi::acquireBody(empFileNameNext, bodyStr,
+                                                   true);
+
+                             //So it can be released later on
+                             data->bodies.push_back(bodyNext);
+                         }
+                         if (stats != NULL)
+                             stats->addEmp(empFileNameNext);
 
-                         //So it can be deleted later on
-                         bodies->push_back(bodyNext);
-                         delete empReaderNext;
+                         // Create node
+                         data->node = NbAi::loadMesh(body, frametime, bodyNext,
+                                                     splitBins, cell,
+                                                     userChannels, 2, stats);
                   } else {
                       //no motionblur available
 #ifdef DEBUG
                       std::cerr << "naiad_geo: " <<
                               "Can't create motion blur. No next frame. \n";
 #endif
-                      node = NbAi::loadMesh(body, 0);
+                      data->node = NbAi::loadMesh(body, 0, NULL, splitBins,
+                                                  cell, userChannels, 2,
+                                                  stats);
                   }
               } else {
 #ifdef DEBUG
                   std::cerr << "naiad_geo: " <<
                           "Creating motion blur from velocity channel. \n";
 #endif
-                  node = NbAi::loadMesh(body, frametime);
+                  data->node = NbAi::loadMesh(body, frametime, NULL,
+                                              splitBins, cell, userChannels,
+                                              motionKeys, stats);
               }
 
-              //Store body, we will delete it later
-              bodies->push_back(body);
         } else if (type == std::string("Points")){
             //Check point radius and render mode.
-            const float radius = AiNodeGetFlt(proc_node, "radius");
+            NbAi::ParticleRadius radius(AiNodeGetFlt(proc_node, "radius"));
+            if (AiNodeLookUpUserParameter(proc_node, "radius_channel")){
+                radius.channel = AiNodeGetStr(proc_node, "radius_channel");
+                radius.min = AiNodeGetFlt(proc_node, "radius_min");
+                radius.max = AiNodeGetFlt(proc_node, "radius_max");
+            }
             const char * pointsMode = AiNodeGetStr(proc_node, "mode");
 
+            //Particles outside the camera view or the cull box are dropped
+            NbAi::CullRegion cull;
+            if (AiNodeLookUpUserParameter(proc_node, "cull_camera"))
+                cull = NbAi::cullRegion(
+                    AiNodeGetBool(proc_node, "cull_camera"),
+                    AiNodeGetStr(proc_node, "cull_box"),
+                    AiNodeGetFlt(proc_node, "cull_padding") + radius.bound());
+
 #ifdef DEBUG
-            std::cerr << "naiad_geo: Radius: " << radius << "\n";
+            std::cerr << "naiad_geo: Radius: " << radius.radius << " "
+                      << radius.channel << "\n";
             std::cerr << "naiad_geo: Points Mode: " << pointsMode << "\n";
 #endif
 
-            node = NbAi::loadParticles(body, pointsMode, radius, frametime);
-
-            //We don't need the body anymore
-            delete body;
+            data->node = NbAi::loadParticles(body, pointsMode, radius, frametime,
+                                             splitGrid, cell, userChannels,
+                                             motionKeys, &cull, stats);
+
+            //We don't need the body anymore, other nodes may
+            if (splitCount == 0){
+                data->bodies.pop_back();
+                NbAi::releaseBody(body);
+            }
+        } else if (type == std::string("Isosurface")){
+            //An implicit rendered as a mesh (see Arnold-Implicit)
+            data->node = NbAi::loadIsosurface(
+                body, AiNodeGetStr(proc_node, "channel"),
+                AiNodeGetFlt(proc_node, "iso"),
+                frametime, motionKeys, stats);
+
+            //The mesh is a copy, the field isn't needed anymore
+            data->bodies.pop_back();
+            NbAi::releaseBody(body);
         }
 
-        //Finally, set the name.
-        AiNodeSetStr(node, "name", AiNodeGetStr(proc_node, "name"));
+        //A cluster is one of many procedurals on the same body. Its geometry
+        //has been copied; the share keeps the body until the last cluster is
+        //built, without a count the cache decides how long it stays.
+        if (splitCount > 0)
+            splitUse.done(data->bodies);
+        else if (split)
+            data->releaseBodies();
 
-        //Done with Naiad library
-        Nb::end();
+        //Finally, set the name.
+        if (data->node != NULL)
+            AiNodeSetStr(data->node, "name", AiNodeGetStr(proc_node, "name"));
 
+        if (stats != NULL)
+            NbAi::reportStats(*stats);
     }
     catch(std::exception& e)
     {
         AiMsgError("%s", e.what());
+        delete static_cast<NaiadGeoData *>(*user_ptr);
+        *user_ptr = NULL;
         return false;
     }
 
@@ -202,8 +478,8 @@ int Cleanup(void *user_ptr)
     std::cerr << "naiad_geo: Cleanup... \n";
 #endif
 
-    for (int i = 0; i < bodies->size(); ++i)
-        delete bodies->at(i);
+    //Deletes the bodies and releases the session
+    delete static_cast<NaiadGeoData *>(user_ptr);
 
 #ifdef DEBUG
     std::cerr << "naiad_geo: Cleanup done. \n";
@@ -215,12 +491,13 @@ int Cleanup(void *user_ptr)
 int NumNodes(void *user_ptr)
 {
     //We only allow one procedural per body.
-    return 1;
+    const NaiadGeoData * data = static_cast<const NaiadGeoData *>(user_ptr);
+    return data != NULL && data->node != NULL ? 1 : 0;
 }
 
 AtNode* GetNode(void *user_ptr, int i)
 {
-    return node;
+    return static_cast<NaiadGeoData *>(user_ptr)->node;
 }
 
 proc_loader
@@ -0,0 +1,389 @@
+// ----------------------------------------------------------------------------
+//
+// naiad_volume.cc
+//
+// Copyright (c) 2011 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+// Arnold volume plug-in for Naiad fields: density, foam, aeration or any
+// other float or vector field channel of a body becomes a volume channel of
+// the same name. Arnold's volume API arrived with Arnold 4.2, the build
+// leaves this plug-in out for older versions.
+//
+// A volume node points to the EMP sequence like naiad_geo procedurals do:
+//
+//   volume
+//   {
+//    name foam
+//    dso "naiad_volume.so"
+//    data "/sims/foam"            (EMP sequence, without .#.emp)
+//    step_size 0                  (0: one voxel)
+//    declare body constant STRING
+//    body "Field-Foam"
+//    declare frame constant INT
+//    frame 12
+//    declare padding constant INT
+//    padding 4
+//    declare channels constant STRING
+//    channels "foam-density"      (all field channels if not given)
+//    declare active_threshold constant FLOAT
+//    active_threshold 0           (values at most this count as empty)
+//   }
+//
+// Only tiles with field data and values above the threshold are part of the
+// volume, see NbAiVolumeTiles.h: ray extents cover their active cells and
+// nothing else, so Arnold doesn't march through empty tiles. Sampling reads
+// the body's fields through its tile layout, which is shared read-only by
+// every render thread.
+//
+// ----------------------------------------------------------------------------
+
+#include <ai.h>
+#include <string.h>
+
+#include <Nb.h>
+#include <NbField.h>
+#include <NbBody.h>
+#include <NbFilename.h>
+
+#include <../common/NbAiSession.h>
+#include <../common/NbAiBodyCache.h>
+#include <../common/NbAiVolumeTiles.h>
+
+#include <iostream>
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+#if !(AI_VERSION_ARCH_NUM > 4 || \
+      (AI_VERSION_ARCH_NUM == 4 && AI_VERSION_MAJOR_NUM >= 2))
+#error naiad_volume needs the volume API of Arnold 4.2 or later
+#endif
+
+#include <ai_volume.h>
+
+// A field channel as Arnold sees it: a float, or a vector of three floats.
+struct NaiadVolumeChannel
+{
+    std::string        name;
+    int                components;
+    const Nb::Field1f* field[3];
+};
+
+// Everything one volume node uses. Several volumes may read the same body,
+// which the body cache shares among them.
+struct NaiadVolumeData
+{
+    NaiadVolumeData()
+        : body(0)
+    { NbAi::acquireSession(); }
+
+    ~NaiadVolumeData()
+    {
+        NbAi::releaseBody(body);
+        NbAi::releaseSession();
+    }
+
+    const NaiadVolumeChannel *
+    channel(const char * name) const
+    {
+        for (size_t c = 0; c < channels.size(); ++c)
+            if (channels[c].name == name)
+                return &channels[c];
+        return 0;
+    }
+
+    const Nb::Body*                 body;
+    std::vector<NaiadVolumeChannel> channels;
+    NbAi::VolumeTiles               tiles;
+};
+
+// The channels listed in the node's channels parameter, all float and
+// vector field channels of the body if it isn't given.
+static void
+findChannels(NaiadVolumeData & data, const Nb::String & list)
+{
+    const Nb::FieldShape & field = data.body->constFieldShape();
+    for (int ch = 0; ch < field.channelCount(); ++ch) {
+        const Nb::String name = field.constChannelBase(ch).name();
+        if (list.size() > 0 && !name.listed_in(list))
+            continue;
+        NaiadVolumeChannel channel;
+        channel.name = name;
+        const int type = field.constChannelBase(ch).type();
+        if (type == Nb::ValueBase::FloatType) {
+            channel.components = 1;
+            channel.field[0] = &field.constField1f(name);
+            channel.field[1] = channel.field[2] = 0;
+        } else if (type == Nb::ValueBase::Vec3fType) {
+            channel.components = 3;
+            for (int k = 0; k < 3; ++k)
+                channel.field[k] = &field.constField3f(name, k);
+        } else {
+            continue;
+        }
+        data.channels.push_back(channel);
+    }
+}
+
+// Marks the cells of every tile where some channel is above threshold, then
+// grows them by the reach of the cubic sampler. The blocks of the fields
+// follow the tiles of the layout with one voxel per cell, x fastest, so the
+// voxels are read directly; a block of another size marks its whole tile.
+static void
+buildVolumeTiles(NaiadVolumeData & data, const float threshold)
+{
+    const Nb::TileLayout & layout = data.body->constLayout();
+    const int tileCount = layout.fineTileCount();
+    if (tileCount == 0 || data.channels.empty())
+        return;
+
+    Nb::Vec3f tileMin, tileMax, min, max;
+    layout.tileBounds(0, tileMin, tileMax);
+    layout.allTileBounds(min, max);
+    const float tileSize = tileMax[0] - tileMin[0];
+    const int cells = std::max(1, static_cast<int>(
+        tileSize / layout.cellSize() + 0.5f));
+    const int64_t voxels = int64_t(cells) * cells * cells;
+
+    const float fmin[3] = { min[0], min[1], min[2] };
+    const float fmax[3] = { max[0], max[1], max[2] };
+    NbAi::VolumeTiles & tiles = data.tiles;
+    tiles.init(fmin, fmax, tileSize, cells);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tileCount; ++t) {
+        Nb::Vec3f o, end;
+        layout.tileBounds(t, o, end);
+        const float center[3] = { 0.5f * (o[0] + end[0]),
+                                  0.5f * (o[1] + end[1]),
+                                  0.5f * (o[2] + end[2]) };
+        const int tile = tiles.tileIndex(center);
+        if (tile < 0)
+            continue;
+
+        int lo[3] = { cells, cells, cells };
+        int hi[3] = { -1, -1, -1 };
+        for (size_t c = 0; c < data.channels.size(); ++c)
+            for (int n = 0; n < data.channels[c].components; ++n) {
+                const Nb::Field1f & field = *data.channels[c].field[n];
+                if (t >= field.block_count())
+                    continue;
+                const Nb::Block1f & block = field(t);
+                for (int64_t v = 0; v < block.size(); ++v) {
+                    if (!(std::fabs(block(v)) > threshold))
+                        continue;
+                    if (block.size() != voxels) {
+                        lo[0] = lo[1] = lo[2] = 0;
+                        hi[0] = hi[1] = hi[2] = cells - 1;
+                        break;
+                    }
+                    const int cell[3] = {
+                        static_cast<int>(v % cells),
+                        static_cast<int>(v / cells % cells),
+                        static_cast<int>(v / (int64_t(cells) * cells)) };
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = std::min(lo[a], cell[a]);
+                        hi[a] = std::max(hi[a], cell[a]);
+                    }
+                }
+            }
+        if (hi[0] >= 0)
+            tiles.setActive(tile, lo, hi);
+    }
+
+    tiles.dilate(std::min(2, cells));
+    tiles.countActive();
+}
+
+static float
+sampleField(const int              interp,
+            const Nb::Vec3f &      x,
+            const Nb::TileLayout & layout,
+            const Nb::Field1f &    field)
+{
+    // Nb has no nearest-voxel lookup, closest is trilinear as well
+    if (interp == AI_VOLUME_INTERP_TRICUBIC)
+        return Nb::sampleFieldCubic1f(x, layout, field);
+    return Nb::sampleFieldLinear1f(x, layout, field);
+}
+
+static bool
+NaiadVolumeCreate(void *         user_ptr,
+                  const char *   user_string,
+                  const AtNode * node,
+                  AtVolumeData * data)
+{
+    NaiadVolumeData * volume = new NaiadVolumeData;
+    data->private_info = volume;
+
+    try
+    {
+        const int frame = AiNodeLookUpUserParameter(node, "frame") ?
+            AiNodeGetInt(node, "frame") : 1;
+        const int padding = AiNodeLookUpUserParameter(node, "padding") ?
+            AiNodeGetInt(node, "padding") : 4;
+        const Nb::String bodyName = AiNodeGetStr(node, "body");
+        const Nb::String channels =
+            AiNodeLookUpUserParameter(node, "channels") ?
+            AiNodeGetStr(node, "channels") : "";
+        const float threshold =
+            AiNodeLookUpUserParameter(node, "active_threshold") ?
+            AiNodeGetFlt(node, "active_threshold") : 0.f;
+
+        // Same EMP sequence naming as naiad_geo
+        std::stringstream ss;
+        ss << user_string << ".#.emp";
+        const Nb::String empFileName =
+            Nb::sequenceToFilename("", ss.str(), frame, 0, padding);
+
+        volume->body = NbAi::acquireBody(empFileName, bodyName);
+        findChannels(*volume, channels);
+        if (volume->channels.empty())
+            AiMsgWarning("naiad_volume: %s has no field channel %s",
+                         bodyName.c_str(), channels.c_str());
+
+        buildVolumeTiles(*volume, threshold);
+
+        float min[3], max[3];
+        if (!volume->tiles.bounds(min, max))
+            min[0] = min[1] = min[2] = max[0] = max[1] = max[2] = 0.f;
+        data->bbox.min.x = min[0];
+        data->bbox.min.y = min[1];
+        data->bbox.min.z = min[2];
+        data->bbox.max.x = max[0];
+        data->bbox.max.y = max[1];
+        data->bbox.max.z = max[2];
+        data->auto_step_size = volume->body->constLayout().cellSize();
+
+        AiMsgInfo("naiad_volume: %s, %d channels, %d of %d tiles active, "
+                  "%d KB", empFileName.c_str(),
+                  static_cast<int>(volume->channels.size()),
+                  volume->tiles.activeCount(), volume->tiles.tileCount(),
+                  static_cast<int>(volume->tiles.bytes() / 1024));
+    }
+    catch(std::exception& e)
+    {
+        AiMsgError("%s", e.what());
+        delete volume;
+        data->private_info = 0;
+        return false;
+    }
+    return true;
+}
+
+static bool
+NaiadVolumeCleanup(void * user_ptr, AtVolumeData * data)
+{
+    delete static_cast<NaiadVolumeData*>(data->private_info);
+    data->private_info = 0;
+    return true;
+}
+
+static bool
+NaiadVolumeSample(void *                  user_ptr,
+                  const AtVolumeData *    data,
+                  const char *            channel,
+                  const AtShaderGlobals * sg,
+                  int                     interp,
+                  AtParamValue *          value,
+                  AtByte *                type)
+{
+    const NaiadVolumeData * volume =
+        static_cast<const NaiadVolumeData*>(data->private_info);
+    const NaiadVolumeChannel * ch = volume->channel(channel);
+    if (ch == 0)
+        return false;
+
+    // Nothing to interpolate outside the active tiles
+    float v[3] = { 0.f, 0.f, 0.f };
+    const float p[3] = { sg->Po.x, sg->Po.y, sg->Po.z };
+    if (volume->tiles.active(volume->tiles.tileIndex(p))) {
+        const Nb::Vec3f x(p[0], p[1], p[2]);
+        const Nb::TileLayout & layout = volume->body->constLayout();
+        for (int k = 0; k < ch->components; ++k)
+            v[k] = sampleField(interp, x, layout, *ch->field[k]);
+    }
+
+    if (ch->components == 1) {
+        *type = AI_TYPE_FLOAT;
+        value->FLT = v[0];
+    } else {
+        *type = AI_TYPE_VECTOR;
+        value->VEC.x = v[0];
+        value->VEC.y = v[1];
+        value->VEC.z = v[2];
+    }
+    return true;
+}
+
+// Hands each run of active cells along the ray to Arnold
+struct AddIntersection
+{
+    const AtVolumeIntersectionInfo * info;
+
+    void operator()(const float t0, const float t1) const
+    { AiVolumeAddIntersection(info, t0, t1); }
+};
+
+static void
+NaiadVolumeRayExtents(void *                           user_ptr,
+                      const AtVolumeData *             data,
+                      const AtVolumeIntersectionInfo * info,
+                      AtUInt32                         tid,
+                      float                            time,
+                      const AtPoint *                  origin,
+                      const AtVector *                 direction,
+                      float                            t0,
+                      float                            t1)
+{
+    const NaiadVolumeData * volume =
+        static_cast<const NaiadVolumeData*>(data->private_info);
+    const float o[3] = { origin->x, origin->y, origin->z };
+    const float d[3] = { direction->x, direction->y, direction->z };
+    AddIntersection add;
+    add.info = info;
+    volume->tiles.rayExtents(o, d, t0, t1, add);
+}
+
+volume_plugin_loader
+{
+    vtable->Init          = 0;
+    vtable->Cleanup       = 0;
+    vtable->CreateVolume  = NaiadVolumeCreate;
+    vtable->UpdateVolume  = 0;
+    vtable->CleanupVolume = NaiadVolumeCleanup;
+    vtable->Sample        = NaiadVolumeSample;
+    vtable->RayExtents    = NaiadVolumeRayExtents;
+    strcpy(vtable->version, AI_VERSION);
+    return true;
+}
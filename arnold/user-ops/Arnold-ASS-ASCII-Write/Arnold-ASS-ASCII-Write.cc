@@ -78,7 +78,13 @@ private:
                                     param1f("Motion Blur")->eval(tb),
              Ng::Store::globalOp()->param1i("Fps")->eval(tb),
                                     param1i("Frame Padding")->eval(tb),
-                           _evalStr(param1s("Output ASS file")->eval(tb),tb)
+                           _evalStr(param1s("Output ASS file")->eval(tb),tb),
+                                    "",//never kicked
+                                    param1s("Arnold Procedural")->eval(tb),
+                                    1,
+                                    0,
+                      Nb::String("On") ==
+                                    param1e("Inline Geometry")->eval(tb)
                      );
     };
 // ----------------------------------------------------------------------------
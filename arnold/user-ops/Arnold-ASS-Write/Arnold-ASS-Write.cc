@@ -62,6 +62,12 @@ public:
         NbAi::OutputAssWrite output(p, bodies, camera, tb);
         output.processBodies(tb);
         output.createOutput(tb);
+
+        //Report the kicks of the range when it ends, not at unload
+        const int last =
+            Ng::Store::globalOp()->param1i("Last Frame")->eval(tb);
+        if (tb.frame >= last)
+            NbAi::KickScheduler::instance().wait();
     }
 // ----------------------------------------------------------------------------
 private:
@@ -80,7 +86,9 @@ private:
                                     param1i("Frame Padding")->eval(tb),
                            _evalStr(param1s("Output ASS file")->eval(tb),tb),
                                     param1s("Kick Ass")->eval(tb),
-                                    param1s("Arnold Procedural")->eval(tb)
+                                    param1s("Arnold Procedural")->eval(tb),
+                                    param1i("Kick Jobs")->eval(tb),
+                                    param1i("Kick Threads")->eval(tb)
                      );
     };
 // ----------------------------------------------------------------------------
@@ -112,6 +120,8 @@ BeginPlugin(NtForeignFactory* factory)
 NI_EXPORT bool
 EndPlugin(NtForeignFactory* factory)
 {
+    //Kicks of the last frames may still be running
+    NbAi::KickScheduler::instance().shutdown();
     return true;
 }
 
@@ -99,6 +99,12 @@ public:
             NbAi::setProp<Nb::ValueBase::IntType>(body, "samples", ss.str());
             ss.str("");
 
+            //Render the surface as a polymesh instead (see loadIsosurface)
+            NbAi::setProp<Nb::ValueBase::IntType>(
+                    body, "mesh",
+                    Nb::String("On") == Nb::String(
+                        param1e("Render As Mesh")->eval(tb)) ? "1" : "0");
+
 #ifndef NDEBUG
             std::cerr<< "Adding Arnold properties for " << body->name() << "\n"
             << "\tYype: " << body->prop1s("type")->eval(tb) << "\n"
@@ -109,7 +115,8 @@ public:
             << "\tOpaque: " << body->prop1i("opaque")->eval(tb) << "\n"
             << "\tRay Bias: " << body->prop1f("raybias")->eval(tb) << "\n"
             << "\tThreshold: " << body->prop1f("threshold")->eval(tb) << "\n"
-            << "\tSamples: " << body->prop1i("samples")->eval(tb) <<  std::endl;
+            << "\tSamples: " << body->prop1i("samples")->eval(tb) << "\n"
+            << "\tMesh: " << body->prop1i("mesh")->eval(tb) <<  std::endl;
 #endif
         }
     }
@@ -74,12 +74,27 @@ public:
                 opaque = "1";
             NbAi::setProp<Nb::ValueBase::IntType>(body, "opaque", opaque);
 
+            //Point channels exported as Arnold user data
+            NbAi::setProp<Nb::ValueBase::StringType>(
+                    body, "user-channels", param1s("User Channels")->eval(tb));
+
+            //Motion keys for velocity motion blur
+            std::stringstream ss;
+            ss << std::max(2, param1i("Motion Keys")->eval(tb));
+            NbAi::setProp<Nb::ValueBase::IntType>(body, "motion-keys", ss.str());
+
+            //Split in one procedural per cluster of tiles (0 is off)
+            ss.str("");
+            ss << std::max(0, param1i("Split Tiles")->eval(tb));
+            NbAi::setProp<Nb::ValueBase::IntType>(body, "split", ss.str());
+
 #ifndef NDEBUG
             std::cerr<< "Adding Arnold properties for " << body->name() << "\n"
             << "\tYype: " << body->prop1s("type")->eval(tb) << "\n"
             << "\tNode name: " << body->prop1s("name")->eval(tb) << "\n"
             << "\tShader: " << body->prop1s("shader")->eval(tb) << "\n"
-            << "\tOpaque: " << body->prop1i("opaque")->eval(tb) << std::endl;
+            << "\tOpaque: " << body->prop1i("opaque")->eval(tb) << "\n"
+            << "\tSplit: " << body->prop1i("split")->eval(tb) << std::endl;
 #endif
         }
     }
@@ -80,10 +80,48 @@ public:
             ss << param1f("Radius")->eval(tb);
             NbAi::setProp<Nb::ValueBase::FloatType>(body, "radius", ss.str());
 
+            //Per-particle radius, Radius times a float channel, clamped
+            NbAi::setProp<Nb::ValueBase::StringType>(
+                    body, "radius-channel", param1s("Radius Channel")->eval(tb));
+            ss.str("");
+            ss << param1f("Radius Min")->eval(tb);
+            NbAi::setProp<Nb::ValueBase::FloatType>(
+                    body, "radius-min", ss.str());
+            ss.str("");
+            ss << param1f("Radius Max")->eval(tb);
+            NbAi::setProp<Nb::ValueBase::FloatType>(
+                    body, "radius-max", ss.str());
+
             //Particle render mode
             NbAi::setProp<Nb::ValueBase::StringType>(
                     body, "particle-mode", param1s("Particle Mode")->eval(tb));
 
+            //Particle channels exported as Arnold user data
+            NbAi::setProp<Nb::ValueBase::StringType>(
+                    body, "user-channels", param1s("User Channels")->eval(tb));
+
+            //Culling to the camera view and a box
+            NbAi::setProp<Nb::ValueBase::IntType>(
+                    body, "cull-camera",
+                    Nb::String("On") == Nb::String(
+                        param1e("Cull To Camera")->eval(tb)) ? "1" : "0");
+            NbAi::setProp<Nb::ValueBase::StringType>(
+                    body, "cull-box", param1s("Cull Box")->eval(tb));
+            ss.str("");
+            ss << param1f("Cull Padding")->eval(tb);
+            NbAi::setProp<Nb::ValueBase::FloatType>(
+                    body, "cull-padding", ss.str());
+
+            //Motion keys for velocity motion blur
+            ss.str("");
+            ss << std::max(2, param1i("Motion Keys")->eval(tb));
+            NbAi::setProp<Nb::ValueBase::IntType>(body, "motion-keys", ss.str());
+
+            //Split in one procedural per cluster of tiles (0 is off)
+            ss.str("");
+            ss << std::max(0, param1i("Split Tiles")->eval(tb));
+            NbAi::setProp<Nb::ValueBase::IntType>(body, "split", ss.str());
+
 #ifndef NDEBUG
             std::cerr<< "Adding Arnold properties for " << body->name() << "\n"
             << "\tType: " << body->prop1s("type")->eval(tb) << "\n"
@@ -91,8 +129,9 @@ public:
             << "\tShader: " << body->prop1s("shader")->eval(tb) << "\n"
             << "\tOpaque: " << body->prop1i("opaque")->eval(tb) << "\n"
             << "\tRadius: " << body->prop1f("radius")->eval(tb) << "\n"
-            << "\tParticle-mode: " << body->prop1s("particle-mode")->eval(tb) <<
-            std::endl;
+            << "\tRadius channel: " << body->prop1s("radius-channel")->eval(tb) << "\n"
+            << "\tParticle-mode: " << body->prop1s("particle-mode")->eval(tb) << "\n"
+            << "\tSplit: " << body->prop1i("split")->eval(tb) << std::endl;
 #endif
         }
     }
@@ -0,0 +1,182 @@
+// ----------------------------------------------------------------------------
+//
+// mesh_file.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Minimal stand-in for the V-Ray SDK header of the same name. It declares
+// only what VRMesh and VRVoxelBuilder use, so that vrmesh export can be
+// built and benchmarked without a V-Ray installation. Channel ids and flag
+// values are arbitrary, the layouts of Vector and FaceTopoData match the
+// SDK.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef VRMESH_STUB_MESH_FILE_H
+#define VRMESH_STUB_MESH_FILE_H
+
+#include <cstddef>
+
+typedef unsigned int       uint32;
+typedef unsigned long long uint64;
+
+// Channel ids
+#define VERT_GEOM_CHANNEL         0
+#define VERT_NORMAL_CHANNEL       1
+#define VERT_VELOCITY_CHANNEL     2
+#define FACE_TOPO_CHANNEL         3
+#define VERT_NORMAL_TOPO_CHANNEL  4
+#define VERT_TEX_CHANNEL0         1000
+#define VERT_TEX_TOPO_CHANNEL0    2000
+
+// Channel flags
+#define MF_VERT_CHANNEL           1
+#define MF_TOPO_CHANNEL           2
+
+// Voxel flags
+#define MVF_GEOMETRY_VOXEL        1
+#define MVF_PREVIEW_VOXEL         2
+
+namespace VUtils
+{
+
+struct Vector
+{
+    float x, y, z;
+};
+
+typedef Vector VertGeomData;
+
+struct FaceTopoData
+{
+    int v[3];
+};
+
+struct Box
+{
+    Vector pmin, pmax;
+
+    void init()
+    {
+        pmin.x = pmin.y = pmin.z =  1e30f;
+        pmax.x = pmax.y = pmax.z = -1e30f;
+    }
+
+    Box& operator+=(const Vector &p)
+    {
+        if (p.x < pmin.x) pmin.x = p.x;
+        if (p.y < pmin.y) pmin.y = p.y;
+        if (p.z < pmin.z) pmin.z = p.z;
+        if (p.x > pmax.x) pmax.x = p.x;
+        if (p.y > pmax.y) pmax.y = p.y;
+        if (p.z > pmax.z) pmax.z = p.z;
+        return *this;
+    }
+};
+
+struct MeshChannel
+{
+    int   elementSize;
+    int   numElements;
+    int   channelID;
+    int   depChannelID;
+    int   flags;
+    void *data;
+
+    MeshChannel()
+        : elementSize(0), numElements(0), channelID(0), depChannelID(0),
+          flags(0), data(0)
+    {}
+
+    ~MeshChannel()
+    { freeMem(); }
+
+    void init(int elemSize, int numElems, int chanID, int depChanID,
+              int chanFlags, bool allocData = true)
+    {
+        elementSize = elemSize;
+        numElements = numElems;
+        channelID = chanID;
+        depChannelID = depChanID;
+        flags = chanFlags;
+        data = allocData ? new char[size_t(elemSize)*size_t(numElems)] : 0;
+    }
+
+    void freeMem()
+    {
+        delete [] static_cast<char*>(data);
+        data = 0;
+    }
+};
+
+struct MeshVoxel
+{
+    int          numChannels;
+    MeshChannel *channels;
+    int          index;
+
+    void init()
+    {
+        numChannels = 0;
+        channels = 0;
+        index = 0;
+    }
+
+    void freeMem()
+    {
+        delete [] channels;
+        init();
+    }
+
+    MeshChannel* getChannel(const int channelID)
+    {
+        for (int i=0; i<numChannels; i++)
+            if (channels[i].channelID == channelID)
+                return &channels[i];
+        return 0;
+    }
+};
+
+class MeshInterface
+{
+public:
+    virtual ~MeshInterface() {}
+    virtual int getNumVoxels() = 0;
+    virtual Box getVoxelBBox(int index) = 0;
+    virtual uint32 getVoxelFlags(int index) = 0;
+    virtual MeshVoxel* getVoxel(int index, uint64 *memUsage = 0) = 0;
+    virtual void releaseVoxel(MeshVoxel *voxel, uint64 *memUsage = 0) = 0;
+};
+
+} // namespace VUtils
+
+#endif // VRMESH_STUB_MESH_FILE_H
@@ -0,0 +1,105 @@
+// ----------------------------------------------------------------------------
+//
+// voxelsubdivider.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Stand-in for the V-Ray SDK subdivider. It does not subdivide: the voxels
+// are written in order, raw, to a file that only serves to measure the
+// amount of data an export produces. Voxels are requested and released one
+// at a time, the way the SDK does it.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef VRMESH_STUB_VOXELSUBDIVIDER_H
+#define VRMESH_STUB_VOXELSUBDIVIDER_H
+
+#include <cstdio>
+
+#include "mesh_file.h"
+
+namespace VUtils
+{
+
+//! Bytes written by the last subdivideMeshToFile() call. Stub only.
+inline uint64& stubBytesWritten()
+{
+    static uint64 bytes = 0;
+    return bytes;
+}
+
+inline int
+subdivideMeshToFile(MeshInterface *mesh,
+                    const char    *fileName,
+                    int            /*facesPerVoxel*/ = 10000)
+{
+    stubBytesWritten() = 0;
+
+    FILE *file = std::fopen(fileName, "wb");
+    if (!file)
+        return 1;
+
+    uint64 bytes = 0;
+    const int numVoxels = mesh->getNumVoxels();
+    bytes += std::fwrite(&numVoxels, sizeof(int), 1, file)*sizeof(int);
+
+    for (int v=0; v<numVoxels; v++) {
+        const uint32 flags = mesh->getVoxelFlags(v);
+        const Box bbox = mesh->getVoxelBBox(v);
+        bytes += std::fwrite(&flags, sizeof(flags), 1, file)*sizeof(flags);
+        bytes += std::fwrite(&bbox, sizeof(bbox), 1, file)*sizeof(bbox);
+
+        uint64 memUsage = 0;
+        MeshVoxel *voxel = mesh->getVoxel(v, &memUsage);
+        bytes += std::fwrite(&voxel->numChannels, sizeof(int), 1, file)*
+            sizeof(int);
+        for (int c=0; c<voxel->numChannels; c++) {
+            const MeshChannel &ch = voxel->channels[c];
+            const int header[5] = { ch.elementSize, ch.numElements,
+                                    ch.channelID, ch.depChannelID, ch.flags };
+            bytes += std::fwrite(header, sizeof(header), 1, file)*
+                sizeof(header);
+            if (ch.data && ch.numElements > 0)
+                bytes += std::fwrite(ch.data, ch.elementSize,
+                                     ch.numElements, file)*ch.elementSize;
+        }
+        mesh->releaseVoxel(voxel, &memUsage);
+    }
+
+    std::fclose(file);
+    stubBytesWritten() = bytes;
+    return 0;
+}
+
+} // namespace VUtils
+
+#endif // VRMESH_STUB_VOXELSUBDIVIDER_H
@@ -0,0 +1,403 @@
+// ----------------------------------------------------------------------------
+//
+// vrmeshbench.cc
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Benchmark and validation harness for the vrmesh export path. It builds
+// against the stand-in V-Ray headers in stub/ and needs neither V-Ray nor
+// Naiad: a synthetic mesh is voxelized with VRVoxelBuilder, written through
+// VRMesh and the stub subdivider, and every voxel is checked for valid
+// bounds and indices. A second pass rebuilds the same topology with moved
+// vertices to measure partition reuse. Returns non-zero if a check fails.
+//
+// ----------------------------------------------------------------------------
+
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <sys/resource.h>
+
+#include "VRMesh.h"
+#include "VRVoxelBuilder.h"
+
+
+std::string clockString(const double seconds)
+{
+    std::stringstream ss;
+
+    if (60.0 > seconds) {
+        ss << seconds << "s";
+        return ss.str();
+    }
+
+    const int minutes(static_cast<int>(seconds/60.0));
+    ss << minutes << "m " << seconds - 60.0*minutes << "s";
+    return ss.str();
+}
+
+
+double wallTime()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return static_cast<double>(std::clock())/CLOCKS_PER_SEC;
+#endif
+}
+
+
+//! Peak resident set size of the process in MB.
+double peakMemoryMB()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss/1024.0;  // kilobytes on Linux
+}
+
+//! Default output path, in $TMPDIR (or /tmp) rather than the working
+//! directory so that a run from a source tree leaves nothing behind.
+std::string defaultOutputPath()
+{
+    const char *tmp = std::getenv("TMPDIR");
+    return std::string(tmp && *tmp ? tmp : "/tmp") + "/vrmeshbench.out";
+}
+
+
+// SyntheticMesh
+// -------------
+//! A wavy res x res quad sheet split into triangles, with velocities,
+//! normals, one per-vertex map and one per-corner uv map.
+
+struct SyntheticMesh
+{
+    std::vector<VUtils::Vector>       position;
+    std::vector<VUtils::Vector>       velocity;
+    std::vector<VUtils::Vector>       normal;
+    std::vector<VUtils::FaceTopoData> index;
+    std::vector<VUtils::Vector>       foam;
+    std::vector<VUtils::Vector>       uv;
+    std::vector<VUtils::FaceTopoData> uvIndex;
+
+    SyntheticMesh(const int res)
+    {
+        const int n = res + 1;
+        position.resize(n*n);
+        velocity.resize(n*n);
+        normal.resize(n*n);
+        foam.resize(n*n);
+        moveTo(0.f);
+
+        index.resize(2*res*res);
+        uv.resize(3*index.size());
+        uvIndex.resize(index.size());
+        for (int j=0; j<res; j++) {
+            for (int i=0; i<res; i++) {
+                const int a = j*n + i;
+                const int f = 2*(j*res + i);
+                const int quad[2][3] = { { a, a + 1, a + n },
+                                         { a + 1, a + n + 1, a + n } };
+                for (int t=0; t<2; t++) {
+                    for (int k=0; k<3; k++) {
+                        index[f + t].v[k] = quad[t][k];
+                        uv[3*(f + t) + k].x = position[quad[t][k]].x;
+                        uv[3*(f + t) + k].y = position[quad[t][k]].z;
+                        uv[3*(f + t) + k].z = 0.f;
+                        uvIndex[f + t].v[k] = 3*(f + t) + k;
+                    }
+                }
+            }
+        }
+    }
+
+    //! Vertex data at time t, the topology does not change.
+    void moveTo(const float t)
+    {
+        const int n = static_cast<int>(std::sqrt(double(position.size())));
+#pragma omp parallel for schedule(static)
+        for (int j=0; j<n; j++) {
+            for (int i=0; i<n; i++) {
+                const int v = j*n + i;
+                const float x = float(i)/(n - 1), z = float(j)/(n - 1);
+                const float h = 0.05f*std::sin(20.f*x + t)*std::cos(17.f*z);
+                position[v].x = x;
+                position[v].y = h;
+                position[v].z = z;
+                velocity[v].x = 0.f;
+                velocity[v].y = 0.05f*std::cos(20.f*x + t)*std::cos(17.f*z);
+                velocity[v].z = 0.f;
+                normal[v].x = 0.f;
+                normal[v].y = 1.f;
+                normal[v].z = 0.f;
+                foam[v].x = h > 0.04f ? 1.f : 0.f;
+                foam[v].y = foam[v].z = 0.f;
+            }
+        }
+    }
+
+    VRMeshView view() const
+    {
+        VRMeshView mesh;
+        mesh.position = &position[0];
+        mesh.velocity = &velocity[0];
+        mesh.normal = &normal[0];
+        mesh.index = &index[0];
+        mesh.numVerts = static_cast<int>(position.size());
+        mesh.numFaces = static_cast<int>(index.size());
+        mesh.velocityScale = 1.f/24.f;
+
+        VRMapChannel foamMap;
+        foamMap.name = "foam";
+        foamMap.values = &foam[0];
+        foamMap.numValues = mesh.numVerts;
+        mesh.maps.push_back(foamMap);
+
+        VRMapChannel uvMap;
+        uvMap.name = "uv";
+        uvMap.values = &uv[0];
+        uvMap.numValues = static_cast<int>(uv.size());
+        uvMap.index = &uvIndex[0];
+        mesh.maps.push_back(uvMap);
+
+        return mesh;
+    }
+};
+
+
+// validate
+// --------
+//! Checks every voxel of vrm against the mesh it was built from and
+//! returns the number of problems found.
+
+int validate(VRMesh &vrm, const VRMeshView &mesh)
+{
+    int errors = 0;
+    int previewVoxels = 0;
+    int64_t geometryFaces = 0;
+
+    for (int v=0; v<vrm.getNumVoxels(); v++) {
+        const uint32 flags = vrm.getVoxelFlags(v);
+        const VUtils::Box bbox = vrm.getVoxelBBox(v);
+        VUtils::MeshVoxel *voxel = vrm.getVoxel(v, 0);
+
+        if (flags == MVF_PREVIEW_VOXEL)
+            ++previewVoxels;
+
+        const VUtils::MeshChannel *geom = voxel->getChannel(VERT_GEOM_CHANNEL);
+        const VUtils::MeshChannel *topo = voxel->getChannel(FACE_TOPO_CHANNEL);
+        if (!geom || !topo) {
+            std::cerr << "Voxel " << v << ": missing geometry channels\n";
+            ++errors;
+            vrm.releaseVoxel(voxel, 0);
+            continue;
+        }
+        if (flags == MVF_GEOMETRY_VOXEL)
+            geometryFaces += topo->numElements;
+
+        // Every vertex inside the voxel bounds.
+        const VUtils::Vector *pos =
+            static_cast<const VUtils::Vector*>(geom->data);
+        for (int i=0; i<geom->numElements; i++) {
+            if (pos[i].x < bbox.pmin.x || pos[i].x > bbox.pmax.x ||
+                pos[i].y < bbox.pmin.y || pos[i].y > bbox.pmax.y ||
+                pos[i].z < bbox.pmin.z || pos[i].z > bbox.pmax.z) {
+                std::cerr << "Voxel " << v << ": vertex " << i
+                          << " outside of the voxel bounds\n";
+                ++errors;
+                break;
+            }
+        }
+
+        // Every index channel addresses its data channel in range.
+        for (int c=0; c<voxel->numChannels; c++) {
+            const VUtils::MeshChannel &ch = voxel->channels[c];
+            if (ch.flags != MF_TOPO_CHANNEL)
+                continue;
+
+            int numValues = -1;
+            for (int d=0; d<voxel->numChannels; d++)
+                if (voxel->channels[d].depChannelID == ch.channelID &&
+                    voxel->channels[d].flags == MF_VERT_CHANNEL)
+                    numValues = voxel->channels[d].numElements;
+
+            if (ch.numElements != topo->numElements) {
+                std::cerr << "Voxel " << v << ": channel " << ch.channelID
+                          << " has " << ch.numElements << " faces, expected "
+                          << topo->numElements << "\n";
+                ++errors;
+            }
+
+            const VUtils::FaceTopoData *faces =
+                static_cast<const VUtils::FaceTopoData*>(ch.data);
+            for (int f=0; f<ch.numElements; f++) {
+                for (int k=0; k<3; k++) {
+                    if (faces[f].v[k] < 0 || faces[f].v[k] >= numValues) {
+                        std::cerr << "Voxel " << v << ": channel "
+                                  << ch.channelID << " index " << faces[f].v[k]
+                                  << " out of range [0," << numValues << ")\n";
+                        ++errors;
+                        f = ch.numElements;
+                        break;
+                    }
+                }
+            }
+        }
+
+        vrm.releaseVoxel(voxel, 0);
+    }
+
+    if (previewVoxels != 1) {
+        std::cerr << previewVoxels << " preview voxels, expected 1\n";
+        ++errors;
+    }
+    if (geometryFaces != mesh.numFaces) {
+        std::cerr << geometryFaces << " faces in geometry voxels, expected "
+                  << mesh.numFaces << "\n";
+        ++errors;
+    }
+    return errors;
+}
+
+
+// runPass
+// -------
+//! Voxelizes, writes and validates mesh once. The partition is reused if
+//! it still matches, which must be the case exactly when expectReuse is set.
+//! Returns the number of validation errors.
+
+int runPass(const std::string      &name,
+            const VRMeshView       &mesh,
+            const VRVoxelBuilder   &builder,
+            VRVoxelPartition       &part,
+            const bool              expectReuse,
+            const std::string      &outputPath)
+{
+    VRMesh vrm;
+
+    const int generation0 = part.generation;
+
+    const double t0 = wallTime();
+    const bool reused = builder.matches(mesh, part);
+    if (!reused)
+        builder.partition(mesh, part, true);
+    const double t1 = wallTime();
+
+    int errors = 0;
+    const bool kept = (part.generation == generation0);
+    if (reused != expectReuse || kept != expectReuse) {
+        std::cerr << "ERROR: " << name << ": partition "
+                  << (kept ? "reused" : "rebuilt") << ", expected "
+                  << (expectReuse ? "reuse" : "a new one") << "\n";
+        ++errors;
+    }
+
+    builder.buildPreview(std::vector<VRMeshView>(1, mesh), 10000, vrm);
+    builder.build(mesh, part, vrm);
+    const double t2 = wallTime();
+
+    VUtils::subdivideMeshToFile(&vrm, outputPath.c_str(),
+                                builder.facesPerVoxel());
+    const double t3 = wallTime();
+
+    errors += validate(vrm, mesh);
+
+    std::cerr
+        << name << ":\n"
+        << "\tVoxels: " << vrm.getNumVoxels() << "\n"
+        << "\tPartition: " << (reused ? "reused" : clockString(t1 - t0)) << "\n"
+        << "\tBuild: " << clockString(t2 - t1) << "\n"
+        << "\tWrite: " << clockString(t3 - t2) << "\n"
+        << "\tVoxelization total: " << clockString(t2 - t0) << "\n"
+        << "\tBytes written: " << VUtils::stubBytesWritten() << "\n"
+        << "\tVoxel memory: " << vrm.ownedBytes()/(1024.0*1024.0) << " MB\n"
+        << "\tPeak memory: " << peakMemoryMB() << " MB\n"
+        << "\tValidation errors: " << errors << "\n";
+
+    vrm.freeMem();
+    return errors;
+}
+
+
+// main
+// ----
+//! Entry point.
+
+int main( int argc, char *argv[] )
+{
+    try {
+        const int res(1 < argc ? std::atoi(argv[1]) : 1000);
+        const int facesPerVoxel(2 < argc ? std::atoi(argv[2]) : 10000);
+        const std::string outputPath(3 < argc ? argv[3]
+                                              : defaultOutputPath());
+
+        if (0 >= res || 0 >= facesPerVoxel) {
+            std::cerr
+                << "Usage: vrmeshbench [resolution] [facesPerVoxel] [output]\n"
+                << "Example: vrmeshbench 1000 10000 /tmp/vrmeshbench.out\n"
+                << "The output defaults to $TMPDIR/vrmeshbench.out.\n";
+            return 40;
+        }
+
+        std::cerr << "Generating " << 2*res*res << " faces...\n";
+        const double t0 = wallTime();
+        SyntheticMesh synthetic(res);
+        std::cerr << "Generated in " << clockString(wallTime() - t0) << "\n"
+                  << "Peak memory: " << peakMemoryMB() << " MB\n\n";
+
+        const VRVoxelBuilder builder(facesPerVoxel);
+        VRVoxelPartition part;
+
+        int errors = runPass("Frame 1", synthetic.view(), builder, part,
+                             false, outputPath);
+
+        // Same topology, moved vertices: the partition must be reused.
+        synthetic.moveTo(1.f);
+        errors += runPass("Frame 2 (same topology)", synthetic.view(),
+                          builder, part, true, outputPath);
+
+        std::cerr << "\n" << (errors ? "FAILED" : "PASSED") << "\n";
+        return errors ? 1 : 0;
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "\nERROR: " << ex.what() << "\n\n";
+        return 1;
+    }
+}
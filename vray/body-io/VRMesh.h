@@ -37,185 +37,320 @@
 #ifndef VRMESH_H
 #define VRMESH_H
 
+#include <deque>
 #include <string>
+#include <vector>
 #include <iostream>
+#include <stdint.h>
 
 // V-Ray includes
 #include <mesh_file.h>
 #include <voxelsubdivider.h>
 #include <table.h>
 
-class VRMesh : public VUtils::MeshInterface
+// ----------------------------------------------------------------------------
+
+//! A borrowed V-Ray map channel. Without an index the values are per
+//! vertex and the channel shares the face indices of the geometry.
+struct VRMapChannel
 {
-	VUtils::Table<VUtils::MeshVoxel> voxels;
-	VUtils::Box bbox;
+	VRMapChannel()
+		: values(0), numValues(0), index(0)
+	{}
 
-public:
-	VRMesh()
+	std::string                 name;
+	const VUtils::Vector       *values;    //!< numValues elements
+	int                         numValues;
+	const VUtils::FaceTopoData *index;     //!< numFaces elements, or null
+};
+
+//! A borrowed view of one triangle mesh. VRMesh never copies or frees the
+//! arrays, so they must stay valid until the mesh has been written.
+struct VRMeshView
+{
+	VRMeshView()
+		: position(0), velocity(0), normal(0), index(0),
+		  numVerts(0), numFaces(0), velocityScale(1.f)
+	{}
+
+	const VUtils::Vector       *position;  //!< numVerts elements
+	const VUtils::Vector       *velocity;  //!< numVerts elements, or null
+	const VUtils::Vector       *normal;    //!< numVerts elements, or null
+	const VUtils::FaceTopoData *index;     //!< numFaces elements
+	int                         numVerts;
+	int                         numFaces;
+	float                       velocityScale; //!< applied when voxelized
+	std::vector<VRMapChannel>   maps;      //!< written as map channels 0..n-1
+};
+
+// ----------------------------------------------------------------------------
+
+//! Description of one V-Ray mesh channel. The data is handed to V-Ray as is
+//! when a voxel is requested, no per-element conversion takes place. It is
+//! either borrowed (data) or owned by the channel (storage).
+struct VRChannel
+{
+	VRChannel()
+		: elementSize(0), numElements(0), channelID(0), depChannelID(0),
+		  flags(0), data(0)
+	{}
+
+	int               elementSize;
+	int               numElements;
+	int               channelID;
+	int               depChannelID;
+	int               flags;
+	const void       *data;
+	std::vector<char> storage;
+
+	const void* ptr() const
+	{ return storage.empty() ? data : &storage[0]; }
+
+	void* mutablePtr()
+	{ return storage.empty() ? 0 : &storage[0]; }
+
+	uint64 bytes() const
+	{ return uint64(elementSize)*uint64(numElements); }
+
+	//! Sets index k of face f in an owned index channel.
+	void setIndex(const int f, const int k, const int value)
+	{ reinterpret_cast<VUtils::FaceTopoData*>(&storage[0])[f].v[k] = value; }
+};
+
+//! A voxel as VRMesh stores it between addMeshData() and the final write.
+struct VRVoxel
+{
+	VRVoxel()
+		: flags(MVF_GEOMETRY_VOXEL)
 	{
-		std::cout << "VRMesh constructor called" << std::endl;
 		bbox.init();
 	}
 
-	virtual ~VRMesh()
+	//! Appends a channel. With null data the channel allocates and owns
+	//! numElements*elementSize bytes, filled in by the caller.
+	VRChannel& addChannel(const int   elementSize,
+						  const int   numElements,
+						  const int   channelID,
+						  const int   depChannelID,
+						  const int   channelFlags,
+						  const void *data = 0)
+	{
+		channels.push_back(VRChannel());
+		VRChannel &ch = channels.back();
+		ch.elementSize = elementSize;
+		ch.numElements = numElements;
+		ch.channelID = channelID;
+		ch.depChannelID = depChannelID;
+		ch.flags = channelFlags;
+		ch.data = data;
+		if (!data && numElements > 0)
+			ch.storage.resize(size_t(elementSize)*size_t(numElements));
+		return ch;
+	}
+
+	//! Appends a face index channel. With null faces the channel owns its
+	//! indices, filled in through VRChannel::setIndex().
+	VRChannel& addIndexChannel(const int                   numFaces,
+							   const int                   channelID,
+							   const VUtils::FaceTopoData *faces = 0)
 	{
-		std::cout << "VRMesh destructor called" << std::endl;
+		channels.push_back(VRChannel());
+		VRChannel &ch = channels.back();
+		ch.elementSize = sizeof(VUtils::FaceTopoData);
+		ch.numElements = numFaces;
+		ch.channelID = channelID;
+		ch.depChannelID = 0;
+		ch.flags = MF_TOPO_CHANNEL;
+		if (faces)
+			ch.data = faces;
+		else if (numFaces > 0)
+			ch.storage.resize(size_t(numFaces)*sizeof(VUtils::FaceTopoData));
+		return ch;
 	}
+
+	VUtils::Box            bbox;
+	uint32                 flags;
+	std::vector<VRChannel> channels;
+};
+
+// ----------------------------------------------------------------------------
+
+class VRMesh : public VUtils::MeshInterface
+{
+	// A deque, so that appending voxels never copies the channel storage of
+	// the voxels already added.
+	std::deque<VRVoxel>  voxels;
+	int                  _debugLevel;
+
+public:
+	VRMesh()
+		: _debugLevel(0)
+	{}
+
+	virtual ~VRMesh()
+	{}
+
+	//! 0 is silent, 1 reports added meshes, 2 also traces every accessor call.
+	void setDebugLevel(const int level)
+	{ _debugLevel = level; }
+
 	virtual int getNumVoxels()
 	{
-		std::cout << "getNumVoxels() method called: " <<  voxels.count() << std::endl;
-		return voxels.count();
+		return static_cast<int>(voxels.size());
 	}
+
 	virtual VUtils::Box getVoxelBBox(int index)
 	{
-		std::cout << "getVoxelBBox() method called:" << index << std::endl;
-		return bbox;
+		if (_debugLevel > 1)
+			std::cerr << "VRMesh::getVoxelBBox(" << index << ")" << std::endl;
+		return voxels[index].bbox;
 	}
+
 	virtual uint32 getVoxelFlags(int index)
 	{
-		std::cout << "getVoxelFlags() method called: " << index << std::endl;
-		return index==0 ? MVF_PREVIEW_VOXEL:MVF_GEOMETRY_VOXEL;
+		if (_debugLevel > 1)
+			std::cerr << "VRMesh::getVoxelFlags(" << index << ")" << std::endl;
+		return voxels[index].flags;
 	}
 
+	//! Builds a transient MeshVoxel whose channels point straight at the
+	//! stored data. It is torn down again in releaseVoxel().
 	virtual VUtils::MeshVoxel* getVoxel(int index, uint64* memUsage)
 	{
-		std::cout << "getVoxel() method called: " << index << std::endl;
+		if (_debugLevel > 1)
+			std::cerr << "VRMesh::getVoxel(" << index << ")" << std::endl;
 
-		VUtils::MeshVoxel &voxel=voxels[index];
+		const VRVoxel &src = voxels[index];
 
-//		voxel.init();
+		VUtils::MeshVoxel *voxel = new VUtils::MeshVoxel;
+		voxel->init();
+		voxel->index = index;
+		voxel->numChannels = static_cast<int>(src.channels.size());
+		voxel->channels = new VUtils::MeshChannel[voxel->numChannels];
 
-		std::cout << "index " << index << std::endl;
-		std::cout << "voxels.count() " << voxels.count() << std::endl;
-		voxel.index=index;
-		return &voxel;
+		for (int i=0; i<voxel->numChannels; i++)
+		{
+			const VRChannel &ch = src.channels[i];
+			voxel->channels[i].init(ch.elementSize,
+									ch.numElements,
+									ch.channelID,
+									ch.depChannelID,
+									ch.flags,
+									false);
+			voxel->channels[i].data = const_cast<void*>(ch.ptr());
+			if (memUsage)
+				*memUsage += ch.bytes();
+		}
+		return voxel;
 	}
 
-	virtual void releaseVoxel(VUtils::MeshVoxel*, uint64*)
+	virtual void releaseVoxel(VUtils::MeshVoxel* voxel, uint64* memUsage)
 	{
+		if (!voxel)
+			return;
+
+		// The channel data is borrowed, detach it before the channels go.
+		for (int i=0; i<voxel->numChannels; i++)
+		{
+			if (memUsage)
+				*memUsage -= uint64(voxel->channels[i].elementSize)*
+					uint64(voxel->channels[i].numElements);
+			voxel->channels[i].data = 0;
+		}
+		delete [] voxel->channels;
+		voxel->channels = 0;
+		voxel->numChannels = 0;
+		delete voxel;
 	}
 
-	void addMeshData(const Nb::Buffer3i &idx,
-					 const Nb::Buffer3f &pos,
-					 const Nb::Buffer3f &vel,
-					 const Nb::Buffer3f *nrm)
+	//! Adds the mesh as one voxel. The mesh arrays are referenced, not copied.
+	void addMeshData(const VRMeshView &mesh, const uint32 flags)
 	{
-		NB_INFO("pos.size() = " << pos.size());
+		if (_debugLevel > 0)
+			std::cerr << "VRMesh::addMeshData() " << mesh.numVerts
+					  << " vertices, " << mesh.numFaces << " faces" << std::endl;
+
+		voxels.push_back(VRVoxel());
+		VRVoxel &voxel = voxels.back();
+		voxel.flags = flags;
+		voxel.bbox = computeBBox(mesh.position, mesh.numVerts);
+
+		// Channel 0 : Position
+		// Channel 1 : Velocities (optional)
+		// Channel 2 : Tri-face vertex indices
+		// Channel 3 : Normals (optional)
+		voxel.addChannel(sizeof(VUtils::VertGeomData), mesh.numVerts,
+						 VERT_GEOM_CHANNEL, FACE_TOPO_CHANNEL, MF_VERT_CHANNEL,
+						 mesh.position);
+		if (mesh.velocity)
+			voxel.addChannel(sizeof(VUtils::VertGeomData), mesh.numVerts,
+							 VERT_VELOCITY_CHANNEL, FACE_TOPO_CHANNEL,
+							 MF_VERT_CHANNEL, mesh.velocity);
+		voxel.addChannel(sizeof(VUtils::FaceTopoData), mesh.numFaces,
+						 FACE_TOPO_CHANNEL, 0, MF_TOPO_CHANNEL,
+						 mesh.index);
+		if (mesh.normal)
+			voxel.addChannel(sizeof(VUtils::VertGeomData), mesh.numVerts,
+							 VERT_NORMAL_CHANNEL, FACE_TOPO_CHANNEL,
+							 MF_VERT_CHANNEL, mesh.normal);
+	}
 
-		VUtils::MeshVoxel* vp = voxels.newElement();
-		if (vp)
+	//! Appends count empty voxels and returns the index of the first one.
+	//! The voxels may then be filled concurrently through voxel().
+	int addVoxels(const int count, const uint32 flags)
+	{
+		const int first = static_cast<int>(voxels.size());
+		voxels.resize(first + count);
+		for (int i=first; i<first+count; i++)
 		{
-            vp->init();
-			
-			// Channel 0 : Position
-			// Channel 1 : Velocities
-			// Channel 2 : Tri-face vertex indices
-            vp->numChannels = 3;
-
-			// Get the collection of vertices
-			VUtils::Vector* verts = new VUtils::Vector [pos.size()];
-			for (size_t i=0;i<pos.size();i++)
-			{
-				verts[i].x = pos[i][0];
-				verts[i].y = pos[i][1];
-				verts[i].z = pos[i][2];
-				bbox+=verts[i];
-			}
+			voxels[i].flags = flags;
+			voxels[i].channels.reserve(8);
+		}
+		return first;
+	}
 
+	VRVoxel& voxel(const int index)
+	{ return voxels[index]; }
 
-			// Get the collection of velocities
-			VUtils::Vector* velocities = new VUtils::Vector [vel.size()];
-			for (size_t i=0;i<vel.size();i++)
-			{
-				velocities[i].x = vel[i][0];
-				velocities[i].y = vel[i][1];
-				velocities[i].z = vel[i][2];
-			}
+	//! Total bytes held by the channels VRMesh owns.
+	uint64 ownedBytes() const
+	{
+		uint64 bytes = 0;
+		for (size_t v=0; v<voxels.size(); v++)
+			for (size_t c=0; c<voxels[v].channels.size(); c++)
+				bytes += voxels[v].channels[c].storage.size();
+		return bytes;
+	}
 
-			// Get the collection of tri-face vertices index
-			VUtils::FaceTopoData* topo = new VUtils::FaceTopoData[idx.size()];
-			for (size_t i=0;i<idx.size();i++)
-			{
-				topo[i].v[0] = idx[i][0];
-				topo[i].v[1] = idx[i][1];
-				topo[i].v[2] = idx[i][2];
-			}
+	//< Clean up
+	void freeMem()
+	{
+		voxels.clear();
+	}
 
-			// ====================================================================
-			// Optional channels must be collected last as we are incrementing index
-			// ====================================================================
+	//! Parallel bounding box of n vertices.
+	static VUtils::Box computeBBox(const VUtils::Vector *verts, const int n)
+	{
+		VUtils::Box bbox;
+		bbox.init();
 
-			// Get the collection of normals (if they exists)
-			VUtils::Vector* normals = 0;
-			int normalChannelIndex = -1;
-			if (nrm)
+#pragma omp parallel
+		{
+			VUtils::Box local;
+			local.init();
+#pragma omp for schedule(static)
+			for (int i=0; i<n; i++)
+				local += verts[i];
+#pragma omp critical(VRMeshBBox)
 			{
-				normals = new VUtils::Vector [nrm->size()];
-				for (size_t i=0;i<nrm->size();i++)
+				if (local.pmin.x <= local.pmax.x)
 				{
-					normals[i].x = (*nrm)[i][0];
-					normals[i].y = (*nrm)[i][1];
-					normals[i].z = (*nrm)[i][2];
+					bbox += local.pmin;
+					bbox += local.pmax;
 				}
-				normalChannelIndex = vp->numChannels;
-				vp->numChannels++;
 			}
-
-			// Create the number of channels (variable depending on input)
-            vp->channels = new VUtils::MeshChannel[vp->numChannels];
-
-			// Put data into voxel
-			VUtils::MeshChannel &geomChan=vp->channels[0];
-            geomChan.init(sizeof(VUtils::VertGeomData),
-						  pos.size(),
-						  VERT_GEOM_CHANNEL,
-						  FACE_TOPO_CHANNEL,
-						  MF_VERT_CHANNEL,
-						  false);
-            geomChan.data = verts;
-
-			VUtils::MeshChannel &velChan=vp->channels[1];
-            velChan.init(sizeof(VUtils::VertGeomData),
-						  vel.size(),
-						  VERT_VELOCITY_CHANNEL,
-						  FACE_TOPO_CHANNEL,
-						  MF_VERT_CHANNEL,
-						  false);
-            velChan.data = velocities;
-
-			VUtils::MeshChannel &topoChan=vp->channels[2];
-            topoChan.init(sizeof(VUtils::FaceTopoData),
-						  idx.size(),
-						  FACE_TOPO_CHANNEL,
-						  0, MF_TOPO_CHANNEL,
-						  false);
-            topoChan.data = topo;
-
-			// ====================================================================
-			// Optional channels must be added last to match index
-			// Order is critical
-			// ====================================================================
-			if (nrm && normals)
-			{
-				VUtils::MeshChannel &nrmChan=vp->channels[normalChannelIndex];
-				nrmChan.init(sizeof(VUtils::VertGeomData),
-							 nrm->size(),
-							 VERT_NORMAL_CHANNEL,
-							 FACE_TOPO_CHANNEL,
-							 MF_VERT_CHANNEL,
-							 false);
-				nrmChan.data = normals;
-			}
-
 		}
-	}
-
-	//< Clean up
-	void freeMem()
-	{
-	    for (int i=0; i<voxels.count(); i++)
-	    	voxels[i].freeMem();
-	    voxels.freeData();
+		return bbox;
 	}
 };
 
@@ -0,0 +1,527 @@
+// ----------------------------------------------------------------------------
+//
+// VRVoxelBuilder.h
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+
+#ifndef VRVOXELBUILDER_H
+#define VRVOXELBUILDER_H
+
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "VRMesh.h"
+
+// ----------------------------------------------------------------------------
+
+//! The topology dependent part of a voxelized mesh: which faces go into
+//! which voxel, and the voxel-local vertex remaps.
+struct VRVoxelPartition
+{
+	struct Voxel
+	{
+		std::vector<int>                  verts;   //!< local -> mesh vertex
+		std::vector<int>                  faceIds; //!< local -> mesh face
+		std::vector<VUtils::FaceTopoData> faces;   //!< local vertex indices
+	};
+
+	VRVoxelPartition()
+		: numVerts(0), numFaces(0), facesPerVoxel(0), generation(0)
+	{}
+
+	std::vector<Voxel> voxels;
+	int                numVerts;
+	int                numFaces;
+	int                facesPerVoxel;
+	int                generation;    //!< bumped by every partition()
+
+	//! Copy of the mesh face indices, only kept for topology reuse.
+	std::vector<VUtils::FaceTopoData> topology;
+};
+
+// ----------------------------------------------------------------------------
+
+//! Splits meshes into spatially coherent voxels of at most facesPerVoxel
+//! faces and fills VRMesh with them. All per-voxel work runs in parallel,
+//! voxels are still appended in a deterministic order.
+class VRVoxelBuilder
+{
+public:
+	explicit VRVoxelBuilder(const int facesPerVoxel = 10000)
+		: _facesPerVoxel(std::max(1, facesPerVoxel))
+	{}
+
+	int facesPerVoxel() const
+	{ return _facesPerVoxel; }
+
+	//! True if part can be reused for mesh: same face budget and the exact
+	//! same face indices. Only partitions built with keepTopology match.
+	bool matches(const VRMeshView &mesh, const VRVoxelPartition &part) const
+	{
+		if (part.facesPerVoxel != _facesPerVoxel ||
+			part.numVerts != mesh.numVerts ||
+			part.numFaces != mesh.numFaces ||
+			part.topology.size() != size_t(mesh.numFaces) ||
+			mesh.numFaces == 0)
+			return false;
+		return std::memcmp(&part.topology[0], mesh.index,
+						   part.topology.size()*
+						   sizeof(VUtils::FaceTopoData)) == 0;
+	}
+
+	//! Median-splits the face centroids along the longest axis until every
+	//! range fits in a voxel, then builds the local vertex remaps. With
+	//! keepTopology the face indices are stored for matches().
+	void partition(const VRMeshView &mesh,
+				   VRVoxelPartition &part,
+				   const bool        keepTopology = false) const
+	{
+		part.voxels.clear();
+		part.topology.clear();
+		part.numVerts = mesh.numVerts;
+		part.numFaces = mesh.numFaces;
+		part.facesPerVoxel = _facesPerVoxel;
+		++part.generation;
+
+		const int nf = mesh.numFaces;
+		if (nf == 0)
+			return;
+
+		if (keepTopology)
+			part.topology.assign(mesh.index, mesh.index + nf);
+
+		std::vector<VUtils::Vector> centroid(nf);
+#pragma omp parallel for schedule(static)
+		for (int f=0; f<nf; f++)
+		{
+			const VUtils::Vector &a = mesh.position[mesh.index[f].v[0]];
+			const VUtils::Vector &b = mesh.position[mesh.index[f].v[1]];
+			const VUtils::Vector &c = mesh.position[mesh.index[f].v[2]];
+			centroid[f].x = (a.x + b.x + c.x)*(1.f/3.f);
+			centroid[f].y = (a.y + b.y + c.y)*(1.f/3.f);
+			centroid[f].z = (a.z + b.z + c.z)*(1.f/3.f);
+		}
+
+		std::vector<int> order(nf);
+		for (int f=0; f<nf; f++)
+			order[f] = f;
+
+		// Split breadth first so the ranges of one level run in parallel.
+		std::vector<Range> level(1, Range(0, nf));
+		std::vector<Range> leaves;
+		while (!level.empty())
+		{
+			const int nr = static_cast<int>(level.size());
+			std::vector<Range> halves(2*nr);
+			std::vector<char>  split(nr, 0);
+
+#pragma omp parallel for schedule(dynamic)
+			for (int r=0; r<nr; r++)
+			{
+				const Range range = level[r];
+				if (range.end - range.begin <= _facesPerVoxel)
+					continue;
+
+				VUtils::Box box;
+				box.init();
+				for (int i=range.begin; i<range.end; i++)
+					box += centroid[order[i]];
+
+				const float dx = box.pmax.x - box.pmin.x;
+				const float dy = box.pmax.y - box.pmin.y;
+				const float dz = box.pmax.z - box.pmin.z;
+				const int axis = (dx >= dy && dx >= dz) ? 0 : (dy >= dz ? 1 : 2);
+
+				const int mid = range.begin + (range.end - range.begin)/2;
+				std::nth_element(order.begin() + range.begin,
+								 order.begin() + mid,
+								 order.begin() + range.end,
+								 CentroidLess(centroid, axis));
+				halves[2*r]   = Range(range.begin, mid);
+				halves[2*r+1] = Range(mid, range.end);
+				split[r] = 1;
+			}
+
+			std::vector<Range> next;
+			for (int r=0; r<nr; r++)
+			{
+				if (split[r])
+				{
+					next.push_back(halves[2*r]);
+					next.push_back(halves[2*r+1]);
+				}
+				else
+					leaves.push_back(level[r]);
+			}
+			level.swap(next);
+		}
+
+		// Leaves tile the face order, sorting them restores spatial order.
+		std::sort(leaves.begin(), leaves.end());
+
+		const int nv = static_cast<int>(leaves.size());
+		part.voxels.resize(nv);
+
+#pragma omp parallel for schedule(dynamic)
+		for (int v=0; v<nv; v++)
+		{
+			const Range range = leaves[v];
+			VRVoxelPartition::Voxel &voxel = part.voxels[v];
+
+			voxel.verts.reserve(3*(range.end - range.begin));
+			for (int i=range.begin; i<range.end; i++)
+			{
+				const VUtils::FaceTopoData &face = mesh.index[order[i]];
+				voxel.verts.push_back(face.v[0]);
+				voxel.verts.push_back(face.v[1]);
+				voxel.verts.push_back(face.v[2]);
+			}
+			std::sort(voxel.verts.begin(), voxel.verts.end());
+			voxel.verts.erase(std::unique(voxel.verts.begin(),
+										  voxel.verts.end()),
+							  voxel.verts.end());
+
+			voxel.faceIds.assign(order.begin() + range.begin,
+								 order.begin() + range.end);
+			voxel.faces.resize(range.end - range.begin);
+			for (int i=range.begin; i<range.end; i++)
+			{
+				const VUtils::FaceTopoData &face = mesh.index[order[i]];
+				for (int k=0; k<3; k++)
+					voxel.faces[i - range.begin].v[k] = static_cast<int>(
+						std::lower_bound(voxel.verts.begin(),
+										 voxel.verts.end(),
+										 face.v[k]) - voxel.verts.begin());
+			}
+		}
+	}
+
+	//! Appends one geometry voxel per partition voxel, slicing the vertex
+	//! channels through the local remaps. The face channel, and the index
+	//! channel of every per-vertex map kept at full size, references the
+	//! partition, which must outlive the write. Normals and map values
+	//! that repeat within a voxel are stored once.
+	void build(const VRMeshView       &mesh,
+			   const VRVoxelPartition &part,
+			   VRMesh                 &vrm) const
+	{
+		const int nv = static_cast<int>(part.voxels.size());
+		const int first = vrm.addVoxels(nv, MVF_GEOMETRY_VOXEL);
+
+#pragma omp parallel for schedule(dynamic)
+		for (int v=0; v<nv; v++)
+		{
+			const VRVoxelPartition::Voxel &src = part.voxels[v];
+			VRVoxel &voxel = vrm.voxel(first + v);
+			const int numVerts = static_cast<int>(src.verts.size());
+
+			VRChannel &geom = voxel.addChannel(
+				sizeof(VUtils::VertGeomData), numVerts,
+				VERT_GEOM_CHANNEL, FACE_TOPO_CHANNEL, MF_VERT_CHANNEL);
+			VUtils::Vector *pos =
+				static_cast<VUtils::Vector*>(geom.mutablePtr());
+			for (int i=0; i<numVerts; i++)
+			{
+				pos[i] = mesh.position[src.verts[i]];
+				voxel.bbox += pos[i];
+			}
+
+			// Velocity is sliced per voxel like the positions, so every
+			// voxel blurs with the velocities of its own vertices.
+			if (mesh.velocity)
+				_gather(voxel.addChannel(sizeof(VUtils::VertGeomData),
+										 numVerts,
+										 VERT_VELOCITY_CHANNEL,
+										 FACE_TOPO_CHANNEL,
+										 MF_VERT_CHANNEL),
+						mesh.velocity, src.verts, mesh.velocityScale);
+
+			voxel.addIndexChannel(static_cast<int>(src.faces.size()),
+								  FACE_TOPO_CHANNEL,
+								  src.faces.empty() ? 0 : &src.faces[0]);
+
+			if (mesh.normal)
+				_buildVertexChannel(mesh.normal, VERT_NORMAL_CHANNEL,
+									VERT_NORMAL_TOPO_CHANNEL, src, voxel);
+
+			for (size_t m=0; m<mesh.maps.size(); m++)
+				_buildMap(mesh.maps[m], static_cast<int>(m), src, voxel);
+		}
+	}
+
+	//! Appends a single preview voxel holding an evenly strided subset of
+	//! at most previewFaces faces, taken across all meshes.
+	void buildPreview(const std::vector<VRMeshView> &meshes,
+					  const int                      previewFaces,
+					  VRMesh                        &vrm) const
+	{
+		int64_t total = 0;
+		for (size_t m=0; m<meshes.size(); m++)
+			total += meshes[m].numFaces;
+		if (total == 0 || previewFaces <= 0)
+			return;
+
+		const int64_t stride = (total + previewFaces - 1)/previewFaces;
+
+		std::vector<VUtils::Vector>       pos;
+		std::vector<VUtils::FaceTopoData> faces;
+		for (size_t m=0; m<meshes.size(); m++)
+		{
+			const VRMeshView &mesh = meshes[m];
+
+			std::vector<int> verts;
+			for (int64_t f=0; f<mesh.numFaces; f+=stride)
+				for (int k=0; k<3; k++)
+					verts.push_back(mesh.index[f].v[k]);
+			std::sort(verts.begin(), verts.end());
+			verts.erase(std::unique(verts.begin(), verts.end()), verts.end());
+
+			const int offset = static_cast<int>(pos.size());
+			for (size_t i=0; i<verts.size(); i++)
+				pos.push_back(mesh.position[verts[i]]);
+
+			for (int64_t f=0; f<mesh.numFaces; f+=stride)
+			{
+				VUtils::FaceTopoData face;
+				for (int k=0; k<3; k++)
+					face.v[k] = offset + static_cast<int>(
+						std::lower_bound(verts.begin(), verts.end(),
+										 mesh.index[f].v[k]) - verts.begin());
+				faces.push_back(face);
+			}
+		}
+
+		VRVoxel &voxel = vrm.voxel(vrm.addVoxels(1, MVF_PREVIEW_VOXEL));
+		VRChannel &geom = voxel.addChannel(
+			sizeof(VUtils::VertGeomData), static_cast<int>(pos.size()),
+			VERT_GEOM_CHANNEL, FACE_TOPO_CHANNEL, MF_VERT_CHANNEL);
+		std::copy(pos.begin(), pos.end(),
+				  static_cast<VUtils::Vector*>(geom.mutablePtr()));
+		VRChannel &topo = voxel.addIndexChannel(
+			static_cast<int>(faces.size()), FACE_TOPO_CHANNEL);
+		for (size_t f=0; f<faces.size(); f++)
+			for (int k=0; k<3; k++)
+				topo.setIndex(static_cast<int>(f), k, faces[f].v[k]);
+		for (size_t i=0; i<pos.size(); i++)
+			voxel.bbox += pos[i];
+	}
+
+private:
+
+	struct Range
+	{
+		Range(const int b = 0, const int e = 0)
+			: begin(b), end(e)
+		{}
+
+		bool operator<(const Range &rhs) const
+		{ return begin < rhs.begin; }
+
+		int begin;
+		int end;
+	};
+
+	struct CentroidLess
+	{
+		CentroidLess(const std::vector<VUtils::Vector> &c, const int a)
+			: centroid(c), axis(a)
+		{}
+
+		float key(const int f) const
+		{
+			const VUtils::Vector &c = centroid[f];
+			return axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+		}
+
+		bool operator()(const int a, const int b) const
+		{ return key(a) < key(b); }
+
+		const std::vector<VUtils::Vector> &centroid;
+		const int                          axis;
+	};
+
+	static void _gather(VRChannel              &ch,
+						const VUtils::Vector   *src,
+						const std::vector<int> &verts,
+						const float             scale = 1.f)
+	{
+		VUtils::Vector *dst = static_cast<VUtils::Vector*>(ch.mutablePtr());
+		if (scale == 1.f)
+		{
+			for (size_t i=0; i<verts.size(); i++)
+				dst[i] = src[verts[i]];
+			return;
+		}
+		for (size_t i=0; i<verts.size(); i++)
+		{
+			dst[i].x = src[verts[i]].x*scale;
+			dst[i].y = src[verts[i]].y*scale;
+			dst[i].z = src[verts[i]].z*scale;
+		}
+	}
+
+	//! The bits of one value and its position in the id list.
+	struct ValueKey
+	{
+		uint32_t bits[3];
+		int      pos;
+
+		bool operator<(const ValueKey &rhs) const
+		{
+			if (bits[0] != rhs.bits[0]) return bits[0] < rhs.bits[0];
+			if (bits[1] != rhs.bits[1]) return bits[1] < rhs.bits[1];
+			return bits[2] < rhs.bits[2];
+		}
+
+		bool sameValue(const ValueKey &rhs) const
+		{
+			return bits[0] == rhs.bits[0] && bits[1] == rhs.bits[1] &&
+				bits[2] == rhs.bits[2];
+		}
+	};
+
+	//! Collapses ids that address bitwise identical values. On return
+	//! unique holds one id per distinct value and slot[i] is the position
+	//! of ids[i] in unique.
+	static void _unique(const VUtils::Vector   *values,
+						const std::vector<int> &ids,
+						std::vector<int>       &unique,
+						std::vector<int>       &slot)
+	{
+		const int n = static_cast<int>(ids.size());
+		std::vector<ValueKey> keys(n);
+		for (int i=0; i<n; i++)
+		{
+			std::memcpy(keys[i].bits, &values[ids[i]], sizeof(keys[i].bits));
+			keys[i].pos = i;
+		}
+		std::sort(keys.begin(), keys.end());
+
+		unique.clear();
+		slot.resize(n);
+		for (int i=0; i<n; i++)
+		{
+			if (i == 0 || !keys[i].sameValue(keys[i-1]))
+				unique.push_back(ids[keys[i].pos]);
+			slot[keys[i].pos] = static_cast<int>(unique.size()) - 1;
+		}
+	}
+
+	//! Adds a per-vertex channel. If its values repeat enough within the
+	//! voxel that the distinct values plus an index channel of their own
+	//! are smaller than one value per vertex, that form is written
+	//! instead; otherwise the channel shares the geometry faces.
+	static void _buildVertexChannel(const VUtils::Vector          *values,
+									const int                      channelID,
+									const int                      topoID,
+									const VRVoxelPartition::Voxel &src,
+									VRVoxel                       &voxel)
+	{
+		const int numVerts = static_cast<int>(src.verts.size());
+		const int numFaces = static_cast<int>(src.faces.size());
+
+		std::vector<int> unique, slot;
+		_unique(values, src.verts, unique, slot);
+
+		const int numValues = static_cast<int>(unique.size());
+		const uint64 indexSize = sizeof(VUtils::FaceTopoData);
+		if (uint64(numValues)*sizeof(VUtils::Vector) + numFaces*indexSize >=
+			uint64(numVerts)*sizeof(VUtils::Vector))
+		{
+			_gather(voxel.addChannel(sizeof(VUtils::Vector), numVerts,
+									 channelID, FACE_TOPO_CHANNEL,
+									 MF_VERT_CHANNEL),
+					values, src.verts);
+			return;
+		}
+
+		_gather(voxel.addChannel(sizeof(VUtils::Vector), numValues,
+								 channelID, topoID, MF_VERT_CHANNEL),
+				values, unique);
+		VRChannel &topo = voxel.addIndexChannel(numFaces, topoID);
+		for (int f=0; f<numFaces; f++)
+			for (int k=0; k<3; k++)
+				topo.setIndex(f, k, slot[src.faces[f].v[k]]);
+	}
+
+	//! Adds the map channel of the given slot to the voxel. Per-vertex maps
+	//! go through _buildVertexChannel(), indexed maps get their own remap
+	//! over the distinct values they reference.
+	static void _buildMap(const VRMapChannel             &map,
+						  const int                       slot,
+						  const VRVoxelPartition::Voxel  &src,
+						  VRVoxel                        &voxel)
+	{
+		const int texID  = VERT_TEX_CHANNEL0 + slot;
+		const int topoID = VERT_TEX_TOPO_CHANNEL0 + slot;
+		const int numFaces = static_cast<int>(src.faces.size());
+
+		if (!map.index)
+		{
+			_buildVertexChannel(map.values, texID, topoID, src, voxel);
+			return;
+		}
+
+		// Indices used by the voxel, then the distinct values behind them;
+		// per-corner maps repeat the value of a shared vertex per face.
+		std::vector<int> ids;
+		ids.reserve(3*numFaces);
+		for (int f=0; f<numFaces; f++)
+			for (int k=0; k<3; k++)
+				ids.push_back(map.index[src.faceIds[f]].v[k]);
+		std::sort(ids.begin(), ids.end());
+		ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+
+		std::vector<int> unique, slots;
+		_unique(map.values, ids, unique, slots);
+		const int numValues = static_cast<int>(unique.size());
+
+		_gather(voxel.addChannel(sizeof(VUtils::Vector), numValues,
+								 texID, topoID, MF_VERT_CHANNEL),
+				map.values, unique);
+
+		VRChannel &topo = voxel.addIndexChannel(numFaces, topoID);
+		for (int f=0; f<numFaces; f++)
+			for (int k=0; k<3; k++)
+				topo.setIndex(f, k, slots[
+					std::lower_bound(ids.begin(), ids.end(),
+									 map.index[src.faceIds[f]].v[k]) -
+					ids.begin()]);
+	}
+
+	int _facesPerVoxel;
+};
+
+#endif // VRVOXELBUILDER_H
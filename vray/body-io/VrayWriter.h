@@ -44,12 +44,21 @@
 #include <NbFilename.h>
 
 // stdc++
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <ctime>
+#include <list>
 #include <string>
 #include <vector>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 // V-ray utility
 #include "VRMesh.h"
+#include "VRVoxelBuilder.h"
 #include "VRScene.h"
 
 // ----------------------------------------------------------------------------
@@ -61,6 +70,11 @@ public:
     //! CTOR.
     VrayWriter()
         : Nb::BodyWriter()
+        , _debugLevel(0)
+        , _facesPerVoxel(10000)
+        , _previewFaces(10000)
+        , _fps(24.f)
+        , _reuseTopology(false)
     {}
 
     //! DTOR.
@@ -76,26 +90,101 @@ public:
 
 		_fileName = fileName;
 
-		NB_INFO("VrayWriter::open filename = " << fileName);
+        // Diagnostics level for the voxel accessors, 0 keeps them silent.
+        const char *debugLevel = std::getenv("NAIAD_VRMESH_DEBUG");
+        _debugLevel = debugLevel ? std::atoi(debugLevel) : 0;
+        vrm.setDebugLevel(_debugLevel);
+
+        // Voxel sizes, tunable per export.
+        const char *facesPerVoxel = std::getenv("NAIAD_VRMESH_FACES_PER_VOXEL");
+        if (facesPerVoxel)
+            setFacesPerVoxel(std::atoi(facesPerVoxel));
+        const char *previewFaces = std::getenv("NAIAD_VRMESH_PREVIEW_FACES");
+        if (previewFaces)
+            setPreviewFaces(std::atoi(previewFaces));
+        const char *fps = std::getenv("NAIAD_VRMESH_FPS");
+        if (fps)
+            setFps(static_cast<float>(std::atof(fps)));
+
+		NB_VERBOSE("VrayWriter::open filename = " << fileName);
 
     }
     
+    //! The buffers of every body passed to write() are referenced by vrm
+    //! and must stay alive until close() has returned.
     virtual void
     close()
     {
-		const int facesPerVoxel = 10000;
-		VUtils::subdivideMeshToFile(&vrm,_fileName.c_str(),facesPerVoxel);
+        const double t0 = _wallTime();
+
+        // One shared preview voxel, then the geometry voxels of every mesh
+        // in the order the bodies were written.
+        VRVoxelBuilder builder(_facesPerVoxel);
+        builder.buildPreview(_meshes, _previewFaces, vrm);
+
+        _partitions.resize(_meshes.size());
+        for (size_t m=0; m<_meshes.size(); m++) {
+            if (_reuseTopology && builder.matches(_meshes[m], _partitions[m]))
+                NB_VERBOSE("VrayWriter: reusing voxel partition of mesh " << m);
+            else
+                builder.partition(_meshes[m], _partitions[m], _reuseTopology);
+            builder.build(_meshes[m], _partitions[m], vrm);
+        }
+
+        const double t1 = _wallTime();
+
+        // Every voxel already fits the face budget, so the subdivider has
+        // nothing left to split and only serialises them.
+		if (vrm.getNumVoxels() > 0)
+			VUtils::subdivideMeshToFile(&vrm,_fileName.c_str(),_facesPerVoxel);
+
+        NB_VERBOSE("VrayWriter::close " << vrm.getNumVoxels() << " voxels, "
+                   << "build " << t1 - t0 << "s, "
+                   << "write " << _wallTime() - t1 << "s");
+
+        vrm.freeMem();
+        _meshes.clear();
+        if (!_reuseTopology)
+            _partitions.clear();
+        _converted.clear();
 
         Nb::BodyWriter::close();    // Call base method.
     }
 
+    //! Maximum number of faces per geometry voxel.
+    void
+    setFacesPerVoxel(const int facesPerVoxel)
+    { _facesPerVoxel = std::max(1, facesPerVoxel); }
+
+    //! Maximum number of faces in the preview voxel, 0 writes none.
+    void
+    setPreviewFaces(const int previewFaces)
+    { _previewFaces = std::max(0, previewFaces); }
+
+    //! Naiad velocities are per second, V-Ray blurs with velocities per
+    //! frame. They are divided by fps when written.
+    void
+    setFps(const float fps)
+    { _fps = fps > 0.f ? fps : 24.f; }
+
+    //! Keep the voxel partitions between close() and the next open(). When
+    //! the n-th mesh of the next file has identical face indices, its
+    //! partition is reused and only the vertex data is rebuilt.
+    void
+    setReuseTopology(const bool reuse)
+    {
+        _reuseTopology = reuse;
+        if (!reuse)
+            _partitions.clear();
+    }
+
     //! Use only channels listed in channels.
     virtual void
     write(const Nb::Body   *body,
           const Nb::String &channels,
           const bool        compressed)
     {
-		NB_INFO("VrayWriter::write method called");
+		NB_VERBOSE("VrayWriter::write method called");
 
         const bool meshSig = body->matches("Mesh");
         const bool particleSig = body->matches("Particle");
@@ -111,27 +200,229 @@ public:
 			_addParticleData(body);
 		
         if (meshSig)
-			_addMeshData(body);
+			_addMeshData(body, channels);
     }
 	
 private:
 
-	void _addMeshData(const Nb::Body*              body)
+    //! Seconds since an arbitrary point, wall clock where OpenMP is
+    //! available. clock() would sum the CPU time of all workers.
+    static double
+    _wallTime()
+    {
+#ifdef _OPENMP
+        return omp_get_wtime();
+#else
+        return static_cast<double>(std::clock())/CLOCKS_PER_SEC;
+#endif
+    }
+
+	void _addMeshData(const Nb::Body*              body,
+					  const Nb::String&            channels)
 	{
-		NB_INFO("VrayWriter::write() There is mesh signature");
+		NB_VERBOSE("VrayWriter::write() There is mesh signature");
 
 		// Grab the shapes.
 		const Nb::PointShape    &point = body->constPointShape();
 		const Nb::TriangleShape &triangle = body->constTriangleShape();
 		const Nb::Buffer3i      &idx = triangle.constBuffer3i("index");
 		const Nb::Buffer3f      &pos = point.constBuffer3f("position");
-		const Nb::Buffer3f      &vel = point.constBuffer3f("velocity");
+		const Nb::Buffer3f      *vel = point.queryConstBuffer3f("velocity");
 		const Nb::Buffer3f      *nrm = point.queryConstBuffer3f("normal");
-		NB_INFO("VrayWriter::write() nrm pointer value " << nrm);
-		vrm.addMeshData(idx,pos,vel,nrm); // For preview (technically, can reduce the geometry complexity)
-		vrm.addMeshData(idx,pos,vel,nrm); // For render/beauty
+
+		VRMeshView mesh;
+		mesh.numVerts = pos.size();
+		mesh.numFaces = idx.size();
+		mesh.position = _vectors(pos);
+		mesh.velocity = vel ? _vectors(*vel) : 0;
+		mesh.normal   = nrm ? _vectors(*nrm) : 0;
+		mesh.index    = _faces(idx);
+		mesh.velocityScale = 1.f/_fps;
+
+		_addPointMaps(point, channels, mesh);
+		_addTriangleMaps(triangle, channels, mesh);
+
+		for (size_t m=0; m<mesh.maps.size(); m++)
+			NB_VERBOSE("VrayWriter: '" << body->name() << "' map channel " << m
+					   << " = '" << mesh.maps[m].name << "'");
+
+		// Voxels are built from all meshes at once in close().
+		_meshes.push_back(mesh);
 	}
-	
+
+	//! Every listed float or vector point channel, other than the ones
+	//! that already have a dedicated V-Ray channel, becomes a map channel
+	//! sharing the geometry face indices.
+	void _addPointMaps(const Nb::PointShape &point,
+					   const Nb::String     &channels,
+					   VRMeshView           &mesh)
+	{
+		for (int ch=0; ch<point.channelCount(); ++ch) {
+			const Nb::String name = point.constChannelBase(ch).name();
+			if (name == "position" || name == "velocity" || name == "normal")
+				continue;
+			const Nb::String qualName = Nb::String("Point.") + name;
+			if (!qualName.listed_in_channel_list(channels))
+				continue;
+
+			VRMapChannel map;
+			map.name = name;
+			map.numValues = mesh.numVerts;
+			switch (point.constChannelBase(ch).type()) {
+				case Nb::ValueBase::FloatType:
+					map.values = _vectors(point.constBuffer1f(name));
+					break;
+				case Nb::ValueBase::Vec3fType:
+					map.values = _vectors(point.constBuffer3f(name));
+					break;
+				default:
+					NB_VERBOSE("VrayWriter: skipping point channel '"
+							   << name << "' of unsupported type");
+					continue;
+			}
+			mesh.maps.push_back(map);
+		}
+	}
+
+	//! Triangle channels hold one value per face, or per face corner for
+	//! the u/v pair. They become indexed map channels.
+	void _addTriangleMaps(const Nb::TriangleShape &triangle,
+						  const Nb::String        &channels,
+						  VRMeshView              &mesh)
+	{
+		const int nf = mesh.numFaces;
+		const bool uvListed =
+			Nb::String("Triangle.u").listed_in_channel_list(channels) &&
+			Nb::String("Triangle.v").listed_in_channel_list(channels);
+
+		// Texture coordinates, one value per face corner.
+		if (uvListed && nf > 0 &&
+			triangle.hasChannels3f("u") && triangle.hasChannels3f("v")) {
+			const Nb::Buffer3f &u = triangle.constBuffer3f("u");
+			const Nb::Buffer3f &v = triangle.constBuffer3f("v");
+
+			VUtils::Vector *uv = _allocate<VUtils::Vector>(3*nf);
+			VUtils::FaceTopoData *uvIdx = _allocate<VUtils::FaceTopoData>(nf);
+#pragma omp parallel for schedule(static)
+			for (int f=0; f<nf; f++) {
+				for (int k=0; k<3; k++) {
+					uv[3*f+k].x = u[f][k];
+					uv[3*f+k].y = v[f][k];
+					uv[3*f+k].z = 0.f;
+					uvIdx[f].v[k] = 3*f+k;
+				}
+			}
+
+			VRMapChannel map;
+			map.name = "uv";
+			map.values = uv;
+			map.numValues = 3*nf;
+			map.index = uvIdx;
+			mesh.maps.push_back(map);
+		}
+
+		// Per face values, all three corners of a face share one value.
+		const VUtils::FaceTopoData *faceIdx = 0;
+		for (int ch=0; ch<triangle.channelCount(); ++ch) {
+			const Nb::String name = triangle.constChannelBase(ch).name();
+			if (name == "index" || name == "u" || name == "v")
+				continue;
+			const Nb::String qualName = Nb::String("Triangle.") + name;
+			if (!qualName.listed_in_channel_list(channels))
+				continue;
+
+			VRMapChannel map;
+			map.name = name;
+			map.numValues = nf;
+			switch (triangle.constChannelBase(ch).type()) {
+				case Nb::ValueBase::FloatType:
+					map.values = _vectors(triangle.constBuffer1f(name));
+					break;
+				case Nb::ValueBase::Vec3fType:
+					map.values = _vectors(triangle.constBuffer3f(name));
+					break;
+				default:
+					NB_VERBOSE("VrayWriter: skipping triangle channel '"
+							   << name << "' of unsupported type");
+					continue;
+			}
+
+			if (!faceIdx && nf > 0) {
+				VUtils::FaceTopoData *idx = _allocate<VUtils::FaceTopoData>(nf);
+				for (int f=0; f<nf; f++)
+					idx[f].v[0] = idx[f].v[1] = idx[f].v[2] = f;
+				faceIdx = idx;
+			}
+			map.index = faceIdx;
+			mesh.maps.push_back(map);
+		}
+	}
+
+	//! Scratch array that lives until close().
+	template<class T> T*
+	_allocate(const size_t n)
+	{
+		_converted.push_back(std::vector<char>(n*sizeof(T)));
+		return reinterpret_cast<T*>(&_converted.back()[0]);
+	}
+
+	//! Scalars are stored in the first component of a map channel.
+	const VUtils::Vector*
+	_vectors(const Nb::Buffer1f &buf)
+	{
+		if (buf.size() == 0)
+			return 0;
+
+		VUtils::Vector *v = _allocate<VUtils::Vector>(buf.size());
+		for (size_t i=0;i<buf.size();i++)
+		{
+			v[i].x = buf[i];
+			v[i].y = 0.f;
+			v[i].z = 0.f;
+		}
+		return v;
+	}
+
+	//! Nb stores vectors as three packed floats, the same layout as
+	//! VUtils::Vector, so the buffer is normally handed over as is. A copy
+	//! is only made if the layouts ever differ.
+	const VUtils::Vector*
+	_vectors(const Nb::Buffer3f &buf)
+	{
+		if (buf.size() == 0)
+			return 0;
+		if (sizeof(buf[0]) == sizeof(VUtils::Vector))
+			return reinterpret_cast<const VUtils::Vector*>(&buf[0]);
+
+		VUtils::Vector *v = _allocate<VUtils::Vector>(buf.size());
+		for (size_t i=0;i<buf.size();i++)
+		{
+			v[i].x = buf[i][0];
+			v[i].y = buf[i][1];
+			v[i].z = buf[i][2];
+		}
+		return v;
+	}
+
+	//! Same as _vectors() for the triangle vertex indices.
+	const VUtils::FaceTopoData*
+	_faces(const Nb::Buffer3i &buf)
+	{
+		if (buf.size() == 0)
+			return 0;
+		if (sizeof(buf[0]) == sizeof(VUtils::FaceTopoData))
+			return reinterpret_cast<const VUtils::FaceTopoData*>(&buf[0]);
+
+		VUtils::FaceTopoData *f = _allocate<VUtils::FaceTopoData>(buf.size());
+		for (size_t i=0;i<buf.size();i++)
+		{
+			f[i].v[0] = buf[i][0];
+			f[i].v[1] = buf[i][1];
+			f[i].v[2] = buf[i][2];
+		}
+		return f;
+	}
+
 	void _addParticleData(const Nb::Body*              body)
 	{
 		// grab the shapes
@@ -149,6 +440,17 @@ private:    // Member variables.
 	VRMesh vrm;
 	VRScene vrs;
     Nb::String _fileName;
+    int _debugLevel;
+    int _facesPerVoxel;
+    int _previewFaces;
+    float _fps;
+    bool _reuseTopology;
+
+    std::vector<VRMeshView>       _meshes;
+    std::vector<VRVoxelPartition> _partitions;
+
+    // Converted copies for buffers whose layout differs from V-Ray's.
+    std::list< std::vector<char> > _converted;
 
 };
 
@@ -0,0 +1,259 @@
+// ----------------------------------------------------------------------------
+//
+// emp2vrmesh.cc
+//
+// Copyright (c) 2012 Exotic Matter AB.  All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of Exotic Matter AB nor its contributors may be used to
+//   endorse or promote products derived from this software without specific
+//   prior written permission.
+//
+//    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+//    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,  INCLUDING,  BUT NOT
+//    LIMITED TO,  THE IMPLIED WARRANTIES OF  MERCHANTABILITY AND FITNESS
+//    FOR  A  PARTICULAR  PURPOSE  ARE DISCLAIMED.  IN NO EVENT SHALL THE
+//    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+//    BUT  NOT LIMITED TO,  PROCUREMENT OF SUBSTITUTE GOODS  OR  SERVICES;
+//    LOSS OF USE,  DATA,  OR PROFITS; OR BUSINESS INTERRUPTION)  HOWEVER
+//    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,  STRICT
+//    LIABILITY,  OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)  ARISING IN
+//    ANY  WAY OUT OF THE USE OF  THIS SOFTWARE,  EVEN IF ADVISED OF  THE
+//    POSSIBILITY OF SUCH DAMAGE.
+//
+// ----------------------------------------------------------------------------
+//
+//  Batch converter from a Naiad EMP sequence to V-Ray mesh (vrmesh) proxies.
+//
+//  Frames are distributed over a pool of workers in contiguous runs. Each
+//  worker keeps its own VrayWriter, so when a body keeps its topology from
+//  one frame to the next the voxel partition and index data are reused and
+//  only positions, velocities and other vertex data are rebuilt.
+//
+// ----------------------------------------------------------------------------
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <Nb.h>
+#include <NbBody.h>
+#include <NbEmpReader.h>
+#include <NbFilename.h>
+
+#include "VrayWriter.h"
+
+
+std::string clockString(const double seconds)
+{
+    std::stringstream ss;
+
+    if (60.0 > seconds) {
+        ss << seconds << "s";
+        return ss.str();
+    }
+
+    const int minutes(static_cast<int>(seconds/60.0));
+    ss << minutes << "m " << seconds - 60.0*minutes << "s";
+    return ss.str();
+}
+
+
+// wallTime
+// --------
+//! Seconds since an arbitrary point, wall clock where OpenMP is available.
+//! clock() would sum the CPU time of all workers.
+
+double wallTime()
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return static_cast<double>(std::clock())/CLOCKS_PER_SEC;
+#endif
+}
+
+
+// convertFrame
+// ------------
+//! Writes the body 'bodyName' of one EMP file to one vrmesh file. Returns
+//! false (after printing why) if the frame could not be converted.
+
+bool
+convertFrame(VrayWriter       &writer,
+             const Nb::String &inputPath,
+             const Nb::String &bodyName,
+             const Nb::String &outputPath)
+{
+    Nb::EmpReader empReader(inputPath, bodyName);
+    const Nb::Body *body = empReader.ejectBody(bodyName);
+
+    if (0 == body) {
+        std::cerr
+            << "\nERROR: EMP File '" << inputPath
+            << "' does not contain a body with name '"
+            << bodyName << "'!\n";
+        return false;
+    }
+
+    if (!body->matches("Mesh")) {
+        std::cerr
+            << "\nERROR: The body '" << body->name().c_str()
+            << "' in '" << inputPath << "' does not have a mesh shape!\n";
+        delete body;
+        return false;
+    }
+
+    writer.open(outputPath);
+    writer.write(body, "*", false);
+    writer.close();
+
+    delete body;
+    return true;
+}
+
+
+// main
+// ----
+//! Entry point.
+
+int main( int argc, char *argv[] )
+{
+    try {
+        static const double EMP2VRMESHVERSION(0.1);
+
+        std::cerr << "\nNaiad EMP to V-Ray Mesh Converter" << "\n";
+        std::cerr << "Version " << EMP2VRMESHVERSION << "\n\n";
+
+        if (6 > argc) {
+            std::cerr
+                << "Please supply an input EMP sequence, a bodyName, an "
+                << "output vrmesh sequence and a frame range.\n"
+                << "Optionally also the frame padding (default 4) and the "
+                << "number of workers (default: one per core).\n\n"
+                << "Example: "
+                << "emp2vrmesh in.#.emp Mesh-Liquid out.#.vrmesh 1 100 4 8\n";
+            return 40;
+        }
+
+        // Get arguments from command line, all checked before Naiad is
+        // initialised so that no exit path skips Nb::end().
+
+        const Nb::String argInputSeq(argv[1]);
+        const Nb::String argBodyName(argv[2]);
+        const Nb::String argOutputSeq(argv[3]);
+        const int firstFrame(std::atoi(argv[4]));
+        const int lastFrame(std::atoi(argv[5]));
+        const int padding(7 > argc ? 4 : std::atoi(argv[6]));
+        int workers(8 > argc ? 0 : std::atoi(argv[7]));
+
+        if (lastFrame < firstFrame) {
+            std::cerr << "\nERROR: Empty frame range!\n\n";
+            return 41;
+        }
+
+        const int frameCount(lastFrame - firstFrame + 1);
+        if (0 >= workers) {
+#ifdef _OPENMP
+            workers = omp_get_max_threads();
+#else
+            workers = 1;
+#endif
+        }
+        workers = std::min(workers, frameCount);
+
+        const double clo = wallTime();
+
+        // Initialise Naiad Base API.
+
+        std::cerr << "Initializing Naiad...\n";
+        Nb::begin();
+
+        std::cerr
+            << "Converting body '" << argBodyName << "' of frames "
+            << firstFrame << "-" << lastFrame << " with "
+            << workers << " worker(s)...\n";
+
+        // Each worker converts one contiguous run of frames so that its
+        // writer can carry the voxel partition from frame to frame. The
+        // voxel building inside a worker is only parallel with one worker.
+
+        int failures(0);
+
+#pragma omp parallel num_threads(workers) reduction(+:failures)
+        {
+#ifdef _OPENMP
+            const int w(omp_get_thread_num());
+#else
+            const int w(0);
+#endif
+            const int begin(firstFrame + (frameCount*w)/workers);
+            const int end(firstFrame + (frameCount*(w + 1))/workers);
+
+            VrayWriter writer;
+            writer.setReuseTopology(true);
+
+            for (int frame(begin); frame < end; ++frame) {
+                const Nb::String inputPath(
+                    Nb::sequenceToFilename("", argInputSeq, frame, 0, padding));
+                const Nb::String outputPath(
+                    Nb::sequenceToFilename("", argOutputSeq, frame, 0, padding));
+
+                const double t0(wallTime());
+                bool ok(false);
+                try {
+                    ok = convertFrame(writer, inputPath, argBodyName, outputPath);
+                }
+                catch (const std::exception &ex) {
+#pragma omp critical(emp2vrmeshLog)
+                    std::cerr
+                        << "\nERROR: Frame " << frame << ": "
+                        << ex.what() << "\n";
+                }
+
+                if (!ok) {
+                    ++failures;
+                    continue;
+                }
+
+#pragma omp critical(emp2vrmeshLog)
+                std::cerr
+                    << "Frame " << frame << " -> '" << outputPath << "' ("
+                    << clockString(wallTime() - t0) << ")\n";
+            }
+        }
+
+        std::cerr
+            << "\nDone converting " << (frameCount - failures) << "/"
+            << frameCount << " frames\n"
+            << "Time: " << clockString(wallTime() - clo) << "\n";
+
+        // Shut down Naiad Base API.
+
+        Nb::end();
+
+        return 0 == failures ? 0 : 1;
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "\nERROR: " << ex.what() << "\n\n";
+        std::abort();
+    }
+}